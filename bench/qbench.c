@@ -0,0 +1,390 @@
+/*
+ * @file qbench.c
+ * @brief Microbenchmarks of the scheduler, run by `make bench`.
+ *
+ * Each benchmark prints one JSON object per line on stdout, so results can
+ * be collected and compared across commits:
+ *
+ * - yield: two threads passing the CPU with qscheduler(); one op is one switch.
+ * - yield_to: the same with qthread_yield_to().
+ * - create_join: qthread_create of an empty thread followed by qthread_join.
+ * - scan_ready: N threads yielding round-robin; one op is one switch.
+ * - scan_blocked: two threads yielding while N others are parked on a semaphore.
+ * - memory: resident and reserved bytes per parked thread, for several stack setups.
+ *
+ * Latencies are sampled over short batches of ops (a clock read costs about as
+ * much as a switch), so percentiles are of the mean op time within a batch.
+ * Everything runs on one worker, with the runtime restarted between runs.
+ *
+ * Usage: qbench [benchmark...] (all of them by default).
+ */
+#include "qthread.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/// Ops per latency sample in the switch benchmarks.
+#define BATCH 32
+
+/**
+ * @struct samples_t
+ * @brief Latency samples of one run.
+ */
+typedef struct {
+    uint64_t *ns; ///< Per-op time of each sample, in nanoseconds.
+    size_t count; ///< Samples taken.
+    size_t capacity; ///< Allocated samples.
+} samples_t;
+
+/**
+ * @brief Allocates room for a number of samples.
+ *
+ * @param s Samples to set up.
+ * @param capacity Maximum number of samples.
+ */
+static void samples_init(samples_t *s, size_t capacity) {
+    s->ns = malloc(sizeof(uint64_t) * capacity);
+    if (!s->ns) {
+        perror("malloc");
+        exit(1);
+    }
+    s->count = 0;
+    s->capacity = capacity;
+}
+
+/**
+ * @brief Records the time of one sample.
+ *
+ * @param s Samples.
+ * @param ns Elapsed time of the sample.
+ * @param ops Ops the sample covers.
+ */
+static void samples_add(samples_t *s, uint64_t ns, uint64_t ops) {
+    if (s->count < s->capacity) s->ns[s->count++] = ns / ops;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Returns a percentile of sorted samples.
+ *
+ * @param s Sorted samples.
+ * @param p Percentile, from 0 to 100.
+ */
+static uint64_t percentile(const samples_t *s, double p) {
+    if (!s->count) return 0;
+    size_t i = (size_t)(p / 100.0 * (double)(s->count - 1) + 0.5);
+    return s->ns[i];
+}
+
+/**
+ * @brief Prints the result of a latency benchmark and frees its samples.
+ *
+ * @param name Benchmark name.
+ * @param threads Number of threads involved.
+ * @param ops Total ops run.
+ * @param total_ns Wall time of all ops.
+ * @param s Samples of the run.
+ */
+static void report(const char *name, int threads, uint64_t ops, uint64_t total_ns, samples_t *s) {
+    qsort(s->ns, s->count, sizeof(uint64_t), cmp_u64);
+    printf("{\"bench\":\"%s\",\"threads\":%d,\"ops\":%llu,\"ns_per_op\":%.1f,"
+           "\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}\n",
+           name, threads, (unsigned long long)ops, (double)total_ns / (double)ops,
+           (unsigned long long)percentile(s, 50), (unsigned long long)percentile(s, 90),
+           (unsigned long long)percentile(s, 99), (unsigned long long)percentile(s, 99.9),
+           (unsigned long long)(s->count ? s->ns[s->count - 1] : 0));
+    fflush(stdout);
+    free(s->ns);
+}
+
+/**
+ * @brief Starts a fresh runtime with main() as a thread.
+ */
+static void runtime_start(void) {
+    if (qthread_init() == -1) {
+        fprintf(stderr, "qthread_init failed\n");
+        exit(1);
+    }
+}
+
+/**
+ * @brief Stops the runtime once the benchmark's threads have finished.
+ */
+static void runtime_stop(void) {
+    if (qthread_shutdown() == -1) {
+        fprintf(stderr, "qthread_shutdown failed\n");
+        exit(1);
+    }
+}
+
+// Yield ping-pong
+
+/**
+ * @struct pingpong_t
+ * @brief State shared by the two threads of a ping-pong run.
+ */
+typedef struct {
+    long rounds; ///< Yields each thread makes.
+    int use_yield_to; ///< Whether to switch with qthread_yield_to.
+    thread_t *peer[2]; ///< The two threads.
+    samples_t samples; ///< Filled by thread 0.
+    uint64_t total_ns; ///< Wall time measured by thread 0.
+} pingpong_t;
+
+static pingpong_t pingpong;
+
+/**
+ * @brief Switches to the other ping-pong thread.
+ *
+ * @param id Index of the calling thread.
+ */
+static inline void pingpong_switch(int id) {
+    if (pingpong.use_yield_to) qthread_yield_to(pingpong.peer[!id]);
+    else qscheduler();
+}
+
+static void pingpong_thread(void *arg) {
+    int id = (int)(intptr_t)arg;
+    if (id) {
+        for (long i = 0; i < pingpong.rounds; i++) pingpong_switch(id);
+        return;
+    }
+
+    uint64_t start = qthread_clock_ns(), batch = start;
+    for (long i = 1; i <= pingpong.rounds; i++) {
+        pingpong_switch(id);
+        if (i % BATCH == 0) {
+            uint64_t now = qthread_clock_ns();
+            samples_add(&pingpong.samples, now - batch, 2 * BATCH); // Two switches per round
+            batch = now;
+        }
+    }
+    pingpong.total_ns = qthread_clock_ns() - start;
+}
+
+/**
+ * @brief Runs a ping-pong between two threads.
+ *
+ * @param name Benchmark name.
+ * @param use_yield_to Whether to switch with qthread_yield_to instead of qscheduler.
+ * @param rounds Yields per thread.
+ */
+static void bench_pingpong(const char *name, int use_yield_to, long rounds) {
+    runtime_start();
+    pingpong.rounds = rounds;
+    pingpong.use_yield_to = use_yield_to;
+    samples_init(&pingpong.samples, (size_t)(rounds / BATCH) + 1);
+
+    // Created from main, which the first yield of thread 0 does not involve
+    qthread_create(&pingpong.peer[0], pingpong_thread, (void *)0);
+    qthread_create(&pingpong.peer[1], pingpong_thread, (void *)1);
+    qthread_join(pingpong.peer[0], NULL);
+    qthread_join(pingpong.peer[1], NULL);
+
+    report(name, 2, (uint64_t)(2 * rounds), pingpong.total_ns, &pingpong.samples);
+    runtime_stop();
+}
+
+// Create and join
+
+static void empty_thread(void *arg) {
+    (void)arg;
+}
+
+/**
+ * @brief Creates and joins an empty thread repeatedly.
+ *
+ * @param ops Number of create/join pairs.
+ */
+static void bench_create_join(long ops) {
+    runtime_start();
+    samples_t samples;
+    samples_init(&samples, (size_t)ops);
+
+    uint64_t start = qthread_clock_ns();
+    for (long i = 0; i < ops; i++) {
+        uint64_t t0 = qthread_clock_ns();
+        thread_t *t;
+        if (qthread_create(&t, empty_thread, NULL) == -1) {
+            fprintf(stderr, "qthread_create failed\n");
+            exit(1);
+        }
+        qthread_join(t, NULL);
+        samples_add(&samples, qthread_clock_ns() - t0, 1);
+    }
+    report("create_join", 1, (uint64_t)ops, qthread_clock_ns() - start, &samples);
+    runtime_stop();
+}
+
+// Scheduling cost versus the number of threads
+
+/**
+ * @struct scan_t
+ * @brief State shared by the threads of a scan run (all on one worker).
+ */
+typedef struct {
+    int nthreads; ///< Threads taking part in the measured switches.
+    int started; ///< Threads that reached the start line.
+    long rounds; ///< Yields each of them makes.
+    uint64_t switches; ///< Yields returned from so far, by any thread.
+    uint64_t start_ns; ///< When every thread had started.
+    uint64_t batch_ns; ///< When the current sample started.
+    uint64_t end_ns; ///< When the last thread finished.
+    samples_t samples; ///< One sample per BATCH switches.
+    qthread_sem_t parked; ///< Semaphore the idle threads of scan_blocked wait on.
+} scan_t;
+
+static scan_t scan;
+
+static void scan_thread(void *arg) {
+    (void)arg;
+    scan.started++;
+    while (scan.started < scan.nthreads) qscheduler();
+    if (!scan.start_ns) scan.start_ns = scan.batch_ns = qthread_clock_ns();
+
+    // Every return from a yield ends one switch, whichever thread it resumes
+    for (long i = 0; i < scan.rounds; i++) {
+        qscheduler();
+        if (++scan.switches % BATCH == 0) {
+            uint64_t now = qthread_clock_ns();
+            samples_add(&scan.samples, now - scan.batch_ns, BATCH);
+            scan.batch_ns = now;
+        }
+    }
+    scan.end_ns = qthread_clock_ns();
+}
+
+static void parked_thread(void *arg) {
+    (void)arg;
+    qthread_sem_wait(&scan.parked);
+}
+
+/**
+ * @brief Measures the cost of a switch with many READY or many parked threads.
+ *
+ * @param name Benchmark name.
+ * @param ready Threads yielding round-robin.
+ * @param parked Threads parked on a semaphore meanwhile.
+ * @param switches Total switches to run (approximately).
+ */
+static void bench_scan(const char *name, int ready, int parked, long switches) {
+    runtime_start();
+    thread_t **threads = malloc(sizeof(thread_t *) * (size_t)(ready + parked));
+    if (!threads) {
+        perror("malloc");
+        exit(1);
+    }
+
+    memset(&scan, 0, sizeof(scan));
+    scan.nthreads = ready;
+    scan.rounds = switches / ready;
+    samples_init(&scan.samples, (size_t)(switches / BATCH) + 1);
+    qthread_sem_init(&scan.parked, 0);
+
+    for (int i = 0; i < parked; i++) qthread_create(&threads[ready + i], parked_thread, NULL);
+    qscheduler(); // Let them park before the measured threads start
+    for (int i = 0; i < ready; i++) qthread_create(&threads[i], scan_thread, NULL);
+    for (int i = 0; i < ready; i++) qthread_join(threads[i], NULL);
+
+    report(name, ready + parked, scan.switches, scan.end_ns - scan.start_ns, &scan.samples);
+
+    for (int i = 0; i < parked; i++) qthread_sem_post(&scan.parked);
+    for (int i = 0; i < parked; i++) qthread_join(threads[ready + i], NULL);
+    free(threads);
+    runtime_stop();
+}
+
+// Memory per thread
+
+/**
+ * @brief Returns the resident set size of the process.
+ *
+ * @return Resident bytes, or 0 if /proc is not available.
+ */
+static uint64_t rss_bytes(void) {
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    unsigned long size, resident = 0;
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2) resident = 0;
+    fclose(f);
+    return (uint64_t)resident * (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * @brief Measures the memory of threads parked after a shallow call.
+ *
+ * @param label Stack setup being measured.
+ * @param nthreads Threads to park.
+ * @param stack_size Stack size of the threads.
+ * @param use_mmap Whether stacks are mmap'd with a guard page.
+ */
+static void bench_memory(const char *label, int nthreads, size_t stack_size, int use_mmap) {
+    qthread_set_stacksize(stack_size);
+    qthread_set_stack_mmap(use_mmap);
+    runtime_start();
+    thread_t **threads = malloc(sizeof(thread_t *) * (size_t)nthreads);
+    if (!threads) {
+        perror("malloc");
+        exit(1);
+    }
+    memset(&scan, 0, sizeof(scan));
+    qthread_sem_init(&scan.parked, 0);
+
+    uint64_t before = rss_bytes();
+    for (int i = 0; i < nthreads; i++) qthread_create(&threads[i], parked_thread, NULL);
+    qscheduler(); // Run each of them up to its wait
+    uint64_t after = rss_bytes();
+
+    printf("{\"bench\":\"memory\",\"stacks\":\"%s\",\"threads\":%d,\"stack_size\":%zu,"
+           "\"reserved_bytes_per_thread\":%zu,\"rss_bytes_per_thread\":%.0f}\n",
+           label, nthreads, stack_size, stack_size + sizeof(thread_t),
+           (double)(after > before ? after - before : 0) / nthreads);
+    fflush(stdout);
+
+    for (int i = 0; i < nthreads; i++) qthread_sem_post(&scan.parked);
+    for (int i = 0; i < nthreads; i++) qthread_join(threads[i], NULL);
+    free(threads);
+    runtime_stop();
+    qthread_set_stacksize(DEFAULT_STACK_SIZE);
+    qthread_set_stack_mmap(0);
+}
+
+/**
+ * @brief Tells whether a benchmark was selected on the command line.
+ *
+ * @param name Benchmark name.
+ * @param argc Argument count.
+ * @param argv Arguments; none selects everything.
+ */
+static int selected(const char *name, int argc, char **argv) {
+    if (argc < 2) return 1;
+    for (int i = 1; i < argc; i++)
+        if (!strcmp(argv[i], name)) return 1;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (selected("yield", argc, argv)) bench_pingpong("yield", 0, 1000000);
+    if (selected("yield_to", argc, argv)) bench_pingpong("yield_to", 1, 1000000);
+    if (selected("create_join", argc, argv)) bench_create_join(200000);
+
+    static const int counts[] = { 2, 16, 256, 4096 };
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        if (selected("scan_ready", argc, argv)) bench_scan("scan_ready", counts[i], 0, 2000000);
+        if (selected("scan_blocked", argc, argv))
+            bench_scan("scan_blocked", 2, counts[i] - 2, 2000000);
+    }
+
+    if (selected("memory", argc, argv)) {
+        bench_memory("malloc", 10000, DEFAULT_STACK_SIZE, 0);
+        bench_memory("mmap", 10000, DEFAULT_STACK_SIZE, 1);
+        bench_memory("mmap", 10000, 1024 * 1024, 1);
+    }
+    return 0;
+}
@@ -0,0 +1,129 @@
+/**
+ * @file echo.c
+ * @brief TCP echo server and clients multiplexed on user-level threads.
+ *
+ * A server thread accepts connections on a loopback port and starts one
+ * thread per connection that echoes everything back. Client threads connect,
+ * send a few messages and check the replies. Every socket is non-blocking;
+ * qthread_read, qthread_write, qthread_accept and qthread_connect park the
+ * calling thread in the scheduler's epoll reactor until the socket is ready,
+ * so a single kernel thread serves all of them.
+ */
+#include "qthread.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NUM_CLIENTS 8
+#define NUM_MESSAGES 4
+
+/// Address the server listens on.
+static struct sockaddr_in server_addr;
+
+/// Listening socket.
+static int listen_fd;
+
+/**
+ * @brief Echoes a connection until the peer closes it.
+ *
+ * @param arg The connected socket.
+ */
+void echo_connection(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    char buf[256];
+    ssize_t n;
+
+    while ((n = qthread_read(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t w = qthread_write(fd, buf + off, n - off);
+            if (w < 0) break;
+            off += w;
+        }
+    }
+    close(fd);
+}
+
+/**
+ * @brief Accepts one connection per client and hands each to a new thread.
+ *
+ * @param arg Unused.
+ */
+void server(void *arg) {
+    (void)arg;
+    for (int i = 0; i < NUM_CLIENTS; i++) {
+        int fd = qthread_accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            perror("accept");
+            exit(EXIT_FAILURE);
+        }
+        qthread_create(NULL, echo_connection, (void *)(intptr_t)fd);
+    }
+}
+
+/**
+ * @brief Sends messages to the server and checks the echoed replies.
+ *
+ * @param arg Index of the client.
+ */
+void client(void *arg) {
+    int id = (int)(intptr_t)arg;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+    if (qthread_connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr))) {
+        perror("connect");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < NUM_MESSAGES; i++) {
+        char msg[64], reply[64];
+        int len = snprintf(msg, sizeof(msg), "client %d message %d", id, i);
+        qthread_write(fd, msg, len);
+
+        int got = 0;
+        while (got < len) {
+            ssize_t n = qthread_read(fd, reply + got, len - got);
+            if (n <= 0) break;
+            got += n;
+        }
+        if (got != len || memcmp(msg, reply, len)) {
+            fprintf(stderr, "client %d: bad echo\n", id);
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("Client %d: %d messages echoed\n", id, NUM_MESSAGES);
+    close(fd);
+}
+
+/**
+ * @brief Main function: listens on a loopback port and runs the server and clients.
+ *
+ * @return int Returns 0 on successful execution.
+ */
+int main(void) {
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server_addr.sin_port = 0; // Any free port
+
+    socklen_t len = sizeof(server_addr);
+    if (bind(listen_fd, (struct sockaddr *)&server_addr, len) ||
+        listen(listen_fd, NUM_CLIENTS) ||
+        getsockname(listen_fd, (struct sockaddr *)&server_addr, &len)) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+
+    thread_t *threads[NUM_CLIENTS + 1];
+    qthread_create(&threads[0], server, NULL);
+    for (int i = 0; i < NUM_CLIENTS; i++)
+        qthread_create(&threads[i + 1], client, (void *)(intptr_t)i);
+
+    for (int i = 0; i <= NUM_CLIENTS; i++)
+        qthread_join(threads[i], NULL);
+
+    close(listen_fd);
+    printf("All clients served.\n");
+    return 0;
+}
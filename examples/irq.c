@@ -6,6 +6,8 @@
  * A dedicated thread is created that runs an infinite loop. Every second, it randomly selects
  * one of several interrupt service routines (ISRs) corresponding to different hardware events:
  * keyboard, mouse, timer, and audio. The ISR is then invoked to handle the simulated interrupt.
+ * The simulator runs at the highest priority, so it preempts a batch thread that keeps the
+ * worker busy in the meantime, the way a real interrupt cuts into whatever the CPU was doing.
  */
 
 /**
@@ -20,7 +22,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "qthread.h"
-#include <unistd.h>
 #include <time.h>
 
 #define NUM_IRQ 4
@@ -91,42 +92,67 @@ void (*IRS_vector[NUM_IRQ]) (int) = {
     ISR_AUDIO
 };
 
+/// Units of background work done so far.
+static unsigned long batch_work;
+
+/**
+ * @brief Low-priority thread that keeps the worker busy between interrupts.
+ *
+ * @param arg Unused parameter.
+ */
+void batch_job(void * /* arg */) {
+    while (1) {
+        batch_work++;
+        qscheduler();
+    }
+}
+
 /**
  * @brief Thread function that simulates hardware interrupts.
  *
  * This function is executed by a dedicated thread. It initializes the random number generator
  * and enters an infinite loop. Every second, it selects a random interrupt from the available
- * interrupts and calls the corresponding ISR.
+ * interrupts and calls the corresponding ISR. qthread_sleep_until parks the thread on the
+ * scheduler's timer wheel rather than blocking the kernel thread; when it wakes, its priority
+ * lets it run ahead of the batch job, and it reports how late it was.
  *
  * @param arg Unused parameter.
  */
 void interrupt_simulator(void * /* arg */) {
     srand(time(NULL));
 
+    uint64_t deadline = qthread_clock_ns();
     while (1) {
-        sleep(1);
+        deadline += 1000000000ULL;
+        qthread_sleep_until(deadline);
         int irq_number = rand() % NUM_IRQ;
         IRS_vector[irq_number](irq_number);
+        printf("  latency %lu us, batch work done %lu\n",
+               (unsigned long)((qthread_clock_ns() - deadline) / 1000), batch_work);
     }
 }
 
 /**
  * @brief Main function demonstrating interrupt simulation.
  *
- * The main function creates a thread that runs the interrupt simulator and then starts
- * the thread scheduler. The program will continue to simulate interrupts indefinitely.
+ * The main function creates the batch job at the lowest priority and a thread that runs
+ * the interrupt simulator at the highest, then joins the simulator, running the scheduler
+ * meanwhile. The program will continue to simulate interrupts indefinitely.
  *
  * @return int Returns 0 on successful execution.
  */
 int main(void) {
-    thread_t *thread;
+    thread_t *thread, *batch;
 
-    if (qthread_create(&thread, interrupt_simulator, NULL)) {
+    if (qthread_create(&batch, batch_job, NULL) ||
+        qthread_create(&thread, interrupt_simulator, NULL)) {
         fprintf(stderr, "Error creating thread\n");
         exit(EXIT_FAILURE);
     }
+    qthread_set_priority(batch, 0);
+    qthread_set_priority(thread, QTHREAD_PRIO_MAX);
 
-    qscheduler();
+    qthread_join(thread, NULL);
 
     return 0;
 }
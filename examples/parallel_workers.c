@@ -0,0 +1,69 @@
+/**
+ * @file parallel_workers.c
+ * @brief Runs CPU-bound threads on several worker kernel threads.
+ *
+ * The runtime is configured with four workers. Main creates sixteen threads,
+ * each summing a slice of a range; idle workers steal threads from the queue
+ * of the worker that created them, so the slices are computed in parallel.
+ */
+#include "qthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define NUM_WORKERS 4
+#define NUM_THREADS 16
+#define SLICE 10000000ULL
+
+/**
+ * @brief Sums the integers of one slice and returns the result.
+ *
+ * The thread yields every million iterations so threads sharing a worker
+ * make progress together.
+ *
+ * @param arg Index of the slice.
+ */
+void sum_slice(void *arg) {
+    uint64_t index = (uint64_t)(uintptr_t)arg;
+    uint64_t *sum = malloc(sizeof(uint64_t));
+    *sum = 0;
+
+    for (uint64_t i = index * SLICE; i < (index + 1) * SLICE; i++) {
+        *sum += i;
+        if (i % 1000000 == 0) qscheduler();
+    }
+    qthread_exit(sum);
+}
+
+/**
+ * @brief Main function: spreads the slices over the workers and adds the results.
+ *
+ * @return int Returns 0 on successful execution.
+ */
+int main(void) {
+    qthread_set_concurrency(NUM_WORKERS);
+
+    thread_t *threads[NUM_THREADS];
+    for (uint64_t i = 0; i < NUM_THREADS; i++) {
+        if (qthread_create(&threads[i], sum_slice, (void *)(uintptr_t)i)) {
+            fprintf(stderr, "Error creating thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    uint64_t total = 0;
+    for (int i = 0; i < NUM_THREADS; i++) {
+        void *sum;
+        if (qthread_join(threads[i], &sum)) {
+            fprintf(stderr, "Error joining thread\n");
+            exit(EXIT_FAILURE);
+        }
+        total += *(uint64_t *)sum;
+        free(sum);
+    }
+
+    uint64_t n = NUM_THREADS * SLICE;
+    printf("Sum of 0..%llu = %llu (expected %llu)\n", (unsigned long long)(n - 1),
+           (unsigned long long)total, (unsigned long long)(n * (n - 1) / 2));
+    return 0;
+}
@@ -0,0 +1,109 @@
+/**
+ * @file pipeline.c
+ * @brief Pipeline of threads connected by channels.
+ *
+ * A generator feeds numbers through a rendezvous channel to a pool of
+ * squarers, which pass their results on a buffered channel. A collector
+ * selects between the results and a control channel on which main asks for
+ * progress reports, and hands the total back on an unbounded channel. Main
+ * itself runs outside any thread and uses select timeouts to wait.
+ */
+#include "qthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NUM_WORKERS 2
+#define NUM_SQUARERS 4
+#define COUNT 10000
+
+static qthread_chan_t numbers, squares, control, reports;
+
+/**
+ * @brief Sends 1..COUNT, then closes the channel.
+ *
+ * @param arg Unused.
+ */
+void generator(void *arg) {
+    (void)arg;
+    for (long i = 1; i <= COUNT; i++)
+        qthread_chan_send(&numbers, &i);
+    qthread_chan_close(&numbers);
+}
+
+/**
+ * @brief Squares numbers until the generator is done.
+ *
+ * @param arg Unused.
+ */
+void squarer(void *arg) {
+    (void)arg;
+    long n;
+    while (qthread_chan_recv(&numbers, &n) == 0) {
+        long sq = n * n;
+        qthread_chan_send(&squares, &sq);
+    }
+}
+
+/**
+ * @brief Sums the squares, answering progress requests on the way.
+ *
+ * @param arg Unused.
+ */
+void collector(void *arg) {
+    (void)arg;
+    long sq, sum = 0, received = 0, request;
+    qthread_select_case_t cases[] = {
+        { &squares, QTHREAD_CHAN_RECV, &sq, 0 },
+        { &control, QTHREAD_CHAN_RECV, &request, 0 },
+    };
+
+    while (received < COUNT) {
+        if (qthread_select(cases, 2, UINT64_MAX) == 0) {
+            sum += sq;
+            received++;
+        } else {
+            qthread_chan_send(&reports, &received);
+        }
+    }
+    qthread_chan_send(&reports, &sum);
+    qthread_chan_close(&reports);
+}
+
+/**
+ * @brief Main function: runs the pipeline and checks the sum of squares.
+ *
+ * @return int Returns 0 on successful execution.
+ */
+int main(void) {
+    qthread_set_concurrency(NUM_WORKERS);
+    qthread_chan_init(&numbers, sizeof(long), 0);
+    qthread_chan_init(&squares, sizeof(long), 64);
+    qthread_chan_init(&control, sizeof(long), 1);
+    qthread_chan_init(&reports, sizeof(long), QTHREAD_CHAN_UNBOUNDED);
+
+    thread_t *threads[NUM_SQUARERS + 2];
+    qthread_create(&threads[0], generator, NULL);
+    for (int i = 0; i < NUM_SQUARERS; i++)
+        qthread_create(&threads[1 + i], squarer, NULL);
+    qthread_create(&threads[NUM_SQUARERS + 1], collector, NULL);
+
+    // Ask for one progress report, then wait for the rest with a timeout
+    long request = 1, value, last = 0;
+    qthread_chan_send(&control, &request);
+    qthread_select_case_t wait[] = { { &reports, QTHREAD_CHAN_RECV, &value, 0 } };
+    while (qthread_select(wait, 1, qthread_clock_ns() + 1000000000ULL) == 0 && wait[0].ok) {
+        if (last) printf("Progress report: %ld squares received\n", last);
+        last = value;
+    }
+
+    for (int i = 0; i < NUM_SQUARERS + 2; i++)
+        qthread_join(threads[i], NULL);
+    qthread_chan_destroy(&numbers);
+    qthread_chan_destroy(&squares);
+    qthread_chan_destroy(&control);
+    qthread_chan_destroy(&reports);
+
+    long expected = (long)COUNT * (COUNT + 1) * (2 * COUNT + 1) / 6;
+    printf("Sum of squares: %ld (expected %ld)\n", last, expected);
+    return last == expected ? EXIT_SUCCESS : EXIT_FAILURE;
+}
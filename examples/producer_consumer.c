@@ -0,0 +1,105 @@
+/**
+ * @file producer_consumer.c
+ * @brief Bounded buffer shared by producer and consumer threads.
+ *
+ * Producers and consumers meet on a ring buffer guarded by a mutex, parking
+ * on condition variables while it is full or empty instead of polling it
+ * through qscheduler(). A semaphore counts the items each consumer handled,
+ * and main waits on it with a timeout before joining the threads.
+ */
+#include "qthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NUM_WORKERS 2
+#define NUM_PRODUCERS 3
+#define NUM_CONSUMERS 3
+#define ITEMS_PER_PRODUCER 1000
+#define CAPACITY 8
+
+static int buffer[CAPACITY];
+static int head, count, producers_left = NUM_PRODUCERS;
+static qthread_mutex_t lock = QTHREAD_MUTEX_INITIALIZER;
+static qthread_cond_t not_full = QTHREAD_COND_INITIALIZER;
+static qthread_cond_t not_empty = QTHREAD_COND_INITIALIZER;
+static qthread_sem_t handled = QTHREAD_SEM_INITIALIZER(0);
+
+/**
+ * @brief Puts ITEMS_PER_PRODUCER numbers into the buffer.
+ *
+ * @param arg Unused.
+ */
+void producer(void *arg) {
+    (void)arg;
+    for (int i = 1; i <= ITEMS_PER_PRODUCER; i++) {
+        qthread_mutex_lock(&lock);
+        while (count == CAPACITY)
+            qthread_cond_wait(&not_full, &lock);
+        buffer[(head + count++) % CAPACITY] = i;
+        qthread_cond_signal(&not_empty);
+        qthread_mutex_unlock(&lock);
+    }
+
+    qthread_mutex_lock(&lock);
+    if (--producers_left == 0)
+        qthread_cond_broadcast(&not_empty); // Let the consumers see the end
+    qthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief Takes numbers out of the buffer until the producers are done.
+ *
+ * @param arg Receives a heap-allocated sum of the numbers taken.
+ */
+void consumer(void *arg) {
+    long *sum = arg;
+    for (;;) {
+        qthread_mutex_lock(&lock);
+        while (count == 0 && producers_left > 0)
+            qthread_cond_wait(&not_empty, &lock);
+        if (count == 0) {
+            qthread_mutex_unlock(&lock);
+            break;
+        }
+        *sum += buffer[head];
+        head = (head + 1) % CAPACITY;
+        count--;
+        qthread_cond_signal(&not_full);
+        qthread_mutex_unlock(&lock);
+        qthread_sem_post(&handled);
+    }
+}
+
+/**
+ * @brief Main function: runs the pipeline and checks that nothing was lost.
+ *
+ * @return int Returns 0 on successful execution.
+ */
+int main(void) {
+    qthread_set_concurrency(NUM_WORKERS);
+
+    thread_t *threads[NUM_PRODUCERS + NUM_CONSUMERS];
+    long sums[NUM_CONSUMERS] = {0};
+    for (int i = 0; i < NUM_PRODUCERS; i++)
+        qthread_create(&threads[i], producer, NULL);
+    for (int i = 0; i < NUM_CONSUMERS; i++)
+        qthread_create(&threads[NUM_PRODUCERS + i], consumer, &sums[i]);
+
+    // Count the handled items as they come, giving up after a second of silence
+    int items = 0;
+    while (items < NUM_PRODUCERS * ITEMS_PER_PRODUCER &&
+           qthread_sem_timedwait(&handled, qthread_clock_ns() + 1000000000ULL) == 0)
+        items++;
+
+    long total = 0;
+    for (int i = 0; i < NUM_PRODUCERS + NUM_CONSUMERS; i++)
+        qthread_join(threads[i], NULL);
+    for (int i = 0; i < NUM_CONSUMERS; i++) {
+        printf("Consumer %d took items summing to %ld\n", i, sums[i]);
+        total += sums[i];
+    }
+
+    long expected = (long)NUM_PRODUCERS * ITEMS_PER_PRODUCER * (ITEMS_PER_PRODUCER + 1) / 2;
+    printf("%d items handled, total %ld (expected %ld)\n", items, total, expected);
+    return total == expected ? EXIT_SUCCESS : EXIT_FAILURE;
+}
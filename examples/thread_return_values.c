@@ -38,32 +38,22 @@ void worker_thread(void *arg) {
  * @brief Main function demonstrating the custom threading library.
  *
  * This function performs the following steps:
- * 1. Incorporates the main thread into the scheduler's thread list.
- * 2. Creates 5 worker threads.
- * 3. Starts the scheduler to execute the worker threads.
- * 4. After all workers have completed, it collects and prints their return values.
- *
- * The main thread is added to the thread list so that the scheduler can return control
- * back to it once all the worker threads finish executing.
+ * 1. Registers main() as the main thread and creates 5 worker threads.
+ * 2. Joins each worker, parking main() while the workers run, and prints its return value.
+ * 3. Shuts the runtime down once every worker has completed.
  *
  * @return int Returns 0 upon successful execution.
  */
 int main() {
-    // 1. Incorporate the main thread into the thread list.
-    thread_t main_thread;
-    if (getcontext(&main_thread.context) == -1) {
-        perror("getcontext");
-        exit(EXIT_FAILURE);
-    }
-    main_thread.state = READY;
-    main_thread.stack = NULL;          // The main thread uses the standard process stack.
-    main_thread.next = &main_thread;     // Initially, it is the only thread in the circular list.
-    thread_list = &main_thread;
-
     // Set a smaller stack size for demonstration purposes.
     qthread_set_stacksize(64 * 1024);
 
-    // 2. Create 5 worker threads.
+    if (qthread_init() == -1) {
+        fprintf(stderr, "qthread_init failed\n");
+        return 1;
+    }
+
+    // 1. Create 5 worker threads.
     thread_t *workers[5];
     for (int i = 0; i < 5; i++) {
         int *id = malloc(sizeof(int));
@@ -71,14 +61,13 @@ int main() {
         qthread_create(&workers[i], worker_thread, id);
     }
 
-    // 3. Start the scheduler to execute the worker threads.
-    // When there are no more READY threads, control will return to the main thread.
-    qscheduler();
-
-    // 4. Collect the results from each worker thread.
+    // 2. Collect the results from each worker thread.
     for (int i = 0; i < 5; i++) {
         void *retval;
-        qthread_join(workers[i], &retval);
+        if (qthread_join(workers[i], &retval) == -1) {
+            fprintf(stderr, "qthread_join failed\n");
+            return 1;
+        }
         
         if ((intptr_t)retval == 0xDEADBEEF) {
             printf("Thread %d: ERROR\n", i+1);
@@ -88,6 +77,9 @@ int main() {
         }
     }
 
+    // 3. Stop the runtime.
+    qthread_shutdown();
+
     printf("All workers completed\n");
     return 0;
 }
@@ -3,7 +3,9 @@
  * @brief Custom lightweight threading library using user-level threads.
  *
  * This library provides basic threading functionalities such as thread creation,
- * scheduling, and joining using user-level threads implemented with `ucontext.h`.
+ * scheduling, and joining using user-level threads. Context switches use a small
+ * assembly routine on x86-64 and aarch64 and fall back to `ucontext.h` elsewhere
+ * (or when built with QTHREAD_UCONTEXT defined).
  *
  * @author ginozza
  * @date 2025
@@ -11,31 +13,128 @@
 #ifndef QTHREAD_H
 #define QTHREAD_H
 
-#include <ucontext.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// The library is built with -fvisibility=hidden: only what this header declares is exported
+#pragma GCC visibility push(default)
 
 /// Default stack size for threads (modifiable with qthread_set_stacksize)
 #define DEFAULT_STACK_SIZE (64 * 1024)
 
+/// Number of scheduling priority levels.
+#define QTHREAD_PRIO_LEVELS 64
+
+/// Most urgent priority.
+#define QTHREAD_PRIO_MAX (QTHREAD_PRIO_LEVELS - 1)
+
+/// Priority of new threads.
+#define QTHREAD_PRIO_DEFAULT 32
+
+/// Default upper bound on stack memory kept for reuse (modifiable with qthread_set_stack_cache_limit)
+#define DEFAULT_STACK_CACHE_LIMIT (32 * 1024 * 1024)
+
+/// Default resident bytes kept at the top of a cached mmap'd stack (modifiable with qthread_set_stack_hot_size)
+#define DEFAULT_STACK_HOT_SIZE (32 * 1024)
+
+#if !defined(QTHREAD_UCONTEXT) && defined(__ELF__) && \
+    (defined(__x86_64__) || defined(__aarch64__))
+#define QTHREAD_CTX_ASM 1
+
+/**
+ * @struct qthread_context_t
+ * @brief Saved execution context; callee-saved registers live on the thread's stack.
+ */
+typedef struct {
+    void *sp; ///< Stack pointer at the time the context was saved.
+} qthread_context_t;
+#else
+#define QTHREAD_CTX_ASM 0
+#include <ucontext.h>
+
+/// Saved execution context (portable ucontext fallback).
+typedef ucontext_t qthread_context_t;
+#endif
+
+/**
+ * @struct qthread_spinlock_t
+ * @brief Lock word used by the scheduler to guard thread and wait list state.
+ */
+typedef struct {
+    int locked; ///< Nonzero while held.
+} qthread_spinlock_t;
+
 /**
  * @enum thread_state
  * @brief Represents the state of a thread.
  */
-typedef enum { READY, RUNNING, FINISHED } thread_state;
+typedef enum {
+    READY,    ///< Waiting in the ready queue.
+    RUNNING,  ///< Currently executing.
+    BLOCKED,  ///< Waiting on an event; not in the ready queue.
+    FINISHED  ///< Exited; waiting to be joined.
+} thread_state;
+
+struct qtimer;
+
+/**
+ * @struct qthread_stats_t
+ * @brief Scheduling statistics of a thread, or summed over all threads.
+ *
+ * Only tracked in builds with QTHREAD_STATS defined (`make STATS=1`).
+ */
+typedef struct {
+    uint64_t switches; ///< Times switched in.
+    uint64_t yields; ///< Times switched out READY on the thread's own call (qscheduler, qthread_yield_to).
+    uint64_t preemptions; ///< Times switched out READY by a preemption tick or a more urgent thread.
+    uint64_t run_ns; ///< Time spent RUNNING.
+    uint64_t ready_ns; ///< Time spent READY, waiting for a worker.
+    uint64_t blocked_ns; ///< Time spent BLOCKED.
+} qthread_stats_t;
 
 /**
  * @struct thread
  * @brief Structure representing a user-level thread.
  */
 typedef struct thread {
-    ucontext_t context; ///< Thread execution context.
+    qthread_context_t context; ///< Thread execution context.
     void *stack; ///< Pointer to allocated stack memory.
+    size_t stack_size; ///< Size of the stack in bytes.
+    size_t mapping_size; ///< Length of the mapping holding a guarded stack (0 if malloc'd).
+    void (*start_routine)(void *); ///< Function executed by the thread.
+    void *arg; ///< Argument passed to start_routine.
     thread_state state; ///< Current state of the thread.
     struct thread *next; ///< Pointer to the next thread in the circular list.
+    struct thread *prev; ///< Pointer to the previous thread in the circular list.
+    struct thread *run_next; ///< Next thread in the global ready queue.
     void *retval; ///< Return value for the thread (used by qthread_join).
+    qthread_spinlock_t lock; ///< Guards state changes to FINISHED and the joiner list; held while parking in qthread_select without a deadline.
+    struct thread *joiners; ///< Threads blocked in qthread_join on this thread.
+    struct thread *wait_next; ///< Next thread in the wait list this thread is blocked on.
+    struct qtimer *wait_timer; ///< Timeout of the current wait on a synchronization object (NULL if none).
+    int wait_status; ///< How the current wait ended; claimed by the first waker or the timeout.
+    int pending_joins; ///< Joiners that have not resumed yet.
+    int outside_joins; ///< Joiners running outside any thread (driving the scheduler).
+    int preempt_disabled; ///< Nesting depth of qthread_preempt_disable.
+    int priority; ///< Scheduling priority (0 to QTHREAD_PRIO_MAX, higher runs first).
+    uint64_t sched_key; ///< Ordering key of key-ordered policies (fair-share pass, CFS virtual runtime).
+    int sched_index; ///< Slot in a policy's heap while queued there (-1 otherwise).
+    void *sched_rq; ///< Policy instance whose pairing heap holds the thread (NULL otherwise).
+    struct thread *heap_child; ///< First child in a pairing heap.
+    struct thread *heap_next; ///< Next sibling in a pairing heap.
+    struct thread *heap_prev; ///< Previous sibling in a pairing heap, or the parent of a first child.
+    uint64_t deadline; ///< Absolute qthread_clock_ns() time the thread should be done by (0 = none).
+    int deadline_missed; ///< Whether the current deadline was already reported as missed.
+    uint64_t hist_ready; ///< qthread_clock_ns() time the thread became READY, for the latency histograms (0 if not READY).
+    uint64_t hist_run; ///< Time the thread was last switched in, for the slice histograms.
+    qthread_stats_t stats; ///< Scheduling statistics, up to the last switch (zero unless built with QTHREAD_STATS).
+    uint64_t stats_since; ///< qthread_clock_ns() time of the last switch in or out (or creation).
+    uint64_t stats_woken; ///< Time the thread was woken from BLOCKED since then (0 if not).
 } thread_t;
 
-// Global circular linked list head for thread management.
+// Global circular doubly linked list head for thread management.
 extern thread_t *thread_list;
 
 /**
@@ -47,6 +146,573 @@ extern thread_t *thread_list;
  */
 void qthread_set_stacksize(size_t size);
 
+/**
+ * @brief Selects mmap'd stacks with a guard page for newly created threads.
+ *
+ * Stacks are reserved with mmap below a PROT_NONE guard page and committed on
+ * demand, so a large stack size only costs the pages a thread touches.
+ * Should be called before creating threads.
+ *
+ * @param enable Nonzero to use mmap'd stacks, 0 for malloc'd stacks (default).
+ */
+void qthread_set_stack_mmap(int enable);
+
+/**
+ * @brief Sets how much of a cached mmap'd stack stays resident.
+ *
+ * When a guarded stack returns to the cache, the pages below its top `bytes`
+ * are released with madvise(MADV_DONTNEED).
+ *
+ * @param bytes Resident bytes kept per cached stack.
+ */
+void qthread_set_stack_hot_size(size_t bytes);
+
+/**
+ * @brief Sets the maximum amount of stack memory cached for reuse.
+ *
+ * Joined threads return their descriptor and stack to a cache bucketed by
+ * stack size; qthread_create reuses them before allocating. Cached stacks
+ * above the new limit are released immediately.
+ *
+ * @param bytes Maximum cached stack bytes (0 disables the cache).
+ */
+void qthread_set_stack_cache_limit(size_t bytes);
+
+/**
+ * @brief Releases cached stacks until at most `keep` bytes remain cached.
+ *
+ * @param keep Cached stack bytes to retain.
+ * @return Number of stack bytes released.
+ */
+size_t qthread_stack_cache_trim(size_t keep);
+
+/**
+ * @brief Sets the number of worker kernel threads that run qthreads.
+ *
+ * Threads are multiplexed M:N onto this many kernel threads, each with its own
+ * run queue; idle workers steal work from busy ones. The kernel thread that
+ * creates the first qthread is worker 0 and runs threads whenever it calls
+ * into the scheduler. Must be called before creating threads (default 1).
+ *
+ * @param workers Number of workers.
+ */
+void qthread_set_concurrency(int workers);
+
+/**
+ * @brief Enables time-slice preemption.
+ *
+ * Each worker gets a timer on its CPU-time clock; a thread that runs for a
+ * whole quantum without yielding is switched out for the next READY thread.
+ * The switch happens from a signal handler, so code that is not
+ * async-signal-safe (malloc, stdio, ...) should run between
+ * qthread_preempt_disable and qthread_preempt_enable, or the thread should
+ * yield on its own. Must be called before creating threads.
+ *
+ * @param quantum Time slice in microseconds (0 disables preemption, the default).
+ * @return 0 on success, -1 if threads already exist or the platform lacks support.
+ */
+int qthread_set_preemption(unsigned int quantum);
+
+/**
+ * @brief Disables preemption of the calling thread (calls nest).
+ */
+void qthread_preempt_disable(void);
+
+/**
+ * @brief Re-enables preemption of the calling thread.
+ *
+ * If the time slice expired meanwhile, the thread yields immediately.
+ */
+void qthread_preempt_enable(void);
+
+/**
+ * @struct qthread_policy_t
+ * @brief Scheduling policy: how each worker orders its READY threads.
+ *
+ * Every worker keeps its own instance of the policy, created by init and
+ * passed to the other hooks as rq. The scheduler keeps what is common to all
+ * policies: the next slot of threads handed the CPU by a waker, the global
+ * queue of threads made READY outside the runtime, stealing between workers
+ * and idling. enqueue, pick_next, remove and the notifications run on the
+ * instance's own worker; steal and has_work may run on any worker at the
+ * same time, so an instance guards the state they touch. Hooks run with
+ * preemption disabled and must not block. Optional hooks may be NULL.
+ */
+typedef struct qthread_policy {
+    const char *name; ///< Name of the policy.
+    void *(*init)(void); ///< Allocates a worker's instance (NULL on failure).
+    void (*fini)(void *rq); ///< Frees an empty instance at shutdown (optional, default free).
+    int (*enqueue)(void *rq, thread_t *t); ///< Queues a READY thread; -1 if full (it goes to the global queue).
+    thread_t *(*pick_next)(void *rq); ///< Dequeues the thread to run next, or NULL.
+    thread_t *(*steal)(void *rq, void *victim); ///< Dequeues a thread from a peer's instance for the idle rq (optional).
+    int (*has_work)(void *rq); ///< Whether any thread is queued.
+    int (*remove)(void *rq, thread_t *t); ///< Takes a given thread out; 1 if it was queued there (optional).
+    int (*before)(thread_t *a, thread_t *b); ///< Whether a must run before b (optional, default never).
+    void (*on_yield)(void *rq, thread_t *t); ///< t is leaving the CPU and stays READY (optional).
+    void (*on_block)(void *rq, thread_t *t); ///< t is leaving the CPU to wait or exit (optional).
+    void (*on_wake)(void *rq, thread_t *t); ///< t is READY after creation or a wait, not queued yet (optional).
+    void (*on_run)(void *rq, thread_t *t); ///< t is about to run on rq's worker (optional).
+    int (*tick)(void *rq, thread_t *t); ///< Time slice of t ended; nonzero switches it out (optional, default yes).
+} qthread_policy_t;
+
+/// Round-robin over all READY threads, ignoring priorities.
+extern const qthread_policy_t qthread_policy_rr;
+
+/// Strict priorities with FIFO order within a level (the default).
+extern const qthread_policy_t qthread_policy_prio;
+
+/// CPU slices in proportion to priority + 1 (stride scheduling).
+extern const qthread_policy_t qthread_policy_fair;
+
+/// CPU time in proportion to a weight per priority, tracked as virtual runtime.
+extern const qthread_policy_t qthread_policy_cfs;
+
+/// Earliest deadline first, then round-robin over threads without a deadline.
+extern const qthread_policy_t qthread_policy_edf;
+
+/**
+ * @brief Installs the scheduling policy of every worker.
+ *
+ * before ranks threads for the scheduler: a woken thread that must run
+ * before the running one preempts it, a yielding thread that must run before
+ * the next candidate keeps the CPU, and a woken thread that the waker must
+ * run before is queued instead of taking the next slot. Must be called
+ * before creating threads.
+ *
+ * @param policy Policy to use, for instance &qthread_policy_fair; it must outlive the runtime.
+ * @return 0 on success, -1 if threads already exist or a mandatory hook is missing.
+ */
+int qthread_set_policy(const qthread_policy_t *policy);
+
+/**
+ * @brief Returns the monotonic clock used for sleep deadlines.
+ *
+ * @return CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t qthread_clock_ns(void);
+
+/**
+ * @brief Sleeps for at least `ns` nanoseconds.
+ *
+ * The calling thread is parked on a timer wheel and its worker runs other
+ * threads meanwhile. Deadlines are rounded up to the wheel resolution (about
+ * 65 microseconds). Called outside any thread, the caller runs threads until
+ * the time is up.
+ *
+ * @param ns Time to sleep in nanoseconds (saturating: a huge value sleeps forever).
+ * @return 0 on success.
+ */
+int qthread_sleep_ns(uint64_t ns);
+
+/**
+ * @brief Sleeps until qthread_clock_ns() reaches `deadline`.
+ *
+ * Returns immediately if the deadline has passed; see qthread_sleep_ns.
+ *
+ * @param deadline Absolute time in nanoseconds (UINT64_MAX for none: sleeps forever).
+ * @return 0 on success.
+ */
+int qthread_sleep_until(uint64_t deadline);
+
+/**
+ * @enum qthread_io_backend
+ * @brief Mechanisms behind qthread_read and the other I/O calls.
+ */
+typedef enum {
+    QTHREAD_IO_EPOLL, ///< Readiness polling with epoll (default).
+    QTHREAD_IO_URING  ///< Batched submission and completion through io_uring.
+} qthread_io_backend;
+
+/**
+ * @brief Selects the I/O backend.
+ *
+ * With io_uring, threads queue their requests in a shared submission ring
+ * that the scheduler hands to the kernel in batches, reaping completions in
+ * batches when workers run out of READY threads. If io_uring cannot be set
+ * up the epoll backend is used. `make IO_URING=1` makes io_uring the default
+ * and `make IO_URING=0` leaves it out. Must be called before creating threads.
+ *
+ * @param backend Backend to use.
+ * @return 0 on success, -1 if threads already exist.
+ */
+int qthread_set_io_backend(qthread_io_backend backend);
+
+/**
+ * @brief Reads from a non-blocking fd, parking the thread until data is available.
+ *
+ * While the fd is not ready the thread is parked in the scheduler's I/O
+ * reactor and its worker runs other threads. One thread may wait to read and
+ * one to write on the same fd at a time. Outside any thread the calling
+ * kernel thread waits in poll().
+ *
+ * @param fd File descriptor in O_NONBLOCK mode.
+ * @param buf Destination buffer.
+ * @param count Maximum bytes to read.
+ * @return Bytes read (0 at end of file), or -1 with errno set.
+ */
+ssize_t qthread_read(int fd, void *buf, size_t count);
+
+/**
+ * @brief Writes to a non-blocking fd, parking the thread until there is room.
+ *
+ * @param fd File descriptor in O_NONBLOCK mode.
+ * @param buf Source buffer.
+ * @param count Bytes to write.
+ * @return Bytes written (possibly fewer than count), or -1 with errno set.
+ */
+ssize_t qthread_write(int fd, const void *buf, size_t count);
+
+/**
+ * @brief Accepts a connection, parking the thread until one is pending.
+ *
+ * @param fd Listening socket in O_NONBLOCK mode.
+ * @param addr Peer address (can be NULL).
+ * @param addrlen Size of addr on input, of the address on output (can be NULL).
+ * @return The new socket, non-blocking and close-on-exec, or -1 with errno set.
+ */
+int qthread_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+/**
+ * @brief Connects a socket, parking the thread until the connection is established.
+ *
+ * @param fd Socket in O_NONBLOCK mode.
+ * @param addr Address to connect to.
+ * @param addrlen Size of addr.
+ * @return 0 on success, -1 with errno set.
+ */
+int qthread_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+
+/**
+ * @brief Flushes a file to storage.
+ *
+ * Parks the thread with the io_uring backend; otherwise calls fsync(2).
+ *
+ * @param fd File descriptor.
+ * @return 0 on success, -1 with errno set.
+ */
+int qthread_fsync(int fd);
+
+/**
+ * @struct qthread_waitq_t
+ * @brief FIFO of threads parked on a synchronization object.
+ *
+ * Threads are linked through thread_t::wait_next, so parking allocates nothing.
+ */
+typedef struct {
+    thread_t *head; ///< Thread that has waited longest.
+    thread_t *tail; ///< Thread that parked last.
+} qthread_waitq_t;
+
+/**
+ * @struct qthread_mutex_t
+ * @brief Mutual exclusion lock that parks the threads contending for it.
+ *
+ * Initialize with QTHREAD_MUTEX_INITIALIZER or qthread_mutex_init.
+ */
+typedef struct {
+    int state; ///< 0 unlocked, 1 locked, 2 locked with possible waiters.
+    qthread_spinlock_t lock; ///< Guards the waiters.
+    qthread_waitq_t waiters; ///< Threads parked in qthread_mutex_lock.
+    int outside_waiters; ///< Lockers running outside any thread (driving the scheduler).
+} qthread_mutex_t;
+
+/// Static initializer of an unlocked qthread_mutex_t.
+#define QTHREAD_MUTEX_INITIALIZER { 0, { 0 }, { NULL, NULL }, 0 }
+
+/**
+ * @brief Initializes an unlocked mutex.
+ *
+ * @param m Mutex.
+ * @return 0.
+ */
+int qthread_mutex_init(qthread_mutex_t *m);
+
+/**
+ * @brief Locks a mutex, parking the thread while another one holds it.
+ *
+ * Taking a free mutex is a single atomic instruction. Contending threads wait
+ * in FIFO order, and unlock hands the mutex directly to the longest waiter.
+ * Outside any thread, the caller runs threads until the mutex is free.
+ *
+ * @param m Mutex.
+ * @return 0 on success, -1 if nothing could ever release it (deadlock).
+ */
+int qthread_mutex_lock(qthread_mutex_t *m);
+
+/**
+ * @brief Locks a mutex only if it is free.
+ *
+ * @param m Mutex.
+ * @return 0 if the mutex was taken, -1 if it is held.
+ */
+int qthread_mutex_trylock(qthread_mutex_t *m);
+
+/**
+ * @brief Unlocks a mutex held by the caller.
+ *
+ * If threads are waiting, the longest waiter becomes the owner and is woken.
+ *
+ * @param m Mutex.
+ * @return 0 on success, -1 if the mutex was not locked.
+ */
+int qthread_mutex_unlock(qthread_mutex_t *m);
+
+/**
+ * @struct qthread_cond_t
+ * @brief Condition variable whose waiters park until signaled.
+ *
+ * Initialize with QTHREAD_COND_INITIALIZER or qthread_cond_init.
+ */
+typedef struct {
+    qthread_spinlock_t lock; ///< Guards the waiters.
+    qthread_waitq_t waiters; ///< Threads parked in qthread_cond_wait.
+} qthread_cond_t;
+
+/// Static initializer of a qthread_cond_t.
+#define QTHREAD_COND_INITIALIZER { { 0 }, { NULL, NULL } }
+
+/**
+ * @brief Initializes a condition variable.
+ *
+ * @param c Condition variable.
+ * @return 0.
+ */
+int qthread_cond_init(qthread_cond_t *c);
+
+/**
+ * @brief Unlocks a mutex and parks until the condition is signaled.
+ *
+ * The mutex is locked again before returning. As with pthread_cond_wait the
+ * caller re-checks its predicate in a loop. Outside any thread, the caller
+ * runs threads until its worker is out of work, which counts as a spurious
+ * wakeup.
+ *
+ * @param c Condition variable.
+ * @param m Mutex held by the caller.
+ * @return 0 on success, -1 if the mutex could not be locked again.
+ */
+int qthread_cond_wait(qthread_cond_t *c, qthread_mutex_t *m);
+
+/**
+ * @brief qthread_cond_wait with a timeout.
+ *
+ * @param c Condition variable.
+ * @param m Mutex held by the caller.
+ * @param deadline Absolute qthread_clock_ns() time to give up at.
+ * @return 0 when signaled, -1 with errno set to ETIMEDOUT once the deadline
+ *         has passed (the mutex is locked again in both cases).
+ */
+int qthread_cond_timedwait(qthread_cond_t *c, qthread_mutex_t *m, uint64_t deadline);
+
+/**
+ * @brief Wakes the thread that has waited longest on a condition variable.
+ *
+ * @param c Condition variable.
+ * @return 0.
+ */
+int qthread_cond_signal(qthread_cond_t *c);
+
+/**
+ * @brief Wakes every thread waiting on a condition variable.
+ *
+ * @param c Condition variable.
+ * @return 0.
+ */
+int qthread_cond_broadcast(qthread_cond_t *c);
+
+/**
+ * @struct qthread_sem_t
+ * @brief Counting semaphore whose waiters park until a unit is posted.
+ *
+ * Initialize with QTHREAD_SEM_INITIALIZER(value) or qthread_sem_init.
+ */
+typedef struct {
+    int value; ///< Units available (never positive while threads wait).
+    qthread_spinlock_t lock; ///< Guards the waiters.
+    qthread_waitq_t waiters; ///< Threads parked in qthread_sem_wait.
+    int outside_waiters; ///< Waiters running outside any thread (driving the scheduler).
+} qthread_sem_t;
+
+/// Static initializer of a qthread_sem_t holding `n` units.
+#define QTHREAD_SEM_INITIALIZER(n) { (n), { 0 }, { NULL, NULL }, 0 }
+
+/**
+ * @brief Initializes a semaphore.
+ *
+ * @param s Semaphore.
+ * @param value Initial number of units.
+ * @return 0.
+ */
+int qthread_sem_init(qthread_sem_t *s, unsigned int value);
+
+/**
+ * @brief Takes a unit, parking the thread until one is posted.
+ *
+ * Waiters are served in FIFO order; a post hands its unit directly to the
+ * longest waiter. Outside any thread, the caller runs threads until a unit
+ * is available.
+ *
+ * @param s Semaphore.
+ * @return 0 on success, -1 if nothing could ever post a unit (deadlock).
+ */
+int qthread_sem_wait(qthread_sem_t *s);
+
+/**
+ * @brief Takes a unit if one is available.
+ *
+ * @param s Semaphore.
+ * @return 0 if a unit was taken, -1 otherwise.
+ */
+int qthread_sem_trywait(qthread_sem_t *s);
+
+/**
+ * @brief qthread_sem_wait with a timeout.
+ *
+ * @param s Semaphore.
+ * @param deadline Absolute qthread_clock_ns() time to give up at.
+ * @return 0 if a unit was taken, -1 with errno set to ETIMEDOUT otherwise.
+ */
+int qthread_sem_timedwait(qthread_sem_t *s, uint64_t deadline);
+
+/**
+ * @brief Releases a unit, waking the longest waiter if there is one.
+ *
+ * @param s Semaphore.
+ * @return 0.
+ */
+int qthread_sem_post(qthread_sem_t *s);
+
+/// Capacity of a channel whose buffer grows instead of blocking senders.
+#define QTHREAD_CHAN_UNBOUNDED ((size_t)-1)
+
+/// Maximum number of cases in one qthread_select.
+#define QTHREAD_SELECT_MAX 64
+
+struct qchan_waiter;
+
+/**
+ * @struct qthread_chan_t
+ * @brief Channel carrying fixed-size values between threads, in FIFO order.
+ *
+ * With capacity 0 every send waits for a receiver (rendezvous); otherwise
+ * values are buffered up to the capacity, or without limit for
+ * QTHREAD_CHAN_UNBOUNDED. Initialize with qthread_chan_init.
+ */
+typedef struct {
+    qthread_spinlock_t lock; ///< Guards everything below.
+    size_t elem_size; ///< Size of a value in bytes.
+    size_t capacity; ///< Values buffered before senders wait.
+    char *buf; ///< Ring of buffered values.
+    size_t slots; ///< Values the ring can hold.
+    size_t head; ///< Ring index of the oldest buffered value.
+    size_t count; ///< Buffered values.
+    int closed; ///< Set by qthread_chan_close.
+    int outside_waiters; ///< Waiters running outside any thread (driving the scheduler).
+    struct qchan_waiter *senders; ///< Parked senders (circular list, oldest first).
+    struct qchan_waiter *receivers; ///< Parked receivers (circular list, oldest first).
+} qthread_chan_t;
+
+/**
+ * @enum qthread_chan_op
+ * @brief Operation of a qthread_select case.
+ */
+typedef enum {
+    QTHREAD_CHAN_SEND, ///< Send *elem.
+    QTHREAD_CHAN_RECV  ///< Receive into *elem.
+} qthread_chan_op;
+
+/**
+ * @struct qthread_select_case_t
+ * @brief One channel operation offered to qthread_select.
+ */
+typedef struct {
+    qthread_chan_t *chan; ///< Channel (cases with NULL are ignored).
+    qthread_chan_op op; ///< Send or receive.
+    void *elem; ///< Value to send, or where to store the received one (can be NULL).
+    int ok; ///< Set for the chosen case: 1 if a value moved, 0 if the channel is closed.
+} qthread_select_case_t;
+
+/**
+ * @brief Initializes a channel.
+ *
+ * @param ch Channel.
+ * @param elem_size Size of the values it carries.
+ * @param capacity Buffered values (0 for rendezvous, QTHREAD_CHAN_UNBOUNDED for no limit).
+ * @return 0 on success, -1 if the buffer cannot be allocated.
+ */
+int qthread_chan_init(qthread_chan_t *ch, size_t elem_size, size_t capacity);
+
+/**
+ * @brief Releases the buffer of a channel nobody uses any more.
+ *
+ * @param ch Channel.
+ */
+void qthread_chan_destroy(qthread_chan_t *ch);
+
+/**
+ * @brief Sends a value, parking the thread until it is buffered or received.
+ *
+ * A parked receiver gets the value copied straight into its buffer and is
+ * woken. Outside any thread, the caller runs threads until the send completes.
+ *
+ * @param ch Channel.
+ * @param elem Value to send (elem_size bytes).
+ * @return 0 on success, -1 with errno set to EPIPE if the channel is closed.
+ */
+int qthread_chan_send(qthread_chan_t *ch, const void *elem);
+
+/**
+ * @brief Receives a value, parking the thread until one is available.
+ *
+ * Buffered values are received before a close is reported.
+ *
+ * @param ch Channel.
+ * @param elem Where to store the value (can be NULL to drop it).
+ * @return 0 on success, -1 with errno set to EPIPE once the channel is closed and empty.
+ */
+int qthread_chan_recv(qthread_chan_t *ch, void *elem);
+
+/**
+ * @brief Sends a value only if that does not require waiting.
+ *
+ * @return 0 on success, -1 with errno set to EAGAIN or EPIPE otherwise.
+ */
+int qthread_chan_trysend(qthread_chan_t *ch, const void *elem);
+
+/**
+ * @brief Receives a value only if one is available right away.
+ *
+ * @return 0 on success, -1 with errno set to EAGAIN or EPIPE otherwise.
+ */
+int qthread_chan_tryrecv(qthread_chan_t *ch, void *elem);
+
+/**
+ * @brief Closes a channel.
+ *
+ * Parked senders fail with EPIPE; receivers drain the buffered values, then
+ * fail with EPIPE as well.
+ *
+ * @param ch Channel.
+ * @return 0 on success, -1 with errno set to EPIPE if it was already closed.
+ */
+int qthread_chan_close(qthread_chan_t *ch);
+
+/**
+ * @brief Performs whichever of several channel operations can proceed first.
+ *
+ * If some cases are ready, one of them is chosen (rotating among calls so
+ * none starves). Otherwise the thread parks on every channel at once until
+ * a peer completes one of the cases or the deadline passes.
+ *
+ * @param cases Operations; the chosen one gets its ok field set.
+ * @param n Number of cases (1 to QTHREAD_SELECT_MAX).
+ * @param deadline Absolute qthread_clock_ns() time to give up at; UINT64_MAX
+ *        waits indefinitely and 0 only polls.
+ * @return Index of the chosen case, or -1 with errno set to ETIMEDOUT,
+ *         EINVAL (bad n) or EDEADLK (nothing could ever complete a case).
+ */
+int qthread_select(qthread_select_case_t *cases, int n, uint64_t deadline);
+
 void qthread_wrapper(void (*func)(void*), void *arg);
 
 /**
@@ -61,15 +727,31 @@ void qthread_wrapper(void (*func)(void*), void *arg);
  */
 int qthread_create(thread_t **new_thread, void(*start_routine)(void *), void *arg);
 
+/**
+ * @brief Creates a new thread with a deadline.
+ *
+ * Like qthread_create, but the thread is queued with its deadline already
+ * set (see qthread_set_deadline).
+ *
+ * @param[out] new_thread Pointer to store the created thread (can be NULL).
+ * @param[in] start_routine Function to be executed by the thread.
+ * @param[in] arg Argument passed to the start_routine function.
+ * @param[in] deadline Absolute qthread_clock_ns() time (0 = none).
+ * @return 0 on success, -1 on failure.
+ */
+int qthread_create_deadline(thread_t **new_thread, void (*start_routine)(void *), void *arg,
+                            uint64_t deadline);
+
 /**
  * @brief Waits for a thread to complete.
  *
- * Blocks until the specified thread has finished execution.
+ * Blocks until the specified thread has finished execution. The caller is
+ * BLOCKED and not scheduled again until the thread exits.
  * If `retval` is not NULL, stores the thread's return value.
  *
  * @param[in] thread Thread to wait for.
  * @param[out] retval Pointer to store the thread's return value (can be NULL).
- * @return 0 on success, -1 on failure.
+ * @return 0 on success, -1 on failure (joining itself, or deadlock).
  */
 int qthread_join(thread_t *thread, void **retval);
 
@@ -85,21 +767,298 @@ void qthread_exit(void *value);
 
 /**
  * @brief Switches execution to the next available thread.
+ *
+ * Called from outside any thread, runs threads until the calling worker has
+ * nothing left to do.
  */
 void qscheduler();
 
+/**
+ * @brief Switches straight to a READY thread, ahead of the threads queued before it.
+ *
+ * The target is taken from the caller's worker (its run queue, or the next
+ * slot where threads woken by the caller's mutex, condition variable,
+ * semaphore or channel operations wait) or from the global queue. The caller
+ * then waits in the next slot, so the target can hand the CPU straight back.
+ * A pair of threads passing the CPU this way keeps it until a preemption tick
+ * or a plain yield serves the queue. If the target cannot be reached (it is
+ * running, blocked or queued on another worker) this is qscheduler().
+ *
+ * @param target Thread to run.
+ * @return 0 if the CPU went to target, -1 if the caller yielded normally.
+ */
+int qthread_yield_to(thread_t *target);
+
+/**
+ * @brief Changes the scheduling priority of a thread.
+ *
+ * What a priority means is up to the policy. Under the default
+ * qthread_policy_prio a worker always runs its most urgent READY thread
+ * first: threads of higher priority run before lower ones, and threads of
+ * equal priority take turns in FIFO order. A thread that yields keeps the CPU
+ * if nothing queued is as urgent as it is, and waking a more urgent thread
+ * switches to it at once (or as soon as the waker re-enables preemption).
+ * Priorities are enforced per worker: idle workers still steal whatever is
+ * queued. qthread_policy_fair turns priorities into CPU shares, and
+ * qthread_policy_rr ignores them. A thread queued on the caller's worker is
+ * requeued at once; one queued elsewhere moves the next time it is queued.
+ *
+ * @param thread Thread to change (for instance qthread_self()).
+ * @param prio New priority, from 0 to QTHREAD_PRIO_MAX (QTHREAD_PRIO_DEFAULT for new threads).
+ * @return 0 on success, -1 if prio is out of range.
+ */
+int qthread_set_priority(thread_t *thread, int prio);
+
+/**
+ * @brief Returns the scheduling priority of a thread.
+ *
+ * @param thread Thread.
+ * @return Its priority.
+ */
+int qthread_get_priority(thread_t *thread);
+
+/**
+ * @brief Returns the virtual runtime of a thread under qthread_policy_cfs.
+ *
+ * The CPU time the thread consumed, in cycle-counter units, scaled by 1024
+ * over its weight: each priority step above QTHREAD_PRIO_DEFAULT raises the
+ * weight by about 19% (doubling it every 4 levels) and each step below
+ * lowers it. The policy runs the thread with the lowest virtual runtime, so
+ * the threads of a worker advance at the same pace and their CPU time is in
+ * proportion to their weights. A thread that slept, or moved from another
+ * worker, restarts from the worker's least virtual runtime so it cannot bank
+ * CPU time. The value only advances when the thread leaves the CPU or is
+ * interrupted by a preemption tick.
+ *
+ * @param thread Thread.
+ * @return Its virtual runtime (0 before it ran under the policy).
+ */
+uint64_t qthread_get_vruntime(thread_t *thread);
+
+/**
+ * @brief Changes the deadline of a thread.
+ *
+ * Under qthread_policy_edf a worker always runs the READY thread with the
+ * nearest deadline, and threads without one only when no deadline is
+ * pending. Waking a thread whose deadline is nearer than the running one's
+ * switches to it at once, and a preemption tick lets the running thread
+ * continue unless a queued deadline is as near. The policy also checks the
+ * deadline whenever the thread is switched in or out and at each tick: the
+ * first time it finds the thread past it, it counts a miss (see
+ * qthread_deadline_misses) and calls the handler installed with
+ * qthread_set_deadline_handler. Setting a new deadline re-arms the check.
+ * Other policies keep the deadline but ignore it.
+ *
+ * @param thread Thread to change (for instance qthread_self()).
+ * @param deadline Absolute qthread_clock_ns() time (0 = none).
+ * @return 0 on success, -1 if thread is NULL.
+ */
+int qthread_set_deadline(thread_t *thread, uint64_t deadline);
+
+/**
+ * @brief Returns the deadline of a thread.
+ *
+ * @param thread Thread.
+ * @return Its absolute deadline, or 0 if it has none.
+ */
+uint64_t qthread_get_deadline(thread_t *thread);
+
+/// Called by qthread_policy_edf for a thread found running past its deadline, with how late it is.
+typedef void (*qthread_deadline_handler_t)(thread_t *thread, uint64_t late_ns);
+
+/**
+ * @brief Installs the handler of deadline misses.
+ *
+ * The handler runs on the scheduler's path (possibly from the preemption
+ * signal), with preemption disabled: it must be short and must not call
+ * back into the library beyond reading thread attributes.
+ *
+ * @param handler Handler (NULL to only count misses).
+ */
+void qthread_set_deadline_handler(qthread_deadline_handler_t handler);
+
+/**
+ * @brief Returns the number of deadline misses counted so far.
+ *
+ * @return Misses since the program started, over all threads.
+ */
+uint64_t qthread_deadline_misses(void);
+
+/**
+ * @brief Takes a snapshot of a thread's scheduling statistics.
+ *
+ * Times include the interval the thread is in right now. Counters are
+ * updated by whichever worker switches the thread, so a snapshot of a
+ * thread running elsewhere may be slightly behind.
+ *
+ * @param thread Thread (not joined yet).
+ * @param[out] stats Statistics (zeroed in builds without QTHREAD_STATS).
+ * @return 0 on success, -1 if thread is NULL or statistics are compiled out.
+ */
+int qthread_stats(thread_t *thread, qthread_stats_t *stats);
+
+/**
+ * @brief Sums the scheduling statistics of every thread that ever ran.
+ *
+ * Kept per worker as threads switch, so it covers joined threads too but
+ * only intervals that ended at a switch: a thread still blocked or running
+ * is counted up to its last switch.
+ *
+ * @param[out] stats Statistics since the program started (zeroed without QTHREAD_STATS).
+ * @return 0 on success, -1 if statistics are compiled out.
+ */
+int qthread_stats_total(qthread_stats_t *stats);
+
+/**
+ * @brief Enables tracing of scheduler events.
+ *
+ * Every worker records thread creations, wakeups, switches, blocks and exits
+ * with a cycle-counter timestamp in a ring of its own, keeping the most
+ * recent `events`. Recording costs a few nanoseconds and takes no lock, so
+ * tracing can stay on. The rings are freed by qthread_shutdown. Must be
+ * called before creating threads.
+ *
+ * @param events Events kept per worker, rounded up to a power of two (0 disables tracing, the default).
+ * @return 0 on success, -1 if threads already exist.
+ */
+int qthread_set_trace(size_t events);
+
+/**
+ * @brief Writes the events recorded so far to a file.
+ *
+ * May be called while threads run; events a worker overwrites during the
+ * dump are left out. `qtrace2json` converts a dump to the Chrome trace
+ * format read by chrome://tracing and Perfetto.
+ *
+ * @param fd File descriptor to write the binary dump to.
+ * @return 0 on success, -1 if tracing is off or writing failed (errno set).
+ */
+int qthread_trace_dump(int fd);
+
+/// Buckets of a latency histogram: one per nanosecond below 16 ns, then 8 per power of two up to 2^40 ns.
+#define QTHREAD_HIST_BUCKETS 304
+
+/// Priority classes with histograms of their own, each covering QTHREAD_PRIO_LEVELS / QTHREAD_HIST_CLASSES levels.
+#define QTHREAD_HIST_CLASSES 4
+
+/**
+ * @enum qthread_hist_kind
+ * @brief Latencies measured by the scheduler histograms.
+ */
+typedef enum {
+    QTHREAD_HIST_WAKE_TO_RUN, ///< From becoming READY (created, woken or switched out READY) to running.
+    QTHREAD_HIST_SLICE        ///< From being switched in to being switched out.
+} qthread_hist_kind;
+
+/**
+ * @struct qthread_hist_t
+ * @brief Log-linear histogram of latencies in nanoseconds.
+ *
+ * Bucket b counts samples from qthread_hist_bucket_min(b) to
+ * qthread_hist_bucket_min(b + 1) - 1, a relative width of at most 12.5%; the
+ * last bucket also counts every larger sample.
+ */
+typedef struct {
+    uint64_t count; ///< Number of samples.
+    uint64_t sum_ns; ///< Sum of the samples.
+    uint64_t max_ns; ///< Largest sample.
+    uint64_t buckets[QTHREAD_HIST_BUCKETS]; ///< Samples per bucket.
+} qthread_hist_t;
+
+/**
+ * @brief Enables the wake-to-run and slice length histograms.
+ *
+ * Each worker keeps its own histograms for each priority class, filled on
+ * every context switch and wakeup at the cost of a clock read, so they can
+ * stay enabled. They are freed by qthread_shutdown. Must be called before
+ * creating threads.
+ *
+ * @param enable Nonzero to enable the histograms, 0 to disable them (default).
+ * @return 0 on success, -1 if threads already exist.
+ */
+int qthread_set_histograms(int enable);
+
+/**
+ * @brief Sums the histograms of every worker since the last reset.
+ *
+ * @param kind Latency to read.
+ * @param prio_class Priority class (priority * QTHREAD_HIST_CLASSES / QTHREAD_PRIO_LEVELS), or -1 for all of them.
+ * @param[out] hist Histogram.
+ * @return 0 on success, -1 if the histograms are off or an argument is out of range.
+ */
+int qthread_hist_read(qthread_hist_kind kind, int prio_class, qthread_hist_t *hist);
+
+/**
+ * @brief Empties every histogram.
+ *
+ * Each worker drops its samples the next time it records one; until then
+ * qthread_hist_read leaves them out.
+ */
+void qthread_hist_reset(void);
+
+/**
+ * @brief Returns the smallest latency counted by a histogram bucket.
+ *
+ * @param bucket Bucket index, up to QTHREAD_HIST_BUCKETS.
+ * @return Lower bound in nanoseconds.
+ */
+uint64_t qthread_hist_bucket_min(int bucket);
+
+/**
+ * @brief Estimates a percentile of a histogram.
+ *
+ * @param hist Histogram.
+ * @param p Percentile, from 0 to 100.
+ * @return Upper bound of the bucket holding the percentile (at most max_ns), or 0 if empty.
+ */
+uint64_t qthread_hist_percentile(const qthread_hist_t *hist, double p);
+
 /**
  * @brief Retrieves the currently running thread.
  *
- * @return Pointer to the current thread.
+ * @return Pointer to the current thread (NULL outside any thread).
  */
 thread_t *qthread_self();
 
 /**
- * @brief Initializes the scheduler by saving the main context as a thread.abort
- * 
- * This function must be called from main() before creating other threads.
+ * @brief Starts the runtime and makes the caller its main thread.
+ *
+ * The calling kernel thread becomes worker 0 (with its run queue and stack
+ * cache) and the code calling this function becomes a thread like the ones
+ * from qthread_create: qthread_self returns it, and qthread_join,
+ * qthread_mutex_lock, sleeps and blocking I/O park it instead of running
+ * other threads from a nested scheduler. The main thread always runs on the
+ * kernel thread that called qthread_init; while it is parked that kernel
+ * thread runs the other threads and, when there are none, sleeps in an idle
+ * loop until a timer, an fd or another worker wakes one. If every thread
+ * is blocked with nothing left that could wake one on a single worker, the
+ * program aborts with a deadlock message. The main thread must not call
+ * qthread_exit.
+ *
+ * Optional: without it the runtime starts on the first qthread_create and
+ * the caller stays outside any thread.
+ *
+ * @return 0 on success, -1 if the caller is another thread or runs on another worker.
+ */
+int qthread_init(void);
+
+/**
+ * @brief Waits for every thread to finish and stops the runtime.
+ *
+ * Called from the main thread (or, without qthread_init, from the kernel
+ * thread that started the runtime, outside any thread). Once every other
+ * thread has exited, it stops the worker kernel threads and their
+ * preemption timers, and frees the run queues, stack caches and the
+ * descriptors of threads nobody joined (which must not be joined
+ * afterwards). The caller is then outside the runtime, which the next
+ * qthread_init or qthread_create starts again. Settings such as the
+ * concurrency or the policy can be changed in between.
+ *
+ * @return 0 on success (or if the runtime is not running), -1 if called from
+ *         elsewhere or no remaining thread can finish.
  */
-void qthread_init();
+int qthread_shutdown(void);
+
+#pragma GCC visibility pop
 
 #endif // QTHREAD_H
@@ -0,0 +1,200 @@
+/*
+ * @file qcfs.c
+ * @brief Completely fair scheduling policy based on virtual runtime.
+ *
+ * Every thread carries a virtual runtime (thread_t::sched_key): the cycles
+ * it spent on the CPU, scaled by 1024 over the weight of its priority. Each
+ * worker keeps its READY threads in a pairing heap ordered by virtual
+ * runtime and always runs the lowest one, so the threads sharing a worker
+ * get CPU time in proportion to their weights.
+ *
+ * Time is charged when a thread leaves the CPU and at each preemption tick,
+ * from the cycle counter read when it was switched in. The worker's minimum
+ * virtual runtime only moves forward; threads that wake up or arrive from
+ * another worker are placed no lower than it, so sleeping does not bank CPU
+ * time and migration does not carry debt or credit across workers.
+ */
+#include "qheap.h"
+#include "qsched.h"
+#include <stdlib.h>
+#include <string.h>
+
+/// Weight of QTHREAD_PRIO_DEFAULT; virtual runtime advances at cycle speed at this weight.
+#define QCFS_WEIGHT_DEFAULT 1024
+
+/**
+ * @struct qcfs_rq_t
+ * @brief Per-worker state of the CFS policy.
+ */
+typedef struct {
+    qthread_spinlock_t lock; ///< Guards the heap.
+    thread_t *root; ///< Thread with the lowest virtual runtime.
+    int size; ///< Number of queued threads (read without the lock).
+    uint64_t min_vruntime; ///< Virtual runtime of the latest thread picked; never decreases.
+    uint64_t stamp; ///< Cycle counter when the running thread was switched in or last charged.
+} qcfs_rq_t;
+
+/**
+ * @brief Returns the weight of a priority.
+ *
+ * Doubles every four levels: from 4 at priority 0 through 1024 at the
+ * default to about 220000 at QTHREAD_PRIO_MAX.
+ *
+ * @param prio Priority.
+ */
+static uint64_t qcfs_weight(int prio) {
+    static const uint64_t base[4] = { 1024, 1218, 1448, 1722 }; // 1024 * 2^(i/4)
+    int e = prio - QTHREAD_PRIO_DEFAULT;
+    int shift = e >= 0 ? e / 4 : -((3 - e) / 4);
+    uint64_t w = base[e - 4 * shift];
+    return shift >= 0 ? w << shift : w >> -shift;
+}
+
+/**
+ * @brief Takes the thread with the lowest virtual runtime.
+ *
+ * @param q Locked instance with a non-empty heap.
+ * @return The thread.
+ */
+static thread_t *qcfs_pop(qcfs_rq_t *q) {
+    thread_t *t = qheap_pop(&q->root);
+    t->sched_rq = NULL;
+    __atomic_store_n(&q->size, q->size - 1, __ATOMIC_RELAXED);
+    return t;
+}
+
+/**
+ * @brief Charges the CPU time since the last stamp to a running thread.
+ *
+ * @param q Instance of the thread's worker.
+ * @param t Thread that was running.
+ */
+static void qcfs_account(qcfs_rq_t *q, thread_t *t) {
+    uint64_t now = qtimer_cycles();
+    uint64_t delta = now - q->stamp;
+    q->stamp = now;
+    t->sched_key += delta * QCFS_WEIGHT_DEFAULT /
+                    qcfs_weight(__atomic_load_n(&t->priority, __ATOMIC_RELAXED));
+}
+
+static void *qcfs_init(void) {
+    qcfs_rq_t *q = aligned_alloc(64, (sizeof(qcfs_rq_t) + 63) & ~(size_t)63);
+    if (q) memset(q, 0, sizeof(*q));
+    return q;
+}
+
+static int qcfs_enqueue(void *rq, thread_t *t) {
+    qcfs_rq_t *q = rq;
+    qspin_lock(&q->lock);
+    t->sched_rq = q;
+    qheap_push(&q->root, t);
+    __atomic_store_n(&q->size, q->size + 1, __ATOMIC_RELAXED);
+    qspin_unlock(&q->lock);
+    return 0;
+}
+
+static thread_t *qcfs_pick_next(void *rq) {
+    qcfs_rq_t *q = rq;
+    if (!__atomic_load_n(&q->size, __ATOMIC_RELAXED)) return NULL;
+
+    qspin_lock(&q->lock);
+    thread_t *t = q->root ? qcfs_pop(q) : NULL;
+    if (t && t->sched_key > q->min_vruntime)
+        __atomic_store_n(&q->min_vruntime, t->sched_key, __ATOMIC_RELAXED);
+    qspin_unlock(&q->lock);
+    return t;
+}
+
+/**
+ * @brief Takes the lowest thread of a peer, rebasing it on the thief's clock.
+ */
+static thread_t *qcfs_steal(void *rq, void *victim) {
+    qcfs_rq_t *q = rq, *v = victim;
+    if (!__atomic_load_n(&v->size, __ATOMIC_RELAXED)) return NULL;
+
+    qspin_lock(&v->lock);
+    uint64_t base = v->min_vruntime;
+    thread_t *t = v->root ? qcfs_pop(v) : NULL;
+    qspin_unlock(&v->lock);
+
+    if (t) {
+        // Keep the lag behind the victim's minimum, not the absolute value
+        uint64_t lag = t->sched_key > base ? t->sched_key - base : 0;
+        t->sched_key = __atomic_load_n(&q->min_vruntime, __ATOMIC_RELAXED) + lag;
+    }
+    return t;
+}
+
+static int qcfs_has_work(void *rq) {
+    qcfs_rq_t *q = rq;
+    return __atomic_load_n(&q->size, __ATOMIC_SEQ_CST) != 0;
+}
+
+static int qcfs_remove(void *rq, thread_t *t) {
+    qcfs_rq_t *q = rq;
+    qspin_lock(&q->lock);
+    if (t->sched_rq != q) {
+        qspin_unlock(&q->lock);
+        return 0;
+    }
+
+    qheap_remove(&q->root, t);
+    t->sched_rq = NULL;
+    __atomic_store_n(&q->size, q->size - 1, __ATOMIC_RELAXED);
+    qspin_unlock(&q->lock);
+    return 1;
+}
+
+static void qcfs_leave(void *rq, thread_t *t) {
+    qcfs_account(rq, t);
+}
+
+static void qcfs_on_wake(void *rq, thread_t *t) {
+    qcfs_rq_t *q = rq;
+    uint64_t min = __atomic_load_n(&q->min_vruntime, __ATOMIC_RELAXED);
+    if (t->sched_key < min) t->sched_key = min;
+}
+
+static void qcfs_on_run(void *rq, thread_t *t) {
+    (void)t;
+    ((qcfs_rq_t *)rq)->stamp = qtimer_cycles();
+}
+
+/**
+ * @brief Ends the slice of t only if a queued thread is now further behind.
+ */
+static int qcfs_tick(void *rq, thread_t *t) {
+    qcfs_rq_t *q = rq;
+    qcfs_account(q, t);
+    if (!__atomic_load_n(&q->size, __ATOMIC_RELAXED)) return 0;
+
+    qspin_lock(&q->lock);
+    int behind = q->root && q->root->sched_key < t->sched_key;
+    qspin_unlock(&q->lock);
+    return behind;
+}
+
+const qthread_policy_t qthread_policy_cfs = {
+    .name = "cfs",
+    .init = qcfs_init,
+    .enqueue = qcfs_enqueue,
+    .pick_next = qcfs_pick_next,
+    .steal = qcfs_steal,
+    .has_work = qcfs_has_work,
+    .remove = qcfs_remove,
+    .on_yield = qcfs_leave,
+    .on_block = qcfs_leave,
+    .on_wake = qcfs_on_wake,
+    .on_run = qcfs_on_run,
+    .tick = qcfs_tick,
+};
+
+/**
+ * @brief Returns the virtual runtime of a thread under the CFS policy.
+ *
+ * @param thread Thread.
+ * @return Its virtual runtime.
+ */
+uint64_t qthread_get_vruntime(thread_t *thread) {
+    return __atomic_load_n(&thread->sched_key, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,634 @@
+/*
+ * @file qchan.c
+ * @brief Channels and select.
+ *
+ * A thread that cannot complete a channel operation parks with a wait record
+ * on its own stack, queued on the channel (on every channel of a select).
+ * The record says where the value comes from or goes to, so the peer that
+ * completes the operation copies the value directly between the two threads
+ * and hands it the CPU next (qsched_handoff); the parked thread resumes with
+ * its operation already done.
+ *
+ * A select locks all its channels in address order, so selects over the same
+ * channels cannot deadlock. The first peer or timeout to claim the thread
+ * through thread_t::wait_status completes the select; the records it still
+ * has on other channels are dropped by the thread when it resumes.
+ *
+ * A parked selector holds a lock until it is switched out, which keeps it
+ * from being resumed before it has left the CPU: its own thread lock, which a
+ * waker takes before waking it, or with a deadline the lock of the wheel its
+ * timeout is on, which the timeout fires under and a waker takes to cancel it.
+ */
+#include "../include/qthread.h"
+#include "qsched.h"
+#include "qwaitq.h"
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @struct qchan_waiter
+ * @brief A parked thread's offer to send or receive on one channel.
+ */
+typedef struct qchan_waiter {
+    struct qchan_waiter *next; ///< Next record in the channel's queue.
+    struct qchan_waiter *prev; ///< Previous record in the channel's queue.
+    thread_t *thread; ///< Parked thread.
+    void *elem; ///< Value to send, or where to store the received one.
+    int index; ///< Select case the record stands for.
+    int queued; ///< Whether the record is still in the queue.
+    int fired; ///< Set by the peer that completed the operation.
+    int ok; ///< Set with fired: 1 if a value moved, 0 if the channel was closed.
+} qchan_waiter_t;
+
+/**
+ * @struct qchan_outside_t
+ * @brief State of a select made outside any thread.
+ */
+typedef struct {
+    qthread_select_case_t *cases; ///< Cases offered.
+    int n; ///< Number of cases.
+    int chosen; ///< Index of the completed case, -1 until then.
+    int expired; ///< Set by the timeout.
+    thread_t *woken; ///< Peer the completed case claimed, woken once the wait is over.
+    int notify; ///< Whether the completed case's channel has other outside waiters to notify then.
+} qchan_outside_t;
+
+/// Rotates the case a select tries first, so that no ready case starves; per
+/// kernel thread, so that selects on different workers share no cache line.
+static __thread unsigned qchan_rotor __attribute__((tls_model("initial-exec")));
+
+/**
+ * @brief Copies a value, tolerating empty values and dropped receives.
+ */
+static void qchan_copy(void *dst, const void *src, size_t size) {
+    if (size && dst) memcpy(dst, src, size);
+}
+
+/**
+ * @brief Returns the buffer slot of the i-th buffered value.
+ */
+static char *qchan_slot(qthread_chan_t *ch, size_t i) {
+    return ch->buf + (ch->head + i) % ch->slots * ch->elem_size;
+}
+
+/**
+ * @brief Doubles the buffer of an unbounded channel.
+ *
+ * Called with the channel lock held, hence with preemption disabled as the
+ * allocator requires.
+ *
+ * @param ch Channel.
+ * @return 0 on success, -1 if memory is short.
+ */
+static int qchan_grow(qthread_chan_t *ch) {
+    size_t slots = ch->slots ? ch->slots * 2 : 16;
+    char *buf = malloc(slots * ch->elem_size);
+    if (!buf) return -1;
+
+    for (size_t i = 0; i < ch->count; i++)
+        memcpy(buf + i * ch->elem_size, qchan_slot(ch, i), ch->elem_size);
+    free(ch->buf);
+    ch->buf = buf;
+    ch->slots = slots;
+    ch->head = 0;
+    return 0;
+}
+
+/**
+ * @brief Appends a record to a channel queue.
+ *
+ * @param q Queue (circular list).
+ * @param r Record.
+ */
+static void qchan_enqueue(qchan_waiter_t **q, qchan_waiter_t *r) {
+    if (*q) {
+        r->next = *q;
+        r->prev = (*q)->prev;
+        r->prev->next = r;
+        (*q)->prev = r;
+    } else {
+        r->next = r->prev = r;
+        *q = r;
+    }
+    r->queued = 1;
+}
+
+/**
+ * @brief Removes a record from the channel queue it is in, if any.
+ *
+ * @param q Queue.
+ * @param r Record.
+ */
+static void qchan_dequeue(qchan_waiter_t **q, qchan_waiter_t *r) {
+    if (!r->queued) return;
+    if (r->next == r) {
+        *q = NULL;
+    } else {
+        r->prev->next = r->next;
+        r->next->prev = r->prev;
+        if (*q == r) *q = r->next;
+    }
+    r->queued = 0;
+}
+
+/**
+ * @brief Dequeues the oldest record whose thread is still waiting.
+ *
+ * @param q Queue, with the channel lock held.
+ * @return The claimed record, to be completed and passed to qchan_wake, or NULL.
+ */
+static qchan_waiter_t *qchan_claim(qchan_waiter_t **q) {
+    qchan_waiter_t *r;
+    while ((r = *q)) {
+        qchan_dequeue(q, r);
+        if (qwaitq_claim(r->thread, QWAIT_WOKEN)) return r;
+        // Another case of its select or its timeout won; it drops the record itself
+    }
+    return NULL;
+}
+
+/**
+ * @brief Wakes a thread parked in qthread_select.
+ *
+ * @param t Thread claimed by the caller.
+ */
+static void qchan_wake(thread_t *t) {
+    // It holds its own lock, or its timer's wheel lock, until it is switched out
+    if (t->wait_timer) {
+        qtimer_cancel(t->wait_timer);
+    } else {
+        qspin_lock(&t->lock);
+        qspin_unlock(&t->lock);
+    }
+    qsched_handoff(t);
+}
+
+/**
+ * @brief Timer callback ending a parked select.
+ *
+ * @param timer Timer whose arg is the parked thread.
+ */
+static void qchan_timeout(qtimer_t *timer) {
+    thread_t *t = timer->arg;
+    if (qwaitq_claim(t, QWAIT_TIMEDOUT)) qsched_wake(t);
+}
+
+/**
+ * @brief Timer callback ending a select made outside any thread.
+ *
+ * @param timer Timer whose arg is the qchan_outside_t.
+ */
+static void qchan_timeout_outside(qtimer_t *timer) {
+    qchan_outside_t *o = timer->arg;
+    __atomic_store_n(&o->expired, 1, __ATOMIC_RELEASE);
+    qsched_notify_all();
+}
+
+/**
+ * @brief Attempts one case without waiting, with its channel locked.
+ *
+ * @param c Case; its ok field is set if it completes.
+ * @param woken Receives the record of a parked peer the case completed.
+ * @return 1 if the case completed, 0 if it would have to wait.
+ */
+static int qchan_try(qthread_select_case_t *c, qchan_waiter_t **woken) {
+    qthread_chan_t *ch = c->chan;
+    qchan_waiter_t *r;
+
+    if (c->op == QTHREAD_CHAN_SEND) {
+        if (ch->closed) {
+            c->ok = 0;
+            return 1;
+        }
+        if ((r = qchan_claim(&ch->receivers))) {
+            qchan_copy(r->elem, c->elem, ch->elem_size);
+            r->ok = r->fired = 1;
+            *woken = r;
+        } else if (ch->count < ch->slots ||
+                   (ch->capacity == QTHREAD_CHAN_UNBOUNDED && qchan_grow(ch) == 0)) {
+            qchan_copy(qchan_slot(ch, ch->count), c->elem, ch->elem_size);
+            ch->count++;
+        } else {
+            return 0; // Full (an unbounded one only when memory is short)
+        }
+        c->ok = 1;
+        return 1;
+    }
+
+    if (ch->count) {
+        qchan_copy(c->elem, qchan_slot(ch, 0), ch->elem_size);
+        ch->head = (ch->head + 1) % ch->slots;
+        ch->count--;
+        // The buffer was full: the longest parked sender's value takes the freed slot
+        if ((r = qchan_claim(&ch->senders))) {
+            qchan_copy(qchan_slot(ch, ch->count), r->elem, ch->elem_size);
+            ch->count++;
+            r->ok = r->fired = 1;
+            *woken = r;
+        }
+    } else if ((r = qchan_claim(&ch->senders))) {
+        qchan_copy(c->elem, r->elem, ch->elem_size);
+        r->ok = r->fired = 1;
+        *woken = r;
+    } else if (ch->closed) {
+        if (c->elem && ch->elem_size) memset(c->elem, 0, ch->elem_size);
+        c->ok = 0;
+        return 1;
+    } else {
+        return 0;
+    }
+    c->ok = 1;
+    return 1;
+}
+
+/**
+ * @brief Sorts the distinct channels of a select by address.
+ *
+ * @param cases Cases.
+ * @param n Number of cases.
+ * @param chans Receives the channels, in locking order.
+ * @return Number of distinct channels.
+ */
+static int qchan_lock_order(qthread_select_case_t *cases, int n, qthread_chan_t **chans) {
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        qthread_chan_t *ch = cases[i].chan;
+        if (!ch) continue;
+        int j = m;
+        while (j > 0 && (uintptr_t)chans[j - 1] > (uintptr_t)ch) j--;
+        if (j > 0 && chans[j - 1] == ch) continue;
+        memmove(&chans[j + 1], &chans[j], (m - j) * sizeof *chans);
+        chans[j] = ch;
+        m++;
+    }
+    return m;
+}
+
+static void qchan_lock_all(qthread_chan_t **chans, int m) {
+    for (int i = 0; i < m; i++) qspin_lock(&chans[i]->lock);
+}
+
+static void qchan_unlock_all(qthread_chan_t **chans, int m) {
+    for (int i = m - 1; i >= 0; i--) qspin_unlock(&chans[i]->lock);
+}
+
+/**
+ * @brief Completes the first ready case, starting from a rotating one.
+ *
+ * Called with every channel of the select locked (at least one), which also
+ * keeps the thread on this kernel thread while it reads the rotor.
+ *
+ * @param cases Cases.
+ * @param n Number of cases.
+ * @param woken Receives the record of a parked peer that must be woken.
+ * @param notify Set if the completed case's channel has outside waiters.
+ * @return Index of the completed case, or -1 if none is ready.
+ */
+static int qchan_try_all(qthread_select_case_t *cases, int n, qchan_waiter_t **woken,
+                         int *notify) {
+    unsigned start = n > 1 ? qchan_rotor++ : 0;
+    for (int k = 0; k < n; k++) {
+        int i = (int)((start + (unsigned)k) % (unsigned)n);
+        if (!cases[i].chan || !qchan_try(&cases[i], woken)) continue;
+        *notify = cases[i].chan->outside_waiters > 0;
+        return i;
+    }
+    return -1;
+}
+
+/**
+ * @brief Locks the channels of a select and completes a ready case, if any.
+ *
+ * The caller wakes the claimed peer and notifies outside waiters: this runs
+ * as a qsched_run predicate, which must do neither.
+ *
+ * @param cases Cases.
+ * @param n Number of cases.
+ * @param[out] woken Parked peer to pass to qchan_wake, or NULL.
+ * @param[out] notify Set if the completed case's channel has outside waiters.
+ * @return Index of the completed case, or -1 if none is ready.
+ */
+static int qchan_poll(qthread_select_case_t *cases, int n, thread_t **woken, int *notify) {
+    qthread_chan_t *chans[QTHREAD_SELECT_MAX];
+    int m = qchan_lock_order(cases, n, chans);
+    qchan_waiter_t *r = NULL;
+
+    qchan_lock_all(chans, m);
+    int chosen = qchan_try_all(cases, n, &r, notify);
+    qchan_unlock_all(chans, m);
+
+    *woken = r ? r->thread : NULL;
+    return chosen;
+}
+
+/**
+ * @brief Wait predicate of a select made outside any thread.
+ *
+ * @param arg The qchan_outside_t.
+ * @return 1 once a case completed or the select timed out.
+ */
+static int qchan_poll_outside(void *arg) {
+    qchan_outside_t *o = arg;
+    if (o->chosen < 0) o->chosen = qchan_poll(o->cases, o->n, &o->woken, &o->notify);
+    return o->chosen >= 0 || __atomic_load_n(&o->expired, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Whether a deadline has passed.
+ *
+ * @param deadline Absolute time (UINT64_MAX for none).
+ * @return 1 if it has passed, 0 otherwise.
+ */
+static int qchan_expired(uint64_t deadline) {
+    return deadline != UINT64_MAX && (!deadline || qtimer_now() >= deadline);
+}
+
+/**
+ * @brief Selects outside any thread.
+ *
+ * The worker runs threads until a case completes; a kernel thread that is
+ * not part of the runtime yields its CPU between polls.
+ *
+ * @param cases Cases.
+ * @param n Number of cases.
+ * @param chans Distinct channels of the cases.
+ * @param m Number of distinct channels.
+ * @param deadline Absolute time to give up at (UINT64_MAX for none).
+ * @return Index of the completed case, or -1.
+ */
+static int qchan_select_outside(qthread_select_case_t *cases, int n, qthread_chan_t **chans,
+                                int m, uint64_t deadline) {
+    qchan_outside_t o = { cases, n, -1, 0, NULL, 0 };
+
+    for (int i = 0; i < m; i++) {
+        qspin_lock(&chans[i]->lock);
+        chans[i]->outside_waiters++;
+        qspin_unlock(&chans[i]->lock);
+    }
+
+    if (qsched_worker()) {
+        qtimer_t timer;
+        if (deadline != UINT64_MAX) qtimer_arm(&timer, deadline, qchan_timeout_outside, &o);
+        qsched_run(qchan_poll_outside, &o);
+        if (deadline != UINT64_MAX) qtimer_cancel(&timer);
+    } else {
+        while (!qchan_poll_outside(&o) && !qchan_expired(deadline))
+            sched_yield();
+    }
+    if (o.woken) qchan_wake(o.woken);
+    if (o.notify) qsched_notify_all();
+
+    for (int i = 0; i < m; i++) {
+        qspin_lock(&chans[i]->lock);
+        chans[i]->outside_waiters--;
+        qspin_unlock(&chans[i]->lock);
+    }
+
+    if (o.chosen >= 0) return o.chosen;
+    errno = qchan_expired(deadline) ? ETIMEDOUT : EDEADLK;
+    return -1;
+}
+
+/**
+ * @brief Performs whichever of several channel operations can proceed first.
+ *
+ * @param cases Operations; the chosen one gets its ok field set.
+ * @param n Number of cases (1 to QTHREAD_SELECT_MAX).
+ * @param deadline Absolute qthread_clock_ns() time to give up at; UINT64_MAX
+ *        waits indefinitely and 0 only polls.
+ * @return Index of the chosen case, or -1 with errno set.
+ */
+int qthread_select(qthread_select_case_t *cases, int n, uint64_t deadline) {
+    if (n <= 0 || n > QTHREAD_SELECT_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    qthread_chan_t *chans[QTHREAD_SELECT_MAX];
+    int m = qchan_lock_order(cases, n, chans);
+    qchan_waiter_t *woken = NULL;
+    int notify = 0;
+
+    qchan_lock_all(chans, m);
+    int chosen = m ? qchan_try_all(cases, n, &woken, &notify) : -1;
+    thread_t *self = qthread_self();
+    if (chosen >= 0 || !self || !m || qchan_expired(deadline)) {
+        qchan_unlock_all(chans, m);
+        if (woken) qchan_wake(woken->thread);
+        if (notify) qsched_notify_all();
+        if (chosen >= 0) return chosen;
+        if (!m) {
+            // Only the deadline to wait for
+            if (deadline == UINT64_MAX) {
+                errno = EDEADLK;
+                return -1;
+            }
+            qthread_sleep_until(deadline);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (!self && !qchan_expired(deadline))
+            return qchan_select_outside(cases, n, chans, m, deadline);
+        // Set last: unlocking may switch threads, which can change errno
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    // Offer every case, then park until a peer or the timeout picks one
+    qchan_waiter_t recs[n];
+    self->wait_status = QWAIT_PENDING;
+    for (int i = 0; i < n; i++) {
+        qthread_chan_t *ch = cases[i].chan;
+        recs[i] = (qchan_waiter_t){ .thread = self, .elem = cases[i].elem, .index = i };
+        if (!ch) continue;
+        qchan_enqueue(cases[i].op == QTHREAD_CHAN_SEND ? &ch->senders : &ch->receivers,
+                      &recs[i]);
+    }
+
+    qtimer_t timer;
+    if (deadline == UINT64_MAX) {
+        self->wait_timer = NULL;
+        qspin_lock(&self->lock);
+        qchan_unlock_all(chans, m);
+        self->state = BLOCKED;
+        qsched_block(&self->lock);
+    } else {
+        self->wait_timer = &timer;
+        qwheel_t *wheel = qtimer_lock_local();
+        qtimer_add(wheel, &timer, deadline, qchan_timeout, self);
+        qchan_unlock_all(chans, m);
+        self->state = BLOCKED;
+        qsched_block(&wheel->lock);
+        qtimer_cancel(&timer);
+    }
+
+    qchan_lock_all(chans, m);
+    for (int i = 0; i < n; i++) {
+        qthread_chan_t *ch = cases[i].chan;
+        if (ch) qchan_dequeue(cases[i].op == QTHREAD_CHAN_SEND ? &ch->senders : &ch->receivers,
+                              &recs[i]);
+    }
+    qchan_unlock_all(chans, m);
+
+    for (int i = 0; i < n; i++) {
+        if (!recs[i].fired) continue;
+        cases[i].ok = recs[i].ok;
+        return i;
+    }
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+/**
+ * @brief Initializes a channel.
+ *
+ * @param ch Channel.
+ * @param elem_size Size of the values it carries.
+ * @param capacity Buffered values (0 for rendezvous, QTHREAD_CHAN_UNBOUNDED for no limit).
+ * @return 0 on success, -1 if the buffer cannot be allocated.
+ */
+int qthread_chan_init(qthread_chan_t *ch, size_t elem_size, size_t capacity) {
+    memset(ch, 0, sizeof *ch);
+    ch->elem_size = elem_size;
+    ch->capacity = capacity;
+    if (!elem_size) {
+        ch->slots = capacity; // Nothing to store, only to count
+        return 0;
+    }
+    if (!capacity || capacity == QTHREAD_CHAN_UNBOUNDED) return 0;
+
+    if (capacity > SIZE_MAX / elem_size) {
+        errno = ENOMEM;
+        return -1;
+    }
+    qpreempt_disable();
+    ch->buf = malloc(capacity * elem_size);
+    qpreempt_enable();
+    if (!ch->buf) return -1;
+    ch->slots = capacity;
+    return 0;
+}
+
+/**
+ * @brief Releases the buffer of a channel nobody uses any more.
+ *
+ * @param ch Channel.
+ */
+void qthread_chan_destroy(qthread_chan_t *ch) {
+    qpreempt_disable();
+    free(ch->buf);
+    qpreempt_enable();
+    ch->buf = NULL;
+    ch->slots = ch->count = 0;
+}
+
+/**
+ * @brief Runs a single channel operation through qthread_select.
+ *
+ * @param ch Channel.
+ * @param op Operation.
+ * @param elem Value or destination.
+ * @param deadline UINT64_MAX to wait, 0 to fail with EAGAIN instead.
+ * @return 0 on success, -1 with errno set otherwise.
+ */
+static int qchan_op(qthread_chan_t *ch, qthread_chan_op op, void *elem, uint64_t deadline) {
+    qthread_select_case_t c = { ch, op, elem, 0 };
+    if (qthread_select(&c, 1, deadline) == -1) {
+        if (errno == ETIMEDOUT) errno = EAGAIN;
+        return -1;
+    }
+    if (!c.ok) {
+        errno = EPIPE;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sends a value, parking the thread until it is buffered or received.
+ *
+ * @param ch Channel.
+ * @param elem Value to send (elem_size bytes).
+ * @return 0 on success, -1 with errno set to EPIPE if the channel is closed.
+ */
+int qthread_chan_send(qthread_chan_t *ch, const void *elem) {
+    return qchan_op(ch, QTHREAD_CHAN_SEND, (void *)elem, UINT64_MAX);
+}
+
+/**
+ * @brief Receives a value, parking the thread until one is available.
+ *
+ * @param ch Channel.
+ * @param elem Where to store the value (can be NULL to drop it).
+ * @return 0 on success, -1 with errno set to EPIPE once the channel is closed and empty.
+ */
+int qthread_chan_recv(qthread_chan_t *ch, void *elem) {
+    return qchan_op(ch, QTHREAD_CHAN_RECV, elem, UINT64_MAX);
+}
+
+/**
+ * @brief Sends a value only if that does not require waiting.
+ *
+ * @param ch Channel.
+ * @param elem Value to send.
+ * @return 0 on success, -1 with errno set to EAGAIN or EPIPE otherwise.
+ */
+int qthread_chan_trysend(qthread_chan_t *ch, const void *elem) {
+    return qchan_op(ch, QTHREAD_CHAN_SEND, (void *)elem, 0);
+}
+
+/**
+ * @brief Receives a value only if one is available right away.
+ *
+ * @param ch Channel.
+ * @param elem Where to store the value (can be NULL).
+ * @return 0 on success, -1 with errno set to EAGAIN or EPIPE otherwise.
+ */
+int qthread_chan_tryrecv(qthread_chan_t *ch, void *elem) {
+    return qchan_op(ch, QTHREAD_CHAN_RECV, elem, 0);
+}
+
+/**
+ * @brief Closes a channel, failing every parked sender and receiver.
+ *
+ * Parked receivers only exist while the buffer is empty, so none of them
+ * misses a buffered value.
+ *
+ * @param ch Channel.
+ * @return 0 on success, -1 with errno set to EPIPE if it was already closed.
+ */
+int qthread_chan_close(qthread_chan_t *ch) {
+    qchan_waiter_t *head = NULL, *r;
+
+    qspin_lock(&ch->lock);
+    if (ch->closed) {
+        qspin_unlock(&ch->lock);
+        errno = EPIPE;
+        return -1;
+    }
+    ch->closed = 1;
+    while ((r = qchan_claim(&ch->receivers))) {
+        if (r->elem && ch->elem_size) memset(r->elem, 0, ch->elem_size);
+        r->ok = 0;
+        r->fired = 1;
+        r->next = head;
+        head = r;
+    }
+    while ((r = qchan_claim(&ch->senders))) {
+        r->ok = 0;
+        r->fired = 1;
+        r->next = head;
+        head = r;
+    }
+    int notify = ch->outside_waiters > 0;
+    qspin_unlock(&ch->lock);
+
+    while ((r = head)) {
+        head = r->next;
+        qchan_wake(r->thread); // r may be gone once its thread runs
+    }
+    if (notify) qsched_notify_all();
+    return 0;
+}
@@ -0,0 +1,182 @@
+/*
+ * @file qcontext.c
+ * @brief Context creation and switching for user-level threads.
+ *
+ * The assembly switch saves only what the calling convention requires the
+ * callee to preserve (plus the floating point control words) on the stack
+ * being left, and stores the resulting stack pointer in the context. Unlike
+ * swapcontext it performs no system call and does not touch the signal mask.
+ */
+#include "qcontext.h"
+#include <stdint.h>
+
+#if QTHREAD_CTX_ASM
+
+/*
+ * Entry trampoline: a fresh context "returns" into it from qcontext_switch
+ * with the entry function and its argument in callee-saved registers.
+ */
+void qcontext_trampoline(void);
+
+#if defined(__x86_64__)
+
+/*
+ * Saved frame, from the stored stack pointer upwards:
+ *   mxcsr, x87 control word | r15 | r14 | r13 | r12 | rbx | rbp | return address
+ */
+__asm__(
+    ".text\n"
+    ".globl qcontext_switch\n"
+    ".hidden qcontext_switch\n"
+    ".type qcontext_switch,@function\n"
+    "qcontext_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq (%rsi), %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size qcontext_switch, .-qcontext_switch\n"
+
+    ".globl qcontext_trampoline\n"
+    ".hidden qcontext_trampoline\n"
+    ".type qcontext_trampoline,@function\n"
+    "qcontext_trampoline:\n"
+    "    .cfi_startproc\n"
+    "    .cfi_undefined rip\n"
+    "    movq %r13, %rdi\n"
+    "    callq *%r12\n"
+    "    ud2\n"
+    "    .cfi_endproc\n"
+    ".size qcontext_trampoline, .-qcontext_trampoline\n"
+);
+
+int qcontext_make(qthread_context_t *ctx, void *stack, size_t size,
+                  void (*entry)(void *), void *arg) {
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+
+    // Return address sits so that %rsp is 16-byte aligned inside the trampoline.
+    uint64_t *sp = (uint64_t *)(top - 24) - 7;
+    sp[0] = 0x037F00001F80ULL;           // Default x87 control word and mxcsr
+    sp[1] = 0;                           // r15
+    sp[2] = 0;                           // r14
+    sp[3] = (uint64_t)(uintptr_t)arg;    // r13
+    sp[4] = (uint64_t)(uintptr_t)entry;  // r12
+    sp[5] = 0;                           // rbx
+    sp[6] = 0;                           // rbp
+    sp[7] = (uint64_t)(uintptr_t)qcontext_trampoline;
+    sp[8] = 0;
+    sp[9] = 0;
+
+    ctx->sp = sp;
+    return 0;
+}
+
+#elif defined(__aarch64__)
+
+/*
+ * Saved frame, from the stored stack pointer upwards (176 bytes):
+ *   x19-x28 | x29, x30 | d8-d15 | fpcr | padding
+ */
+__asm__(
+    ".text\n"
+    ".globl qcontext_switch\n"
+    ".hidden qcontext_switch\n"
+    ".type qcontext_switch,%function\n"
+    "qcontext_switch:\n"
+    "    sub sp, sp, #176\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mrs x9, fpcr\n"
+    "    str x9, [sp, #160]\n"
+    "    mov x9, sp\n"
+    "    str x9, [x0]\n"
+    "    ldr x9, [x1]\n"
+    "    mov sp, x9\n"
+    "    ldr x9, [sp, #160]\n"
+    "    msr fpcr, x9\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #176\n"
+    "    ret\n"
+    ".size qcontext_switch, .-qcontext_switch\n"
+
+    ".globl qcontext_trampoline\n"
+    ".hidden qcontext_trampoline\n"
+    ".type qcontext_trampoline,%function\n"
+    "qcontext_trampoline:\n"
+    "    .cfi_startproc\n"
+    "    .cfi_undefined x30\n"
+    "    mov x0, x20\n"
+    "    blr x19\n"
+    "    brk #0\n"
+    "    .cfi_endproc\n"
+    ".size qcontext_trampoline, .-qcontext_trampoline\n"
+);
+
+int qcontext_make(qthread_context_t *ctx, void *stack, size_t size,
+                  void (*entry)(void *), void *arg) {
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+
+    uint64_t *sp = (uint64_t *)(top - 176);
+    for (int i = 0; i < 22; i++)
+        sp[i] = 0;
+    sp[0] = (uint64_t)(uintptr_t)entry;  // x19
+    sp[1] = (uint64_t)(uintptr_t)arg;    // x20
+    sp[11] = (uint64_t)(uintptr_t)qcontext_trampoline; // x30
+
+    ctx->sp = sp;
+    return 0;
+}
+
+#endif
+
+#else // ucontext fallback
+
+int qcontext_make(qthread_context_t *ctx, void *stack, size_t size,
+                  void (*entry)(void *), void *arg) {
+    if (getcontext(ctx) == -1)
+        return -1;
+    ctx->uc_stack.ss_sp = stack;
+    ctx->uc_stack.ss_size = size;
+    ctx->uc_link = NULL;
+    makecontext(ctx, (void (*)()) entry, 1, arg);
+    return 0;
+}
+
+void qcontext_switch(qthread_context_t *from, qthread_context_t *to) {
+    swapcontext(from, to);
+}
+
+#endif
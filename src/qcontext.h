@@ -0,0 +1,39 @@
+/*
+ * @file qcontext.h
+ * @brief Internal execution context primitives used by the scheduler.
+ *
+ * On x86-64 and aarch64 (ELF) contexts are switched by a small assembly
+ * routine that only saves the callee-saved registers. Every other target,
+ * or a build with QTHREAD_UCONTEXT defined, falls back to ucontext.
+ */
+#ifndef QCONTEXT_H
+#define QCONTEXT_H
+
+#include "../include/qthread.h"
+
+/**
+ * @brief Prepares a context that starts executing entry(arg) on the given stack.
+ *
+ * The entry function must never return; threads leave through qthread_exit().
+ *
+ * @param[out] ctx Context to initialize.
+ * @param[in] stack Lowest address of the stack memory.
+ * @param[in] size Size of the stack in bytes.
+ * @param[in] entry Function executed when the context is first switched to.
+ * @param[in] arg Argument passed to entry.
+ * @return 0 on success, -1 on failure.
+ */
+int qcontext_make(qthread_context_t *ctx, void *stack, size_t size,
+                  void (*entry)(void *), void *arg);
+
+/**
+ * @brief Saves the running context into from and resumes to.
+ *
+ * Returns when some other context switches back to from.
+ *
+ * @param[out] from Storage for the current context.
+ * @param[in] to Context to resume.
+ */
+void qcontext_switch(qthread_context_t *from, qthread_context_t *to);
+
+#endif // QCONTEXT_H
@@ -0,0 +1,210 @@
+/*
+ * @file qedf.c
+ * @brief Earliest-deadline-first scheduling policy.
+ *
+ * Each worker keeps the READY threads that have a deadline in a pairing heap
+ * keyed on it, and the others in a FIFO served round-robin once no deadline
+ * is pending. A thread whose deadline is nearer than the running one's
+ * preempts it when woken, and keeps the CPU through yields and ticks until
+ * a queued deadline is as near.
+ *
+ * Misses are detected lazily, on the paths the policy is on anyway: when a
+ * thread is switched in, switched out or ticked past its deadline. Each
+ * deadline is reported once, so a thread that keeps running late is not
+ * counted again at every tick.
+ */
+#include "qheap.h"
+#include "qsched.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @struct qedf_rq_t
+ * @brief Per-worker state of the EDF policy.
+ */
+typedef struct {
+    qthread_spinlock_t lock; ///< Guards the heap and the FIFO.
+    thread_t *root; ///< Thread with the nearest deadline.
+    thread_t *head; ///< Oldest thread without a deadline, linked through run_next.
+    thread_t *tail; ///< Newest thread without a deadline.
+    int size; ///< Number of queued threads (read without the lock).
+} qedf_rq_t;
+
+/// Handler of deadline misses (NULL for none).
+static qthread_deadline_handler_t qedf_handler;
+
+/// Deadline misses counted so far.
+static uint64_t qedf_misses;
+
+/**
+ * @brief Reports a thread that is past its deadline, once per deadline.
+ *
+ * @param t Thread being switched in, out or ticked.
+ */
+static void qedf_check(thread_t *t) {
+    uint64_t deadline = __atomic_load_n(&t->deadline, __ATOMIC_RELAXED);
+    if (!deadline || __atomic_load_n(&t->deadline_missed, __ATOMIC_RELAXED)) return;
+
+    uint64_t now = qtimer_now();
+    if (now <= deadline) return;
+
+    __atomic_store_n(&t->deadline_missed, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&qedf_misses, 1, __ATOMIC_RELAXED);
+    qthread_deadline_handler_t handler = __atomic_load_n(&qedf_handler, __ATOMIC_ACQUIRE);
+    if (handler) handler(t, now - deadline);
+}
+
+/**
+ * @brief Takes the thread with the nearest deadline, or else the oldest one without.
+ *
+ * @param q Locked instance.
+ * @return The thread, or NULL if the instance is empty.
+ */
+static thread_t *qedf_pop(qedf_rq_t *q) {
+    thread_t *t;
+    if (q->root) {
+        t = qheap_pop(&q->root);
+        t->sched_rq = NULL;
+    } else if (q->head) {
+        t = q->head;
+        q->head = t->run_next;
+        if (!q->head) q->tail = NULL;
+    } else {
+        return NULL;
+    }
+    __atomic_store_n(&q->size, q->size - 1, __ATOMIC_RELAXED);
+    return t;
+}
+
+static void *qedf_init(void) {
+    qedf_rq_t *q = aligned_alloc(64, (sizeof(qedf_rq_t) + 63) & ~(size_t)63);
+    if (q) memset(q, 0, sizeof(*q));
+    return q;
+}
+
+static int qedf_enqueue(void *rq, thread_t *t) {
+    qedf_rq_t *q = rq;
+    uint64_t deadline = __atomic_load_n(&t->deadline, __ATOMIC_RELAXED);
+    qspin_lock(&q->lock);
+    if (deadline) {
+        t->sched_key = deadline;
+        t->sched_rq = q;
+        qheap_push(&q->root, t);
+    } else {
+        t->run_next = NULL;
+        if (q->tail) q->tail->run_next = t;
+        else q->head = t;
+        q->tail = t;
+    }
+    __atomic_store_n(&q->size, q->size + 1, __ATOMIC_RELAXED);
+    qspin_unlock(&q->lock);
+    return 0;
+}
+
+static thread_t *qedf_pick_next(void *rq) {
+    qedf_rq_t *q = rq;
+    if (!__atomic_load_n(&q->size, __ATOMIC_RELAXED)) return NULL;
+
+    qspin_lock(&q->lock);
+    thread_t *t = qedf_pop(q);
+    qspin_unlock(&q->lock);
+    return t;
+}
+
+static thread_t *qedf_steal(void *rq, void *victim) {
+    (void)rq;
+    return qedf_pick_next(victim);
+}
+
+static int qedf_has_work(void *rq) {
+    qedf_rq_t *q = rq;
+    return __atomic_load_n(&q->size, __ATOMIC_SEQ_CST) != 0;
+}
+
+static int qedf_remove(void *rq, thread_t *t) {
+    qedf_rq_t *q = rq;
+    int found = 0;
+    qspin_lock(&q->lock);
+    if (t->sched_rq == q) {
+        qheap_remove(&q->root, t);
+        t->sched_rq = NULL;
+        found = 1;
+    } else {
+        thread_t *prev = NULL;
+        for (thread_t *cur = q->head; cur; prev = cur, cur = cur->run_next) {
+            if (cur != t) continue;
+            if (prev) prev->run_next = t->run_next;
+            else q->head = t->run_next;
+            if (q->tail == t) q->tail = prev;
+            found = 1;
+            break;
+        }
+    }
+    if (found) __atomic_store_n(&q->size, q->size - 1, __ATOMIC_RELAXED);
+    qspin_unlock(&q->lock);
+    return found;
+}
+
+/**
+ * @brief Ranks a thread with a nearer deadline, or any deadline, first.
+ */
+static int qedf_before(thread_t *a, thread_t *b) {
+    uint64_t da = __atomic_load_n(&a->deadline, __ATOMIC_RELAXED);
+    uint64_t db = __atomic_load_n(&b->deadline, __ATOMIC_RELAXED);
+    return da && (!db || da < db);
+}
+
+static void qedf_on_switch(void *rq, thread_t *t) {
+    (void)rq;
+    qedf_check(t);
+}
+
+/**
+ * @brief Ends the slice of t only if a queued thread is at least as urgent.
+ */
+static int qedf_tick(void *rq, thread_t *t) {
+    qedf_rq_t *q = rq;
+    qedf_check(t);
+    if (!__atomic_load_n(&q->size, __ATOMIC_RELAXED)) return 0;
+
+    uint64_t deadline = __atomic_load_n(&t->deadline, __ATOMIC_RELAXED);
+    if (!deadline) return 1; // Anything queued is as urgent
+
+    qspin_lock(&q->lock);
+    int urgent = q->root && q->root->sched_key <= deadline;
+    qspin_unlock(&q->lock);
+    return urgent;
+}
+
+const qthread_policy_t qthread_policy_edf = {
+    .name = "edf",
+    .init = qedf_init,
+    .enqueue = qedf_enqueue,
+    .pick_next = qedf_pick_next,
+    .steal = qedf_steal,
+    .has_work = qedf_has_work,
+    .remove = qedf_remove,
+    .before = qedf_before,
+    .on_yield = qedf_on_switch,
+    .on_block = qedf_on_switch,
+    .on_run = qedf_on_switch,
+    .tick = qedf_tick,
+};
+
+/**
+ * @brief Installs the handler of deadline misses.
+ *
+ * @param handler Handler (NULL to only count misses).
+ */
+void qthread_set_deadline_handler(qthread_deadline_handler_t handler) {
+    __atomic_store_n(&qedf_handler, handler, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Returns the number of deadline misses counted so far.
+ *
+ * @return Misses over all threads.
+ */
+uint64_t qthread_deadline_misses(void) {
+    return __atomic_load_n(&qedf_misses, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,112 @@
+/*
+ * @file qheap.h
+ * @brief Internal pairing heap of threads ordered by thread_t::sched_key.
+ *
+ * Threads are linked through thread_t::heap_child, heap_next and heap_prev,
+ * so queueing needs no allocation and a given thread can be taken out in
+ * O(log n) amortized. Callers serialize access to a heap.
+ */
+#ifndef QHEAP_H
+#define QHEAP_H
+
+#include "../include/qthread.h"
+#include <stddef.h>
+
+/**
+ * @brief Melds two heaps.
+ *
+ * @param a Root of a heap (can be NULL).
+ * @param b Root of another heap (can be NULL).
+ * @return Root of the melded heap.
+ */
+static inline thread_t *qheap_meld(thread_t *a, thread_t *b) {
+    if (!a) return b;
+    if (!b) return a;
+    if (b->sched_key < a->sched_key) {
+        thread_t *x = a;
+        a = b;
+        b = x;
+    }
+    b->heap_prev = a;
+    b->heap_next = a->heap_child;
+    if (a->heap_child) a->heap_child->heap_prev = b;
+    a->heap_child = b;
+    return a;
+}
+
+/**
+ * @brief Melds a list of sibling heaps in two passes.
+ *
+ * Pairs them up from left to right, then melds the pairs from right to left.
+ *
+ * @param first First sibling (can be NULL).
+ * @return Root of the resulting heap.
+ */
+static inline thread_t *qheap_merge_pairs(thread_t *first) {
+    thread_t *pairs = NULL;
+    while (first) {
+        thread_t *a = first, *b = a->heap_next;
+        first = b ? b->heap_next : NULL;
+        a->heap_next = a->heap_prev = NULL;
+        if (b) b->heap_next = b->heap_prev = NULL;
+        a = qheap_meld(a, b);
+        a->heap_next = pairs; // Stack of pairs, the last one on top
+        pairs = a;
+    }
+
+    thread_t *root = NULL;
+    while (pairs) {
+        thread_t *next = pairs->heap_next;
+        pairs->heap_next = NULL;
+        root = qheap_meld(root, pairs);
+        pairs = next;
+    }
+    return root;
+}
+
+/**
+ * @brief Adds a thread to a heap.
+ *
+ * @param root Root of the heap, updated.
+ * @param t Thread, not in any heap; its sched_key is set.
+ */
+static inline void qheap_push(thread_t **root, thread_t *t) {
+    t->heap_child = t->heap_next = t->heap_prev = NULL;
+    *root = qheap_meld(*root, t);
+}
+
+/**
+ * @brief Takes the thread with the lowest key.
+ *
+ * @param root Root of a non-empty heap, updated.
+ * @return The thread.
+ */
+static inline thread_t *qheap_pop(thread_t **root) {
+    thread_t *t = *root;
+    *root = qheap_merge_pairs(t->heap_child);
+    t->heap_child = NULL;
+    return t;
+}
+
+/**
+ * @brief Takes a given thread out of a heap.
+ *
+ * @param root Root of the heap holding t, updated.
+ * @param t Thread.
+ */
+static inline void qheap_remove(thread_t **root, thread_t *t) {
+    if (t == *root) {
+        *root = qheap_merge_pairs(t->heap_child);
+    } else {
+        // Unlink t from its siblings, then meld its children back in
+        if (t->heap_prev->heap_child == t)
+            t->heap_prev->heap_child = t->heap_next;
+        else
+            t->heap_prev->heap_next = t->heap_next;
+        if (t->heap_next) t->heap_next->heap_prev = t->heap_prev;
+        *root = qheap_meld(*root, qheap_merge_pairs(t->heap_child));
+    }
+    t->heap_child = t->heap_next = t->heap_prev = NULL;
+}
+
+#endif // QHEAP_H
@@ -0,0 +1,130 @@
+/*
+ * @file qhist.c
+ * @brief Reading and resetting the latency histograms (see qhist.h).
+ */
+#include "qhist.h"
+#include <stdlib.h>
+#include <string.h>
+
+int qhist_enabled = 0;
+unsigned qhist_gen = 0;
+
+/**
+ * @brief Enables the latency histograms.
+ *
+ * @param enable Nonzero to enable them.
+ * @return 0 on success, -1 if threads already exist.
+ */
+int qthread_set_histograms(int enable) {
+    if (qsched_nworkers) return -1;
+    qhist_enabled = enable != 0;
+    return 0;
+}
+
+int qhist_alloc(qhist_t **hist) {
+    *hist = NULL;
+    if (!qhist_enabled) return 0;
+
+    qhist_t *h = calloc(1, sizeof(*h));
+    if (!h) return -1;
+    h->gen = __atomic_load_n(&qhist_gen, __ATOMIC_RELAXED);
+    *hist = h;
+    return 0;
+}
+
+void qhist_clear(qhist_t *h, unsigned gen) {
+    for (int k = 0; k < 2; k++) {
+        for (int c = 0; c < QTHREAD_HIST_CLASSES; c++) {
+            qthread_hist_t *hist = &h->hist[k][c];
+            __atomic_store_n(&hist->count, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&hist->sum_ns, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&hist->max_ns, 0, __ATOMIC_RELAXED);
+            for (int b = 0; b < QTHREAD_HIST_BUCKETS; b++)
+                __atomic_store_n(&hist->buckets[b], 0, __ATOMIC_RELAXED);
+        }
+    }
+    // Readers look at the samples only once the generation matches
+    __atomic_store_n(&h->gen, gen, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Sums the histograms of every worker since the last reset.
+ *
+ * @param kind Latency to read.
+ * @param prio_class Priority class, or -1 for all of them.
+ * @param[out] hist Histogram.
+ * @return 0 on success, -1 if the histograms are off or an argument is out of range.
+ */
+int qthread_hist_read(qthread_hist_kind kind, int prio_class, qthread_hist_t *hist) {
+    memset(hist, 0, sizeof(*hist));
+    if ((kind != QTHREAD_HIST_WAKE_TO_RUN && kind != QTHREAD_HIST_SLICE) ||
+        prio_class < -1 || prio_class >= QTHREAD_HIST_CLASSES)
+        return -1;
+    if (!qsched_nworkers || !qsched_workers[0].hist) return -1;
+
+    unsigned gen = __atomic_load_n(&qhist_gen, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < qsched_nworkers; i++) {
+        qhist_t *h = qsched_workers[i].hist;
+        if (__atomic_load_n(&h->gen, __ATOMIC_ACQUIRE) != gen) continue; // Not recorded since the reset
+
+        for (int c = 0; c < QTHREAD_HIST_CLASSES; c++) {
+            if (prio_class != -1 && c != prio_class) continue;
+            qthread_hist_t *src = &h->hist[kind][c];
+            hist->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+            hist->sum_ns += __atomic_load_n(&src->sum_ns, __ATOMIC_RELAXED);
+            uint64_t max = __atomic_load_n(&src->max_ns, __ATOMIC_RELAXED);
+            if (max > hist->max_ns) hist->max_ns = max;
+            for (int b = 0; b < QTHREAD_HIST_BUCKETS; b++)
+                hist->buckets[b] += __atomic_load_n(&src->buckets[b], __ATOMIC_RELAXED);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Empties every histogram, lazily on each worker.
+ */
+void qthread_hist_reset(void) {
+    __atomic_add_fetch(&qhist_gen, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Returns the smallest latency counted by a histogram bucket.
+ *
+ * @param bucket Bucket index, up to QTHREAD_HIST_BUCKETS.
+ * @return Lower bound in nanoseconds.
+ */
+uint64_t qthread_hist_bucket_min(int bucket) {
+    if (bucket < QHIST_EXACT) return bucket < 0 ? 0 : (uint64_t)bucket;
+    unsigned i = (unsigned)(bucket - QHIST_EXACT);
+    unsigned e = 4 + (i >> QHIST_SUB_BITS);
+    uint64_t sub = i & ((1u << QHIST_SUB_BITS) - 1);
+    return ((1ull << QHIST_SUB_BITS) + sub) << (e - QHIST_SUB_BITS);
+}
+
+/**
+ * @brief Estimates a percentile of a histogram.
+ *
+ * @param hist Histogram.
+ * @param p Percentile, from 0 to 100.
+ * @return Upper bound of the bucket holding the percentile (at most max_ns), or 0 if empty.
+ */
+uint64_t qthread_hist_percentile(const qthread_hist_t *hist, double p) {
+    if (!hist->count) return 0;
+    if (p < 0) p = 0;
+    if (p > 100) p = 100;
+
+    double x = p / 100 * (double)hist->count;
+    uint64_t rank = (uint64_t)x;
+    if (rank < x || rank < 1) rank++; // Samples at or below the percentile
+    if (rank > hist->count) rank = hist->count;
+
+    uint64_t seen = 0;
+    for (int b = 0; b < QTHREAD_HIST_BUCKETS; b++) {
+        seen += hist->buckets[b];
+        if (seen < rank) continue;
+        uint64_t upper = qthread_hist_bucket_min(b + 1) - 1;
+        return b == QTHREAD_HIST_BUCKETS - 1 || upper > hist->max_ns ? hist->max_ns : upper;
+    }
+    return hist->max_ns;
+}
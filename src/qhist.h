@@ -0,0 +1,124 @@
+/*
+ * @file qhist.h
+ * @brief Internal wake-to-run and slice length histograms of the workers.
+ *
+ * Each worker fills its own histograms on its switch path, so recording is a
+ * few plain increments (published with relaxed atomic stores for readers).
+ * A reset bumps a generation number instead of clearing histograms under
+ * their writers: a worker empties its histograms when it next records and
+ * sees a new generation, and readers skip histograms of an old generation.
+ */
+#ifndef QHIST_H
+#define QHIST_H
+
+#include "qsched.h"
+
+/// Buckets holding one nanosecond value each.
+#define QHIST_EXACT 16
+
+/// log2 of the buckets per power of two above QHIST_EXACT.
+#define QHIST_SUB_BITS 3
+
+/**
+ * @struct qhist_t
+ * @brief Histograms of one worker.
+ */
+typedef struct qhist {
+    unsigned gen; ///< Reset generation the samples belong to.
+    qthread_hist_t hist[2][QTHREAD_HIST_CLASSES]; ///< By qthread_hist_kind and priority class.
+} qhist_t;
+
+/// Whether the histograms are enabled.
+extern int qhist_enabled;
+
+/// Generation bumped by qthread_hist_reset.
+extern unsigned qhist_gen;
+
+/**
+ * @brief Returns the bucket counting a latency.
+ *
+ * @param ns Latency in nanoseconds.
+ * @return Bucket index.
+ */
+static inline unsigned qhist_bucket(uint64_t ns) {
+    if (ns < QHIST_EXACT) return (unsigned)ns;
+    unsigned e = 63 - (unsigned)__builtin_clzll(ns);
+    unsigned b = QHIST_EXACT + ((e - 4) << QHIST_SUB_BITS) +
+                 (unsigned)((ns >> (e - QHIST_SUB_BITS)) & ((1u << QHIST_SUB_BITS) - 1));
+    return b < QTHREAD_HIST_BUCKETS ? b : QTHREAD_HIST_BUCKETS - 1;
+}
+
+/**
+ * @brief Adds a sample to a histogram of the calling worker.
+ */
+static inline void qhist_add(qthread_hist_t *h, uint64_t ns) {
+    unsigned b = qhist_bucket(ns);
+    __atomic_store_n(&h->buckets[b], h->buckets[b] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum_ns, h->sum_ns + ns, __ATOMIC_RELAXED);
+    if (ns > h->max_ns) __atomic_store_n(&h->max_ns, ns, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Returns the priority class of a thread.
+ */
+static inline int qhist_class(thread_t *t) {
+    return __atomic_load_n(&t->priority, __ATOMIC_RELAXED) * QTHREAD_HIST_CLASSES /
+           QTHREAD_PRIO_LEVELS;
+}
+
+/**
+ * @brief Empties the histograms of the calling worker for a new generation.
+ *
+ * @param h Histograms of the calling worker.
+ * @param gen Current generation.
+ */
+void qhist_clear(qhist_t *h, unsigned gen);
+
+/**
+ * @brief Allocates a worker's histograms if they are enabled.
+ *
+ * @param[out] hist The histograms, or NULL when they are off.
+ * @return 0 on success, -1 if the allocation failed.
+ */
+int qhist_alloc(qhist_t **hist);
+
+/**
+ * @brief Records that a thread became READY.
+ *
+ * @param t Thread being created or woken.
+ */
+static inline void qhist_wake(thread_t *t) {
+    if (qhist_enabled) __atomic_store_n(&t->hist_ready, qtimer_now(), __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Records the slice of a thread leaving the CPU and the wait of the next one.
+ *
+ * @param w Calling worker.
+ * @param prev Thread leaving the CPU, its state already set (can be NULL).
+ * @param next Thread about to run (can be NULL).
+ */
+static inline void qhist_switch(qworker_t *w, thread_t *prev, thread_t *next) {
+    qhist_t *h = w->hist;
+    if (!h || (!prev && !next)) return;
+
+    uint64_t now = qtimer_now();
+    unsigned gen = __atomic_load_n(&qhist_gen, __ATOMIC_RELAXED);
+    if (h->gen != gen) qhist_clear(h, gen);
+
+    if (prev) {
+        if (prev->hist_run && now > prev->hist_run)
+            qhist_add(&h->hist[QTHREAD_HIST_SLICE][qhist_class(prev)], now - prev->hist_run);
+        // A blocked thread is stamped again when woken
+        __atomic_store_n(&prev->hist_ready, prev->state == READY ? now : 0, __ATOMIC_RELAXED);
+    }
+    if (next) {
+        uint64_t ready = __atomic_load_n(&next->hist_ready, __ATOMIC_RELAXED);
+        if (ready && now >= ready)
+            qhist_add(&h->hist[QTHREAD_HIST_WAKE_TO_RUN][qhist_class(next)], now - ready);
+        next->hist_run = now;
+    }
+}
+
+#endif // QHIST_H
@@ -0,0 +1,420 @@
+/*
+ * @file qio.c
+ * @brief I/O layer front end, epoll reactor and fiber-blocking socket calls.
+ *
+ * The backend is chosen on first use: the io_uring backend (quring.c) when
+ * it was requested and the kernel supports it, the epoll reactor otherwise.
+ * Both share the wakeup eventfd that interrupts a worker blocked in them.
+ *
+ * A thread whose non-blocking fd is not ready records itself as the fd's
+ * reader or writer and parks. The fd is armed in a shared epoll instance with
+ * EPOLLONESHOT for whatever its waiters need, which also re-registers fds
+ * that were closed and reused since they were last waited on. Workers drain
+ * the epoll instance between scheduling decisions and once their queues run
+ * dry; when every worker is idle, one of them blocks in epoll_wait (up to
+ * the next timer deadline) while the others sleep, and publishing work
+ * interrupts it through an eventfd. Meanwhile the blocked worker is the only
+ * one taking events, so no other worker can swallow its wakeup.
+ */
+#define _GNU_SOURCE // accept4
+#include "../include/qthread.h"
+#include "qio.h"
+#include "qsched.h"
+#include "quring.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+/// Descriptors per chunk of the fd table.
+#define QIO_CHUNK 1024
+
+/// Chunks in the fd table; larger fds fall back to blocking poll().
+#define QIO_CHUNKS 1024
+
+/// Events taken from epoll per call.
+#define QIO_EVENTS 64
+
+/**
+ * @struct qio_desc_t
+ * @brief Threads waiting on one fd.
+ */
+typedef struct {
+    qthread_spinlock_t lock; ///< Guards the waiters; held while a waiter parks.
+    int registered; ///< The fd was added to the epoll instance.
+    thread_t *reader; ///< Thread waiting for the fd to be readable.
+    thread_t *writer; ///< Thread waiting for the fd to be writable.
+} qio_desc_t;
+
+/// Lazily allocated chunks of descriptors, indexed by fd.
+static qio_desc_t *fd_table[QIO_CHUNKS];
+
+#ifdef QTHREAD_IO_URING_DEFAULT
+static qthread_io_backend requested_backend = QTHREAD_IO_URING;
+#else
+static qthread_io_backend requested_backend = QTHREAD_IO_EPOLL;
+#endif
+
+/// Backend in use (-1 until the first I/O call, or if none could be set up).
+static int io_backend = -1;
+
+static pthread_once_t reactor_once = PTHREAD_ONCE_INIT;
+static int epoll_fd = -1;
+static int wakeup_fd = -1;
+
+/// Threads parked on readiness.
+static int waiting = 0;
+
+/// A worker owns the blocking poll.
+static int parked = 0;
+
+/// The eventfd was written and not drained yet.
+static int wakeup_pending = 0;
+
+/**
+ * @brief Selects the I/O backend used by qthread_read and friends.
+ *
+ * @param backend QTHREAD_IO_EPOLL or QTHREAD_IO_URING.
+ * @return 0 on success, -1 if the runtime is already running.
+ */
+int qthread_set_io_backend(qthread_io_backend backend) {
+    if (qsched_nworkers || (backend != QTHREAD_IO_EPOLL && backend != QTHREAD_IO_URING))
+        return -1;
+    requested_backend = backend;
+    return 0;
+}
+
+/**
+ * @brief Creates the wakeup eventfd and sets up the requested backend.
+ */
+static void reactor_init(void) {
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd == -1) return;
+    wakeup_fd = efd;
+
+    if (requested_backend == QTHREAD_IO_URING && quring_init(efd) == 0) {
+        io_backend = QTHREAD_IO_URING;
+        return;
+    }
+
+    // epoll, also when io_uring cannot be set up
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = -1 };
+    if (ep == -1 || epoll_ctl(ep, EPOLL_CTL_ADD, efd, &ev) == -1) {
+        if (ep != -1) close(ep);
+        close(efd);
+        wakeup_fd = -1;
+        return;
+    }
+    epoll_fd = ep;
+    io_backend = QTHREAD_IO_EPOLL;
+}
+
+/**
+ * @brief Returns the backend serving the calling thread's I/O.
+ *
+ * @return The backend, or -1 outside any thread or without a backend.
+ */
+static int qio_backend(void) {
+    if (!qthread_self()) return -1;
+    qpreempt_disable();
+    pthread_once(&reactor_once, reactor_init);
+    qpreempt_enable();
+    return io_backend;
+}
+
+/**
+ * @brief Returns the descriptor of an fd, allocating its chunk if needed.
+ *
+ * @param fd File descriptor.
+ * @return The descriptor, or NULL if fd is out of range or memory is short.
+ */
+static qio_desc_t *qio_desc(int fd) {
+    if (fd < 0 || fd >= QIO_CHUNK * QIO_CHUNKS) return NULL;
+
+    qio_desc_t **slot = &fd_table[fd / QIO_CHUNK];
+    qio_desc_t *chunk = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (!chunk) {
+        qpreempt_disable();
+        qio_desc_t *fresh = calloc(QIO_CHUNK, sizeof(qio_desc_t));
+        if (fresh && !__atomic_compare_exchange_n(slot, &chunk, fresh, 0,
+                                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            free(fresh); // Another thread installed the chunk
+        else
+            chunk = fresh;
+        qpreempt_enable();
+        if (!chunk) return NULL;
+    }
+    return &chunk[fd % QIO_CHUNK];
+}
+
+/**
+ * @brief Arms an fd in epoll for the events its waiters need.
+ *
+ * @param fd File descriptor.
+ * @param d Its descriptor, locked by the caller.
+ * @return 0 on success, -1 on failure (errno set by epoll_ctl).
+ */
+static int qio_arm(int fd, qio_desc_t *d) {
+    struct epoll_event ev = { .events = EPOLLONESHOT, .data.fd = fd };
+    if (d->reader) ev.events |= EPOLLIN | EPOLLRDHUP;
+    if (d->writer) ev.events |= EPOLLOUT;
+
+    int op = d->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(epoll_fd, op, fd, &ev) == -1) {
+        // The fd was closed and reused, or registered by an earlier incarnation
+        if (errno == ENOENT) op = EPOLL_CTL_ADD;
+        else if (errno == EEXIST) op = EPOLL_CTL_MOD;
+        else return -1;
+        if (epoll_ctl(epoll_fd, op, fd, &ev) == -1) return -1;
+    }
+    d->registered = 1;
+    return 0;
+}
+
+/**
+ * @brief Waits until a non-blocking fd is ready.
+ *
+ * Parks the calling thread; outside any thread (or for fds the reactor cannot
+ * track) blocks the kernel thread in poll() instead.
+ *
+ * @param fd File descriptor.
+ * @param events EPOLLIN or EPOLLOUT.
+ * @return 0 once the fd may be ready, -1 on failure.
+ */
+static int qio_wait(int fd, uint32_t events) {
+    thread_t *self = qthread_self();
+    qio_desc_t *d = NULL;
+
+    if (qio_backend() == QTHREAD_IO_EPOLL) d = qio_desc(fd);
+    if (!d) {
+        struct pollfd p = { .fd = fd, .events = events == EPOLLIN ? POLLIN : POLLOUT };
+        while (poll(&p, 1, -1) == -1) {
+            if (errno != EINTR) return -1;
+        }
+        return 0;
+    }
+
+    qspin_lock(&d->lock);
+    thread_t **waiter = events == EPOLLIN ? &d->reader : &d->writer;
+    if (*waiter) {
+        // One reader and one writer per fd
+        qspin_unlock(&d->lock);
+        errno = EBUSY;
+        return -1;
+    }
+    *waiter = self;
+    if (qio_arm(fd, d) == -1) {
+        int saved_errno = errno;
+        *waiter = NULL;
+        qspin_unlock(&d->lock);
+        errno = saved_errno;
+        return -1;
+    }
+    __atomic_add_fetch(&waiting, 1, __ATOMIC_RELAXED);
+    self->state = BLOCKED;
+    qsched_block(&d->lock);
+    return 0;
+}
+
+/**
+ * @brief Wakes the waiters of an fd reported by epoll.
+ *
+ * @param fd File descriptor.
+ * @param events Reported events.
+ * @return Number of threads woken.
+ */
+static int qio_dispatch(int fd, uint32_t events) {
+    qio_desc_t *d = qio_desc(fd);
+    thread_t *reader = NULL, *writer = NULL;
+
+    if (!d) return 0;
+    qspin_lock(&d->lock);
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+        reader = d->reader;
+        d->reader = NULL;
+    }
+    if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+        writer = d->writer;
+        d->writer = NULL;
+    }
+    if (d->reader || d->writer) qio_arm(fd, d); // Still wanted by the other side
+    qspin_unlock(&d->lock);
+
+    int woken = 0;
+    if (reader) {
+        qsched_wake(reader);
+        woken++;
+    }
+    if (writer) {
+        qsched_wake(writer);
+        woken++;
+    }
+    __atomic_sub_fetch(&waiting, woken, __ATOMIC_RELAXED);
+    return woken;
+}
+
+int qio_waiting(void) {
+    return __atomic_load_n(&waiting, __ATOMIC_RELAXED) + quring_inflight();
+}
+
+void qio_wakeup_drain(void) {
+    uint64_t value;
+    ssize_t r = read(wakeup_fd, &value, sizeof(value));
+    (void)r;
+    __atomic_store_n(&wakeup_pending, 0, __ATOMIC_RELEASE);
+}
+
+int qio_poll(uint64_t deadline) {
+    struct epoll_event events[QIO_EVENTS];
+    int n;
+
+    if (io_backend == QTHREAD_IO_URING) return quring_poll(deadline);
+    if (io_backend != QTHREAD_IO_EPOLL) return 0;
+    if (!deadline) {
+        if (!qio_waiting() || qio_parked()) return 0;
+        n = epoll_wait(epoll_fd, events, QIO_EVENTS, 0);
+    } else if (deadline == UINT64_MAX) {
+        n = epoll_wait(epoll_fd, events, QIO_EVENTS, -1);
+    } else {
+        uint64_t now = qtimer_now();
+        uint64_t left = deadline > now ? deadline - now : 0;
+        struct timespec ts = {
+            .tv_sec = (time_t)(left / 1000000000ULL),
+            .tv_nsec = (long)(left % 1000000000ULL),
+        };
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+        n = epoll_pwait2(epoll_fd, events, QIO_EVENTS, &ts, NULL);
+        if (n == -1 && errno == ENOSYS) // Kernel older than 5.11
+#endif
+            n = epoll_wait(epoll_fd, events, QIO_EVENTS, (int)((left + 999999) / 1000000));
+    }
+
+    int woken = 0;
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.fd == -1) {
+            qio_wakeup_drain();
+            continue;
+        }
+        woken += qio_dispatch(events[i].data.fd, events[i].events);
+    }
+    return woken;
+}
+
+int qio_parked(void) {
+    return __atomic_load_n(&parked, __ATOMIC_RELAXED);
+}
+
+int qio_park_begin(void) {
+    if (io_backend == -1 || !qio_waiting()) return 0;
+    return !__atomic_exchange_n(&parked, 1, __ATOMIC_SEQ_CST);
+}
+
+void qio_park_end(void) {
+    __atomic_store_n(&parked, 0, __ATOMIC_RELEASE);
+}
+
+void qio_wakeup(void) {
+    if (__atomic_load_n(&parked, __ATOMIC_RELAXED) &&
+        !__atomic_exchange_n(&wakeup_pending, 1, __ATOMIC_ACQ_REL)) {
+        uint64_t one = 1;
+        ssize_t r = write(wakeup_fd, &one, sizeof(one));
+        (void)r;
+    }
+}
+
+/**
+ * @brief Reads from a non-blocking fd, parking the thread until data arrives.
+ *
+ * @param fd File descriptor in non-blocking mode.
+ * @param buf Destination buffer.
+ * @param count Maximum bytes to read.
+ * @return Bytes read (0 at end of file), or -1 with errno set.
+ */
+ssize_t qthread_read(int fd, void *buf, size_t count) {
+    if (qio_backend() == QTHREAD_IO_URING) return quring_read(fd, buf, count);
+    for (;;) {
+        ssize_t n = read(fd, buf, count);
+        if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return n;
+        if (qio_wait(fd, EPOLLIN) == -1) return -1;
+    }
+}
+
+/**
+ * @brief Writes to a non-blocking fd, parking the thread until there is room.
+ *
+ * @param fd File descriptor in non-blocking mode.
+ * @param buf Source buffer.
+ * @param count Bytes to write.
+ * @return Bytes written (possibly fewer than count), or -1 with errno set.
+ */
+ssize_t qthread_write(int fd, const void *buf, size_t count) {
+    if (qio_backend() == QTHREAD_IO_URING) return quring_write(fd, buf, count);
+    for (;;) {
+        ssize_t n = write(fd, buf, count);
+        if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return n;
+        if (qio_wait(fd, EPOLLOUT) == -1) return -1;
+    }
+}
+
+/**
+ * @brief Accepts a connection, parking the thread until one is pending.
+ *
+ * @param fd Listening socket in non-blocking mode.
+ * @param addr Peer address (can be NULL).
+ * @param addrlen Size of addr on input, of the address on output (can be NULL).
+ * @return The new socket, already non-blocking, or -1 with errno set.
+ */
+int qthread_accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
+    if (qio_backend() == QTHREAD_IO_URING) return quring_accept(fd, addr, addrlen);
+    for (;;) {
+        int s = accept4(fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (s >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return s;
+        if (qio_wait(fd, EPOLLIN) == -1) return -1;
+    }
+}
+
+/**
+ * @brief Connects a socket, parking the thread until the connection completes.
+ *
+ * @param fd Socket in non-blocking mode.
+ * @param addr Address to connect to.
+ * @param addrlen Size of addr.
+ * @return 0 on success, -1 with errno set.
+ */
+int qthread_connect(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+    if (qio_backend() == QTHREAD_IO_URING) return quring_connect(fd, addr, addrlen);
+    if (connect(fd, addr, addrlen) == 0) return 0;
+    if (errno != EINPROGRESS) return -1;
+
+    struct pollfd p = { .fd = fd, .events = POLLOUT };
+    while (poll(&p, 1, 0) == 0) { // Ignore wakeups meant for an earlier use of fd
+        if (qio_wait(fd, EPOLLOUT) == -1) return -1;
+    }
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) return -1;
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Flushes a file to storage, parking the thread on the io_uring backend.
+ *
+ * With the epoll backend (or outside any thread) this is a plain fsync(2).
+ *
+ * @param fd File descriptor.
+ * @return 0 on success, -1 with errno set.
+ */
+int qthread_fsync(int fd) {
+    if (qio_backend() == QTHREAD_IO_URING) return quring_fsync(fd);
+    return fsync(fd);
+}
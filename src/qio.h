@@ -0,0 +1,60 @@
+/*
+ * @file qio.h
+ * @brief Internal I/O reactor parking threads until their fds are ready.
+ */
+#ifndef QIO_H
+#define QIO_H
+
+#include <stdint.h>
+
+/**
+ * @brief Number of threads parked on I/O readiness.
+ */
+int qio_waiting(void);
+
+/**
+ * @brief Wakes the threads whose fds became ready.
+ *
+ * Woken threads are queued on the calling worker. Waiting for events is
+ * reserved to the worker that won qio_park_begin; while it waits, polls by
+ * other workers only hand queued requests to the kernel.
+ *
+ * @param deadline Absolute CLOCK_MONOTONIC time in nanoseconds to wait for
+ *        events until, 0 not to wait, UINT64_MAX to wait indefinitely.
+ * @return Number of threads woken.
+ */
+int qio_poll(uint64_t deadline);
+
+/**
+ * @brief Whether a worker is blocked (or about to block) in qio_poll.
+ */
+int qio_parked(void);
+
+/**
+ * @brief Makes the calling idle worker the one that blocks in the reactor.
+ *
+ * On success the caller must re-check for work before calling qio_poll with
+ * a deadline, then call qio_park_end.
+ *
+ * @return 1 if the caller may block in qio_poll, 0 if another worker does.
+ */
+int qio_park_begin(void);
+
+/**
+ * @brief Ends the blocking poll started with qio_park_begin.
+ */
+void qio_park_end(void);
+
+/**
+ * @brief Resets the wakeup eventfd once a backend has seen it readable.
+ */
+void qio_wakeup_drain(void);
+
+/**
+ * @brief Interrupts the worker blocked in qio_poll, if any.
+ *
+ * Must be called after publishing work, with a full fence in between.
+ */
+void qio_wakeup(void);
+
+#endif // QIO_H
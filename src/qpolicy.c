@@ -0,0 +1,579 @@
+/*
+ * @file qpolicy.c
+ * @brief Scheduling policies shipped with the library.
+ *
+ * A policy orders the READY threads queued on each worker (see
+ * qthread_policy_t). All three keep one instance per worker:
+ *
+ * - Round-robin: a bounded lock-free FIFO ring; priorities are ignored.
+ * - FIFO-priority (the default): per-level FIFOs indexed by a bitmap, with the
+ *   default level kept in a lock-free ring so the common case takes no lock.
+ * - Fair-share: stride scheduling over a binary heap, where every slice a
+ *   thread runs advances its pass by a stride inversely proportional to its
+ *   priority + 1, and the lowest pass runs next.
+ */
+#include "qsched.h"
+#include <stdlib.h>
+#include <string.h>
+
+/// Capacity of a run ring (a power of two).
+#define QRING_SIZE 256
+
+/**
+ * @struct qring_t
+ * @brief Bounded FIFO run queue shared with thieves, like Go's per-P run queues.
+ *
+ * Only the owning worker pushes (at the tail). The owner and thieves take
+ * from the head with a compare-and-swap, so the owner serves its threads in
+ * FIFO (round-robin) order while thieves can grab half of the queue at once.
+ */
+typedef struct {
+    uint32_t head; ///< Next slot to take; advanced by CAS.
+    uint32_t tail; ///< Next slot to fill; written by the owner only.
+    thread_t *buf[QRING_SIZE]; ///< Ring of READY threads.
+} qring_t;
+
+/**
+ * @struct qprioq_t
+ * @brief Per-level FIFOs of READY threads whose priority is not the default.
+ *
+ * Threads are linked through thread_t::run_next. Bit L of the bitmap is set
+ * while level L holds threads, so the most urgent one is found with a single
+ * count-leading-zeros.
+ */
+typedef struct {
+    qthread_spinlock_t lock; ///< Guards the levels.
+    uint64_t bitmap; ///< Non-empty levels (read without the lock).
+    thread_t *head[QTHREAD_PRIO_LEVELS]; ///< Next thread of each level.
+    thread_t *tail[QTHREAD_PRIO_LEVELS]; ///< Last thread of each level.
+} qprioq_t;
+
+/**
+ * @struct qprio_rq_t
+ * @brief Per-worker state of the FIFO-priority policy.
+ */
+typedef struct {
+    qring_t ring; ///< Threads of default priority.
+    qprioq_t prioq; ///< Threads of any other priority.
+} qprio_rq_t;
+
+/// Pass added per slice to a thread of priority 0 under the fair-share policy.
+#define QFAIR_STRIDE (1ULL << 20)
+
+/**
+ * @struct qfair_rq_t
+ * @brief Per-worker state of the fair-share policy.
+ */
+typedef struct {
+    qthread_spinlock_t lock; ///< Guards the heap.
+    thread_t **heap; ///< Min-heap on thread_t::sched_key.
+    int size; ///< Number of queued threads (read without the lock).
+    int capacity; ///< Allocated heap slots.
+    uint64_t pass; ///< Pass of the thread this worker picked last.
+} qfair_rq_t;
+
+/**
+ * @brief Allocates a zeroed, cache-line aligned policy instance.
+ *
+ * @param size Size of the instance.
+ * @return The instance, or NULL on failure.
+ */
+static void *qpolicy_alloc(size_t size) {
+    void *rq = aligned_alloc(64, (size + 63) & ~(size_t)63);
+    if (rq) memset(rq, 0, size);
+    return rq;
+}
+
+/**
+ * @brief Appends a thread to a worker's local run queue.
+ *
+ * @param q Run queue owned by the calling worker.
+ * @param t Thread to enqueue.
+ * @return 0 on success, -1 if the queue is full.
+ */
+static int ring_push(qring_t *q, thread_t *t) {
+    uint32_t tail = q->tail;
+    uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+    if (tail - head >= QRING_SIZE) return -1;
+    __atomic_store_n(&q->buf[tail % QRING_SIZE], t, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * @brief Takes the thread at the head of a run queue.
+ *
+ * @param q Run queue (of any worker).
+ * @return The thread, or NULL if the queue is empty.
+ */
+static thread_t *ring_pop(qring_t *q) {
+    for (;;) {
+        uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        uint32_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+        if (head == tail) return NULL;
+        thread_t *t = __atomic_load_n(&q->buf[head % QRING_SIZE], __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&q->head, &head, head + 1, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return t;
+    }
+}
+
+/**
+ * @brief Moves half of another worker's run queue into an empty local queue.
+ *
+ * @param dst Empty run queue owned by the calling worker.
+ * @param src Victim's run queue.
+ * @return One of the stolen threads (the rest are left in dst), or NULL.
+ */
+static thread_t *ring_steal(qring_t *dst, qring_t *src) {
+    uint32_t dtail = dst->tail;
+    uint32_t n;
+
+    for (;;) {
+        uint32_t head = __atomic_load_n(&src->head, __ATOMIC_ACQUIRE);
+        uint32_t tail = __atomic_load_n(&src->tail, __ATOMIC_ACQUIRE);
+
+        n = tail - head;
+        if (n == 0) return NULL;
+        n -= n / 2;
+        if (n > QRING_SIZE / 2) continue; // Read an inconsistent head/tail pair
+
+        for (uint32_t i = 0; i < n; i++) {
+            thread_t *t = __atomic_load_n(&src->buf[(head + i) % QRING_SIZE], __ATOMIC_RELAXED);
+            __atomic_store_n(&dst->buf[(dtail + i) % QRING_SIZE], t, __ATOMIC_RELAXED);
+        }
+        if (__atomic_compare_exchange_n(&src->head, &head, head + n, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+    }
+
+    // Run the last stolen thread now and publish the others
+    n--;
+    thread_t *t = dst->buf[(dtail + n) % QRING_SIZE];
+    if (n) __atomic_store_n(&dst->tail, dtail + n, __ATOMIC_RELEASE);
+    return t;
+}
+
+/**
+ * @brief Takes a given thread out of the calling worker's own run queue.
+ *
+ * The whole queue is claimed with one compare-and-swap on the head, then the
+ * other threads are pushed back in the same order: thieves may find the
+ * queue empty meanwhile, but never reordered.
+ *
+ * @param q Run queue owned by the calling worker.
+ * @param t Thread to take.
+ * @return 1 if t was taken, 0 if it is not (or no longer) in the queue.
+ */
+static int ring_take(qring_t *q, thread_t *t) {
+    uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = q->tail;
+
+    for (;;) {
+        uint32_t i = head;
+        while (i != tail && __atomic_load_n(&q->buf[i % QRING_SIZE], __ATOMIC_RELAXED) != t) i++;
+        if (i == tail) return 0;
+        if (__atomic_compare_exchange_n(&q->head, &head, tail, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            break;
+    }
+
+    // Slots are refilled no faster than they are read, so copying in place is safe
+    uint32_t end = tail;
+    for (uint32_t i = head; i != tail; i++) {
+        thread_t *x = __atomic_load_n(&q->buf[i % QRING_SIZE], __ATOMIC_RELAXED);
+        if (x != t) __atomic_store_n(&q->buf[end++ % QRING_SIZE], x, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&q->tail, end, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * @brief Checks whether a run queue holds threads.
+ *
+ * @param q Run queue (of any worker).
+ */
+static int ring_busy(qring_t *q) {
+    return __atomic_load_n(&q->head, __ATOMIC_SEQ_CST) != __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Appends a thread to its priority level.
+ *
+ * @param q Priority queue of the calling worker.
+ * @param t Thread to enqueue.
+ * @param level Priority level.
+ */
+static void prioq_push(qprioq_t *q, thread_t *t, int level) {
+    t->run_next = NULL;
+    qspin_lock(&q->lock);
+    if (q->tail[level])
+        q->tail[level]->run_next = t;
+    else
+        q->head[level] = t;
+    q->tail[level] = t;
+    __atomic_store_n(&q->bitmap, q->bitmap | 1ULL << level, __ATOMIC_RELEASE);
+    qspin_unlock(&q->lock);
+}
+
+/**
+ * @brief Returns the most urgent non-empty level of a priority queue.
+ *
+ * @param q Priority queue (of any worker).
+ * @return The level, or -1 if the queue is empty.
+ */
+static int prioq_top(qprioq_t *q) {
+    uint64_t bitmap = __atomic_load_n(&q->bitmap, __ATOMIC_ACQUIRE);
+    return bitmap ? 63 - __builtin_clzll(bitmap) : -1;
+}
+
+/**
+ * @brief Takes the first thread of the most urgent non-empty level.
+ *
+ * @param q Priority queue (of any worker).
+ * @return The thread, or NULL if the queue is empty.
+ */
+static thread_t *prioq_pop(qprioq_t *q) {
+    if (!__atomic_load_n(&q->bitmap, __ATOMIC_RELAXED)) return NULL;
+
+    qspin_lock(&q->lock);
+    thread_t *t = NULL;
+    if (q->bitmap) {
+        int level = 63 - __builtin_clzll(q->bitmap);
+        t = q->head[level];
+        q->head[level] = t->run_next;
+        if (!q->head[level]) {
+            q->tail[level] = NULL;
+            __atomic_store_n(&q->bitmap, q->bitmap & ~(1ULL << level), __ATOMIC_RELAXED);
+        }
+    }
+    qspin_unlock(&q->lock);
+    return t;
+}
+
+/**
+ * @brief Takes a given thread out of its level of a priority queue.
+ *
+ * @param q Priority queue of the calling worker.
+ * @param t Thread to take.
+ * @return 1 if t was taken, 0 if it is not in its current level.
+ */
+static int prioq_take(qprioq_t *q, thread_t *t) {
+    int level = __atomic_load_n(&t->priority, __ATOMIC_RELAXED);
+    if (!(__atomic_load_n(&q->bitmap, __ATOMIC_RELAXED) & 1ULL << level)) return 0;
+
+    int found = 0;
+    qspin_lock(&q->lock);
+    thread_t *prev = NULL;
+    for (thread_t *cur = q->head[level]; cur; prev = cur, cur = cur->run_next) {
+        if (cur != t) continue;
+        if (prev) prev->run_next = t->run_next;
+        else q->head[level] = t->run_next;
+        if (q->tail[level] == t) q->tail[level] = prev;
+        if (!q->head[level])
+            __atomic_store_n(&q->bitmap, q->bitmap & ~(1ULL << level), __ATOMIC_RELAXED);
+        found = 1;
+        break;
+    }
+    qspin_unlock(&q->lock);
+    return found;
+}
+
+// Round-robin: one FIFO ring per worker, blind to priorities
+
+static void *rr_init(void) {
+    return qpolicy_alloc(sizeof(qring_t));
+}
+
+static int rr_enqueue(void *rq, thread_t *t) {
+    return ring_push(rq, t);
+}
+
+static thread_t *rr_pick_next(void *rq) {
+    return ring_pop(rq);
+}
+
+static thread_t *rr_steal(void *rq, void *victim) {
+    return ring_steal(rq, victim);
+}
+
+static int rr_has_work(void *rq) {
+    return ring_busy(rq);
+}
+
+static int rr_remove(void *rq, thread_t *t) {
+    return ring_take(rq, t);
+}
+
+const qthread_policy_t qthread_policy_rr = {
+    .name = "round-robin",
+    .init = rr_init,
+    .enqueue = rr_enqueue,
+    .pick_next = rr_pick_next,
+    .steal = rr_steal,
+    .has_work = rr_has_work,
+    .remove = rr_remove,
+};
+
+// FIFO-priority: the default level in a FIFO ring, the others in a qprioq_t
+
+static void *prio_init(void) {
+    return qpolicy_alloc(sizeof(qprio_rq_t));
+}
+
+static int prio_enqueue(void *rq, thread_t *t) {
+    qprio_rq_t *q = rq;
+    int prio = __atomic_load_n(&t->priority, __ATOMIC_RELAXED);
+    if (prio == QTHREAD_PRIO_DEFAULT) return ring_push(&q->ring, t);
+    prioq_push(&q->prioq, t, prio);
+    return 0;
+}
+
+/**
+ * @brief Takes the most urgent queued thread: higher levels, the default
+ * level, then lower levels.
+ */
+static thread_t *prio_pick_next(void *rq) {
+    qprio_rq_t *q = rq;
+    thread_t *t;
+    if (prioq_top(&q->prioq) > QTHREAD_PRIO_DEFAULT && (t = prioq_pop(&q->prioq))) return t;
+    if ((t = ring_pop(&q->ring))) return t;
+    return prioq_pop(&q->prioq);
+}
+
+static thread_t *prio_steal(void *rq, void *victim) {
+    qprio_rq_t *q = rq, *v = victim;
+    thread_t *t = ring_steal(&q->ring, &v->ring);
+    return t ? t : prioq_pop(&v->prioq);
+}
+
+static int prio_has_work(void *rq) {
+    qprio_rq_t *q = rq;
+    return ring_busy(&q->ring) || __atomic_load_n(&q->prioq.bitmap, __ATOMIC_SEQ_CST);
+}
+
+static int prio_remove(void *rq, thread_t *t) {
+    qprio_rq_t *q = rq;
+    return ring_take(&q->ring, t) || prioq_take(&q->prioq, t);
+}
+
+static int prio_before(thread_t *a, thread_t *b) {
+    return __atomic_load_n(&a->priority, __ATOMIC_RELAXED) >
+           __atomic_load_n(&b->priority, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Lets a time slice end only if a thread as urgent as t is queued.
+ *
+ * Less urgent threads would be put straight back, so the tick is skipped.
+ */
+static int prio_tick(void *rq, thread_t *t) {
+    qprio_rq_t *q = rq;
+    int prio = __atomic_load_n(&t->priority, __ATOMIC_RELAXED);
+    if (prioq_top(&q->prioq) >= prio) return 1;
+    return prio <= QTHREAD_PRIO_DEFAULT && ring_busy(&q->ring);
+}
+
+const qthread_policy_t qthread_policy_prio = {
+    .name = "fifo-priority",
+    .init = prio_init,
+    .enqueue = prio_enqueue,
+    .pick_next = prio_pick_next,
+    .steal = prio_steal,
+    .has_work = prio_has_work,
+    .remove = prio_remove,
+    .before = prio_before,
+    .tick = prio_tick,
+};
+
+// Fair-share: stride scheduling on thread_t::sched_key
+
+/**
+ * @brief Returns the pass a slice adds to a thread under the fair-share policy.
+ *
+ * @param t Thread.
+ */
+static uint64_t fair_stride(thread_t *t) {
+    return QFAIR_STRIDE / (uint64_t)(__atomic_load_n(&t->priority, __ATOMIC_RELAXED) + 1);
+}
+
+/**
+ * @brief Stores a thread at a heap slot, keeping its index up to date.
+ */
+static void fair_place(qfair_rq_t *q, int i, thread_t *t) {
+    q->heap[i] = t;
+    t->sched_index = i;
+}
+
+/**
+ * @brief Moves the thread at slot i up to its place.
+ */
+static void fair_up(qfair_rq_t *q, int i) {
+    thread_t *t = q->heap[i];
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (q->heap[parent]->sched_key <= t->sched_key) break;
+        fair_place(q, i, q->heap[parent]);
+        i = parent;
+    }
+    fair_place(q, i, t);
+}
+
+/**
+ * @brief Moves the thread at slot i down to its place.
+ */
+static void fair_down(qfair_rq_t *q, int i) {
+    thread_t *t = q->heap[i];
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= q->size) break;
+        if (child + 1 < q->size && q->heap[child + 1]->sched_key < q->heap[child]->sched_key)
+            child++;
+        if (t->sched_key <= q->heap[child]->sched_key) break;
+        fair_place(q, i, q->heap[child]);
+        i = child;
+    }
+    fair_place(q, i, t);
+}
+
+/**
+ * @brief Removes the thread at a heap slot.
+ *
+ * @param q Locked instance.
+ * @param i Slot.
+ * @return The thread that was there.
+ */
+static thread_t *fair_delete(qfair_rq_t *q, int i) {
+    thread_t *t = q->heap[i];
+    int last = q->size - 1;
+    __atomic_store_n(&q->size, last, __ATOMIC_RELAXED);
+    if (i != last) {
+        thread_t *moved = q->heap[last];
+        fair_place(q, i, moved);
+        fair_down(q, i);
+        fair_up(q, moved->sched_index);
+    }
+    t->sched_index = -1;
+    return t;
+}
+
+/**
+ * @brief Takes the thread with the lowest pass.
+ *
+ * @param q Instance (of any worker).
+ * @return The thread, or NULL if the heap is empty.
+ */
+static thread_t *fair_pop(qfair_rq_t *q) {
+    if (!__atomic_load_n(&q->size, __ATOMIC_RELAXED)) return NULL;
+
+    qspin_lock(&q->lock);
+    thread_t *t = q->size ? fair_delete(q, 0) : NULL;
+    qspin_unlock(&q->lock);
+    return t;
+}
+
+/**
+ * @brief Brings a thread's pass within one stride of a worker's.
+ *
+ * A thread that slept (or comes from another worker) neither banks the slices
+ * it missed nor pays for ones run elsewhere.
+ *
+ * @param q Instance of the worker the thread is queued on.
+ * @param t Thread.
+ */
+static void fair_clamp(qfair_rq_t *q, thread_t *t) {
+    uint64_t pass = __atomic_load_n(&q->pass, __ATOMIC_RELAXED);
+    uint64_t stride = fair_stride(t);
+    if (t->sched_key < pass) t->sched_key = pass;
+    else if (t->sched_key > pass + stride) t->sched_key = pass + stride;
+}
+
+static void *fair_init(void) {
+    return qpolicy_alloc(sizeof(qfair_rq_t));
+}
+
+static void fair_fini(void *rq) {
+    qfair_rq_t *q = rq;
+    free(q->heap);
+    free(q);
+}
+
+static int fair_enqueue(void *rq, thread_t *t) {
+    qfair_rq_t *q = rq;
+    qspin_lock(&q->lock);
+    if (q->size == q->capacity) {
+        int capacity = q->capacity ? 2 * q->capacity : 64;
+        thread_t **heap = realloc(q->heap, sizeof(thread_t *) * (size_t)capacity);
+        if (!heap) {
+            qspin_unlock(&q->lock);
+            return -1;
+        }
+        q->heap = heap;
+        q->capacity = capacity;
+    }
+    int i = q->size;
+    __atomic_store_n(&q->size, i + 1, __ATOMIC_RELAXED);
+    fair_place(q, i, t);
+    fair_up(q, i);
+    qspin_unlock(&q->lock);
+    return 0;
+}
+
+static thread_t *fair_pick_next(void *rq) {
+    qfair_rq_t *q = rq;
+    thread_t *t = fair_pop(q);
+    if (t && t->sched_key > q->pass) __atomic_store_n(&q->pass, t->sched_key, __ATOMIC_RELAXED);
+    return t;
+}
+
+static thread_t *fair_steal(void *rq, void *victim) {
+    thread_t *t = fair_pop(victim);
+    if (t) fair_clamp(rq, t);
+    return t;
+}
+
+static int fair_has_work(void *rq) {
+    qfair_rq_t *q = rq;
+    return __atomic_load_n(&q->size, __ATOMIC_SEQ_CST) != 0;
+}
+
+static int fair_remove(void *rq, thread_t *t) {
+    qfair_rq_t *q = rq;
+    int found = 0;
+    qspin_lock(&q->lock);
+    int i = t->sched_index;
+    if (i >= 0 && i < q->size && q->heap[i] == t) {
+        fair_delete(q, i);
+        found = 1;
+    }
+    qspin_unlock(&q->lock);
+    return found;
+}
+
+/**
+ * @brief Charges a slice to a thread leaving the CPU.
+ */
+static void fair_charge(void *rq, thread_t *t) {
+    (void)rq;
+    t->sched_key += fair_stride(t);
+}
+
+static void fair_on_wake(void *rq, thread_t *t) {
+    fair_clamp(rq, t);
+}
+
+const qthread_policy_t qthread_policy_fair = {
+    .name = "fair-share",
+    .init = fair_init,
+    .fini = fair_fini,
+    .enqueue = fair_enqueue,
+    .pick_next = fair_pick_next,
+    .steal = fair_steal,
+    .has_work = fair_has_work,
+    .remove = fair_remove,
+    .on_yield = fair_charge,
+    .on_block = fair_charge,
+    .on_wake = fair_on_wake,
+};
@@ -0,0 +1,174 @@
+/*
+ * @file qpreempt.c
+ * @brief Opt-in time-slice preemption driven by per-worker CPU-time timers.
+ *
+ * Each worker arms a POSIX timer on its own CPU-time clock that sends
+ * QPREEMPT_SIGNAL to that worker's kernel thread once per quantum. The
+ * handler runs on the stack of the interrupted thread and yields from there
+ * when it is safe: the worker is not executing scheduler code (which
+ * disables preemption through qpreempt_count, as does holding any scheduler
+ * spinlock) and the thread has not disabled preemption itself. Otherwise
+ * the tick is remembered and the switch happens as soon as preemption is
+ * enabled again.
+ */
+#include "qsched.h"
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/// Signal used for preemption ticks.
+#define QPREEMPT_SIGNAL SIGVTALRM
+
+#if defined(SIGEV_THREAD_ID) && !defined(sigev_notify_thread_id)
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+__thread int qpreempt_count __attribute__((tls_model("initial-exec"))) = 0;
+__thread int qpreempt_pending __attribute__((tls_model("initial-exec"))) = 0;
+
+/// Time slice in microseconds (0 disables preemption).
+static unsigned int quantum_us = 0;
+
+/**
+ * @brief Restores errno after a switch.
+ *
+ * Kept out of line because errno lives in TLS and the compiler may reuse its
+ * address computed before the switch, when the thread may now run on
+ * another worker.
+ *
+ * @param value errno of the thread before it was switched out.
+ */
+static void qpreempt_restore_errno(int value) __attribute__((noinline));
+static void qpreempt_restore_errno(int value) {
+    errno = value;
+}
+
+void qpreempt_resched(void) {
+    qworker_t *w = qsched_worker();
+    int pending = qpreempt_pending;
+
+    qpreempt_pending = 0;
+    if (!w || !w->current || w->current->preempt_disabled) return;
+
+    // The caller may have just set errno, which the threads run meanwhile can change
+    int saved_errno = errno;
+    if (pending & QPREEMPT_URGENT)
+        qsched_preempt();
+    else
+        qsched_tick();
+    qpreempt_restore_errno(saved_errno);
+}
+
+/**
+ * @brief Handler of the preemption tick.
+ *
+ * @param sig Signal number (unused).
+ */
+static void qpreempt_signal(int sig) {
+    (void)sig;
+    qworker_t *w = qsched_worker();
+
+    if (!w || !w->current) return; // In the scheduler or outside the runtime
+
+    if (qpreempt_count || w->current->preempt_disabled) {
+        qpreempt_pending |= QPREEMPT_TICK;
+        return;
+    }
+
+    int saved_errno = errno;
+    qsched_tick();
+    qpreempt_restore_errno(saved_errno);
+}
+
+/**
+ * @brief Enables time-slice preemption.
+ *
+ * A thread that keeps the CPU for a whole quantum (of its worker's CPU time)
+ * is switched out in favour of the next READY thread. Threads can protect
+ * critical sections with qthread_preempt_disable. Must be called before
+ * creating threads.
+ *
+ * @param quantum Time slice in microseconds (0 disables preemption).
+ * @return 0 on success, -1 if the runtime is already running or preemption
+ *         is not supported on this platform.
+ */
+int qthread_set_preemption(unsigned int quantum) {
+#ifdef SIGEV_THREAD_ID
+    if (qsched_nworkers) return -1;
+    quantum_us = quantum;
+    return 0;
+#else
+    (void)quantum;
+    return -1;
+#endif
+}
+
+int qpreempt_start_worker(qworker_t *w) {
+    if (!quantum_us) return 0;
+
+#ifdef SIGEV_THREAD_ID
+    static int installed = 0;
+    if (!installed) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = qpreempt_signal;
+        sigemptyset(&sa.sa_mask);
+        // Not deferred: the handler may switch away and never return on this worker
+        sa.sa_flags = SA_RESTART | SA_NODEFER;
+        if (sigaction(QPREEMPT_SIGNAL, &sa, NULL) == -1) return -1;
+        installed = 1;
+    }
+
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = QPREEMPT_SIGNAL;
+    sev.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &w->preempt_timer) == -1) return -1;
+
+    struct itimerspec its;
+    its.it_interval.tv_sec = quantum_us / 1000000;
+    its.it_interval.tv_nsec = (long)(quantum_us % 1000000) * 1000;
+    its.it_value = its.it_interval;
+    if (timer_settime(w->preempt_timer, 0, &its, NULL) == -1) {
+        timer_delete(w->preempt_timer);
+        return -1;
+    }
+    return 0;
+#else
+    (void)w;
+    return -1;
+#endif
+}
+
+void qpreempt_stop_worker(qworker_t *w) {
+#ifdef SIGEV_THREAD_ID
+    if (quantum_us) timer_delete(w->preempt_timer);
+#else
+    (void)w;
+#endif
+}
+
+/**
+ * @brief Disables preemption of the calling thread (nests).
+ */
+void qthread_preempt_disable(void) {
+    thread_t *self = qthread_self();
+    if (self) self->preempt_disabled++;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Re-enables preemption of the calling thread.
+ *
+ * Yields right away if a tick arrived while preemption was disabled.
+ */
+void qthread_preempt_enable(void) {
+    thread_t *self = qthread_self();
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    if (self && --self->preempt_disabled == 0 && qpreempt_pending && !qpreempt_count)
+        qpreempt_resched();
+}
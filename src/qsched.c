@@ -0,0 +1,925 @@
+/*
+ * @file qsched.c
+ * @brief M:N scheduler: worker kernel threads, run queues and work stealing.
+ *
+ * Every worker owns a run queue, an instance of the scheduling policy
+ * (qthread_policy_t, see qpolicy.c) that decides the order its threads run
+ * in. Threads made runnable on a worker go to its queue; a full queue spills
+ * into a locked global queue that also receives threads created outside the
+ * runtime. Ahead of its queue a worker has a one-thread next slot for
+ * threads that synchronization wakeups and qthread_yield_to hand the CPU to.
+ *
+ * A worker that runs out of local work takes from the global queue, then
+ * steals from a random peer's queue, and finally sleeps until new work is
+ * published or the earliest timer of any worker is due. Threads waiting for
+ * I/O are woken by polling the reactor between decisions and before
+ * stealing; one idle worker blocks in the reactor instead of sleeping.
+ *
+ * Scheduler code runs with preemption disabled (qpreempt_disable); every
+ * context switch happens inside such a section and the resumed context
+ * closes the section it opened before it was switched out.
+ */
+#include "qsched.h"
+#include "qcontext.h"
+#include "qhist.h"
+#include "qio.h"
+#include "qstats.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/// Worker bound to the calling kernel thread.
+static __thread qworker_t *tls_worker __attribute__((tls_model("initial-exec")));
+
+qworker_t *qsched_workers = NULL;
+int qsched_nworkers = 0;
+
+/// Number of workers to start (modifiable via qthread_set_concurrency).
+static int requested_workers = 1;
+
+/**
+ * @struct global_queue_t
+ * @brief Locked FIFO of READY threads, linked through thread_t::run_next.
+ */
+typedef struct {
+    qthread_spinlock_t lock; ///< Guards the list.
+    thread_t *head; ///< Next thread to run.
+    thread_t *tail; ///< Most recently enqueued thread.
+    int size; ///< Number of queued threads (read without the lock).
+} global_queue_t;
+
+/// Overflow from full local queues and threads enqueued outside the runtime.
+static global_queue_t global_queue;
+
+/// Sleeping workers wait on idle_cond under idle_mutex.
+static pthread_mutex_t idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond; // Uses CLOCK_MONOTONIC; set up by qsched_start
+
+/// Number of workers sleeping (or about to sleep) on idle_cond.
+static int idle_count = 0;
+
+thread_t *qsched_main = NULL;
+
+/// qsched_main made READY by another worker, waiting for worker 0 to queue it.
+static thread_t *main_ready = NULL;
+
+/// Descriptor whose stack hosts worker 0's scheduler context while qsched_main is set.
+static thread_t *idle_desc = NULL;
+
+/// Set by qsched_stop to make the other workers exit.
+static int stop_requested = 0;
+
+qworker_t *qsched_worker(void) __attribute__((noinline));
+qworker_t *qsched_worker(void) {
+    return tls_worker;
+}
+
+/**
+ * @brief Sets the number of worker kernel threads.
+ *
+ * Must be called before the first thread is created; later calls have no
+ * effect.
+ *
+ * @param workers Number of workers (at least 1).
+ */
+void qthread_set_concurrency(int workers) {
+    if (workers >= 1 && !qsched_nworkers)
+        requested_workers = workers;
+}
+
+const qthread_policy_t *qsched_policy = &qthread_policy_prio;
+
+/**
+ * @brief Installs the scheduling policy of every worker.
+ *
+ * @param policy Policy to use.
+ * @return 0 on success, -1 if the runtime is running or a mandatory hook is missing.
+ */
+int qthread_set_policy(const qthread_policy_t *policy) {
+    if (qsched_nworkers || !policy || !policy->init || !policy->enqueue ||
+        !policy->pick_next || !policy->has_work)
+        return -1;
+    qsched_policy = policy;
+    return 0;
+}
+
+/**
+ * @brief Appends a thread to the global queue.
+ *
+ * @param t Thread to enqueue.
+ */
+static void global_push(thread_t *t) {
+    t->run_next = NULL;
+    qspin_lock(&global_queue.lock);
+    if (global_queue.tail)
+        global_queue.tail->run_next = t;
+    else
+        global_queue.head = t;
+    global_queue.tail = t;
+    __atomic_store_n(&global_queue.size, global_queue.size + 1, __ATOMIC_RELAXED);
+    qspin_unlock(&global_queue.lock);
+}
+
+/**
+ * @brief Takes the thread at the head of the global queue.
+ *
+ * @return The thread, or NULL if the queue is empty.
+ */
+static thread_t *global_pop(void) {
+    if (!__atomic_load_n(&global_queue.size, __ATOMIC_RELAXED)) return NULL;
+
+    qspin_lock(&global_queue.lock);
+    thread_t *t = global_queue.head;
+    if (t) {
+        global_queue.head = t->run_next;
+        if (!global_queue.head)
+            global_queue.tail = NULL;
+        __atomic_store_n(&global_queue.size, global_queue.size - 1, __ATOMIC_RELAXED);
+    }
+    qspin_unlock(&global_queue.lock);
+    return t;
+}
+
+/**
+ * @brief Takes a given thread out of the global queue.
+ *
+ * @param t Thread to take.
+ * @return 1 if t was taken, 0 if it is not in the queue.
+ */
+static int global_take(thread_t *t) {
+    if (!__atomic_load_n(&global_queue.size, __ATOMIC_RELAXED)) return 0;
+
+    int found = 0;
+    qspin_lock(&global_queue.lock);
+    thread_t *prev = NULL;
+    for (thread_t *cur = global_queue.head; cur; prev = cur, cur = cur->run_next) {
+        if (cur != t) continue;
+        if (prev) prev->run_next = t->run_next;
+        else global_queue.head = t->run_next;
+        if (global_queue.tail == t) global_queue.tail = prev;
+        __atomic_store_n(&global_queue.size, global_queue.size - 1, __ATOMIC_RELAXED);
+        found = 1;
+        break;
+    }
+    qspin_unlock(&global_queue.lock);
+    return found;
+}
+
+/**
+ * @brief Checks whether any queue holds a READY thread a worker may run.
+ *
+ * The main thread waiting for worker 0 to take it is not work for the others.
+ *
+ * @param w Calling worker.
+ */
+static int qsched_has_work(qworker_t *w) {
+    if (__atomic_load_n(&global_queue.size, __ATOMIC_SEQ_CST) ||
+        (w == qsched_workers && __atomic_load_n(&main_ready, __ATOMIC_SEQ_CST)))
+        return 1;
+    for (int i = 0; i < qsched_nworkers; i++) {
+        if (__atomic_load_n(&qsched_workers[i].next, __ATOMIC_SEQ_CST) ||
+            qsched_policy->has_work(qsched_workers[i].rq))
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Wakes one sleeping worker, if any, to pick up newly published work.
+ */
+static void qsched_notify(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&idle_count, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&idle_mutex);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_mutex);
+    }
+    qio_wakeup();
+}
+
+void qsched_notify_all(void) {
+    pthread_mutex_lock(&idle_mutex);
+    pthread_cond_broadcast(&idle_cond);
+    pthread_mutex_unlock(&idle_mutex);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    qio_wakeup();
+}
+
+/**
+ * @brief Puts the calling worker to sleep until there is work or done(arg) holds.
+ *
+ * The sleep also ends when the earliest armed timer is due. If threads wait
+ * for I/O, the first idle worker sleeps in the reactor so their fds wake it.
+ *
+ * @param done Wakeup predicate (can be NULL).
+ * @param arg Argument passed to done.
+ */
+static void qsched_idle_wait(int (*done)(void *), void *arg) {
+    // Read before idle_mutex: firing timers may notify under the wheel locks
+    uint64_t deadline = qtimer_next_deadline();
+    qworker_t *w = qsched_worker();
+
+    if (qio_park_begin()) {
+        if (!qsched_has_work(w) && !(done && done(arg))) qio_poll(deadline);
+        qio_park_end();
+        return;
+    }
+
+    pthread_mutex_lock(&idle_mutex);
+    __atomic_add_fetch(&idle_count, 1, __ATOMIC_SEQ_CST);
+    if (!qsched_has_work(w) && !(done && done(arg))) {
+        if (deadline == UINT64_MAX) {
+            pthread_cond_wait(&idle_cond, &idle_mutex);
+        } else {
+            struct timespec ts = {
+                .tv_sec = (time_t)(deadline / 1000000000ULL),
+                .tv_nsec = (long)(deadline % 1000000000ULL),
+            };
+            pthread_cond_timedwait(&idle_cond, &idle_mutex, &ts);
+        }
+    }
+    __atomic_sub_fetch(&idle_count, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&idle_mutex);
+}
+
+/**
+ * @brief Enqueues a READY thread on a worker (or globally without one).
+ *
+ * @param w Calling worker (can be NULL).
+ * @param t Thread to enqueue.
+ */
+static void qsched_enqueue(qworker_t *w, thread_t *t) {
+    if (t == qsched_main && w != qsched_workers) {
+        // Only worker 0 runs it; wake that one in particular
+        __atomic_store_n(&main_ready, t, __ATOMIC_SEQ_CST);
+        if (w != qsched_workers) qsched_notify_all();
+        return;
+    }
+    if (!w || qsched_policy->enqueue(w->rq, t) == -1)
+        global_push(t);
+}
+
+/**
+ * @brief Puts a READY thread in a worker's next slot.
+ *
+ * @param w Calling worker (can be NULL, then the thread is just enqueued).
+ * @param t Thread to put there.
+ */
+static void qsched_set_next(qworker_t *w, thread_t *t) {
+    if (t == qsched_main) {
+        qsched_enqueue(w, t); // A next slot could be stolen
+        return;
+    }
+    thread_t *old = w ? __atomic_exchange_n(&w->next, t, __ATOMIC_ACQ_REL) : t;
+    if (old) qsched_enqueue(w, old);
+}
+
+/**
+ * @brief Steals work from a random peer.
+ *
+ * Next slots are only taken once every peer's queue is empty, since their
+ * owner is likely about to switch to them.
+ * A stolen main thread goes straight back to worker 0.
+ *
+ * @param w Calling worker, whose run queue is empty.
+ * @return A stolen thread, or NULL if every peer is empty.
+ */
+static thread_t *qsched_steal(qworker_t *w) {
+    int n = qsched_nworkers;
+    if (n == 1) return NULL;
+
+    w->rand = w->rand * 1103515245u + 12345u;
+    int start = (int)((w->rand >> 16) % (unsigned)n);
+    for (int i = 0; i < n; i++) {
+        qworker_t *v = &qsched_workers[(start + i) % n];
+        if (v == w) continue;
+        thread_t *t = qsched_policy->steal ? qsched_policy->steal(w->rq, v->rq) : NULL;
+        if (t && t == qsched_main) {
+            // Only worker 0 runs it: send it back, keeping what was stolen with it
+            qsched_enqueue(w, t);
+            t = qsched_policy->pick_next(w->rq);
+        }
+        if (t) return t;
+    }
+    for (int i = 0; i < n; i++) {
+        qworker_t *v = &qsched_workers[(start + i) % n];
+        if (v == w || !__atomic_load_n(&v->next, __ATOMIC_RELAXED)) continue;
+        thread_t *t = __atomic_exchange_n(&v->next, NULL, __ATOMIC_ACQ_REL);
+        if (t) return t;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Fires due timers of any worker, queueing the threads they wake locally.
+ *
+ * @param w Calling worker.
+ * @return Number of timers fired.
+ */
+static int qsched_poll_timers(qworker_t *w) {
+    int fired = qtimer_poll(&w->wheel);
+    for (int i = 0; i < qsched_nworkers; i++) {
+        if (&qsched_workers[i] != w)
+            fired += qtimer_poll(&qsched_workers[i].wheel);
+    }
+    return fired;
+}
+
+/**
+ * @brief Picks the next thread to run on a worker, wherever it is queued.
+ *
+ * @param w Calling worker.
+ * @return A READY thread removed from its queue, or NULL.
+ */
+static thread_t *qsched_pick(qworker_t *w) {
+    const qthread_policy_t *policy = qsched_policy;
+    thread_t *t;
+    int unlocked = !w->unlock_after;
+
+    // Queue the main thread here once another worker has made it READY
+    if (w == qsched_workers && __atomic_load_n(&main_ready, __ATOMIC_RELAXED) &&
+        (t = __atomic_exchange_n(&main_ready, NULL, __ATOMIC_ACQ_REL)) &&
+        policy->enqueue(w->rq, t) == -1)
+        return t;
+
+    // Move the global queue's head here and poll fds now and then so they cannot starve
+    if (++w->tick % 61 == 0) {
+        if ((t = global_pop()) && policy->enqueue(w->rq, t) == -1) return t;
+        if (unlocked) qio_poll(0);
+    }
+    if (__atomic_load_n(&w->next, __ATOMIC_RELAXED) &&
+        (t = __atomic_exchange_n(&w->next, NULL, __ATOMIC_ACQ_REL)))
+        return t;
+    if (unlocked && w->tick % 16 == 0) qtimer_poll(&w->wheel);
+    if ((t = policy->pick_next(w->rq))) return t;
+    if ((t = global_pop())) return t;
+    if (unlocked && qsched_poll_timers(w) + qio_poll(0) && (t = policy->pick_next(w->rq))) return t;
+    return qsched_steal(w);
+}
+
+/**
+ * @brief Picks the next thread to run on a worker.
+ *
+ * Timers and the I/O reactor are only polled when the caller holds no lock,
+ * since waking their threads may need it.
+ *
+ * @param w Calling worker.
+ * @return A READY thread removed from its queue, or NULL.
+ */
+static thread_t *qsched_find_runnable(qworker_t *w) {
+    thread_t *t = qsched_pick(w);
+    if (t && t == qsched_main && w != qsched_workers) {
+        // Stolen in a batch or taken from the global queue: send it home
+        qsched_enqueue(w, t);
+        t = qsched_pick(w);
+    }
+    return t;
+}
+
+/**
+ * @brief Re-enables preemption after a context switch.
+ *
+ * Kept out of line because the compiler may reuse a TLS address computed
+ * before the switch, and the thread may have resumed on another worker.
+ */
+static void qsched_preempt_enable(void) __attribute__((noinline));
+static void qsched_preempt_enable(void) {
+    qpreempt_enable();
+}
+
+void qsched_finish_switch(qworker_t *w) __attribute__((noinline));
+void qsched_finish_switch(qworker_t *w) {
+    thread_t *prev = w->prev;
+    qthread_spinlock_t *lock = w->unlock_after;
+
+    if (!prev) return;
+    w->prev = NULL;
+    w->unlock_after = NULL;
+
+    switch (prev->state) {
+    case READY:
+        // Yielded: it may run anywhere now that its context is saved
+        if (w->prev_to_next) {
+            w->prev_to_next = 0;
+            qsched_set_next(w, prev);
+        } else {
+            qsched_enqueue(w, prev);
+        }
+        break;
+    case FINISHED: {
+        // Joiners may release the stack we just left; let them in
+        thread_t *j = prev->joiners;
+        int notify = prev->outside_joins > 0;
+        prev->joiners = NULL;
+        qspin_unlock(lock);
+        while (j) {
+            thread_t *next = j->wait_next;
+            j->wait_next = NULL;
+            qsched_wake(j);
+            j = next;
+        }
+        if (notify) qsched_notify_all();
+        break;
+    }
+    default:
+        // Blocked: whoever wakes it needs the lock we release here
+        qspin_unlock(lock);
+        break;
+    }
+}
+
+/**
+ * @brief Switches from the running context of a worker to another one.
+ *
+ * @param w Calling worker.
+ * @param prev Thread being left (NULL when leaving the scheduler context).
+ * @param next Thread to run (NULL to enter the scheduler context).
+ * @param forced Whether a READY prev is preempted rather than yielding.
+ */
+static void qsched_switch(qworker_t *w, thread_t *prev, thread_t *next, int forced) {
+    if (prev) {
+        if (prev->state == READY) {
+            if (qsched_policy->on_yield) qsched_policy->on_yield(w->rq, prev);
+        } else if (qsched_policy->on_block) {
+            qsched_policy->on_block(w->rq, prev);
+        }
+    }
+    if (next && qsched_policy->on_run) qsched_policy->on_run(w->rq, next);
+    qstats_switch(w, prev, next, forced);
+    qhist_switch(w, prev, next);
+    if (w->trace) {
+        uint32_t type = !prev || prev->state == READY ? QTRACE_SWITCH
+                      : prev->state == BLOCKED ? QTRACE_BLOCK : QTRACE_EXIT;
+        qtrace_record(w->trace, type, forced ? QTRACE_PREEMPTED : 0, prev, next);
+    }
+    w->prev = prev;
+    w->current = next;
+    if (next) next->state = RUNNING;
+    qpreempt_pending = 0; // This switch serves any pending tick or urgent thread
+
+    qcontext_switch(prev ? &prev->context : &w->sched_context,
+                    next ? &next->context : &w->sched_context);
+
+    // Possibly on another worker now
+    qsched_finish_switch(qsched_worker());
+}
+
+/**
+ * @brief Tells whether the policy ranks one thread before another.
+ *
+ * @param a Thread.
+ * @param b Thread.
+ * @return Nonzero if a must run before b.
+ */
+static int qsched_before(thread_t *a, thread_t *b) {
+    return qsched_policy->before && qsched_policy->before(a, b);
+}
+
+/**
+ * @brief Preempts the running thread if a thread it woke must run first.
+ *
+ * The switch happens when the caller's preemption section ends, like a
+ * deferred tick.
+ *
+ * @param w Calling worker (can be NULL).
+ * @param t Thread just made READY.
+ */
+static void qsched_check_preempt(qworker_t *w, thread_t *t) {
+    if (w && w->current && qsched_before(t, w->current))
+        qpreempt_pending |= QPREEMPT_URGENT;
+}
+
+void qsched_wake(thread_t *t) {
+    qpreempt_disable();
+    qworker_t *w = qsched_worker();
+    t->state = READY;
+    qstats_wake(t);
+    qhist_wake(t);
+    if (w) qtrace_record(w->trace, QTRACE_WAKE, 0, t, w->current);
+    if (w && qsched_policy->on_wake) qsched_policy->on_wake(w->rq, t);
+    qsched_enqueue(w, t);
+    qsched_check_preempt(w, t);
+    qsched_notify();
+    qpreempt_enable();
+}
+
+void qsched_handoff(thread_t *t) {
+    qpreempt_disable();
+    qworker_t *w = qsched_worker();
+    t->state = READY;
+    qstats_wake(t);
+    qhist_wake(t);
+    if (w) qtrace_record(w->trace, QTRACE_WAKE, 0, t, w->current);
+    if (w && qsched_policy->on_wake) qsched_policy->on_wake(w->rq, t);
+    // Threads the waker outranks could be outranked by queued ones too
+    if (w && w->current && qsched_before(w->current, t))
+        qsched_enqueue(w, t);
+    else
+        qsched_set_next(w, t);
+    qsched_check_preempt(w, t);
+    qsched_notify();
+    qpreempt_enable();
+}
+
+/**
+ * @brief Takes a READY thread from wherever the calling worker can reach it.
+ *
+ * @param w Calling worker.
+ * @param t Thread to take.
+ * @return 1 if t was taken and may be switched to, 0 otherwise.
+ */
+static int qsched_take(qworker_t *w, thread_t *t) {
+    thread_t *expected = t;
+    if (t == qsched_main) {
+        if (w != qsched_workers) return 0;
+        if (__atomic_compare_exchange_n(&main_ready, &expected, NULL, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return 1;
+        expected = t;
+    }
+    if (__atomic_compare_exchange_n(&w->next, &expected, NULL, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return 1;
+    return (qsched_policy->remove && qsched_policy->remove(w->rq, t)) || global_take(t);
+}
+
+/**
+ * @brief Switches straight to a READY thread, skipping the threads ahead of it.
+ *
+ * The caller takes the next slot, so the target can hand the CPU back
+ * without touching a queue. Outside any thread, or when the target is not
+ * reachable (it runs, is blocked or waits in another worker's queue), this
+ * is a plain yield.
+ *
+ * @param target Thread to run.
+ * @return 0 if the CPU went to target, -1 if the caller yielded normally.
+ */
+int qthread_yield_to(thread_t *target) {
+    qpreempt_disable();
+    qworker_t *w = qsched_worker();
+    thread_t *prev = w ? w->current : NULL;
+
+    if (!prev || !target || target == prev || !qsched_take(w, target)) {
+        qpreempt_enable();
+        qsched_yield();
+        return -1;
+    }
+
+    prev->state = READY;
+    w->prev_to_next = 1;
+    qsched_switch(w, prev, target, 0);
+    qsched_preempt_enable();
+    return 0;
+}
+
+/**
+ * @brief Changes the scheduling priority of a thread.
+ *
+ * A READY thread queued where the calling worker can reach it is requeued
+ * under its new priority at once; one queued elsewhere keeps its place until
+ * it runs. A running thread that lowers its own priority yields to any
+ * queued thread that is now more urgent.
+ *
+ * @param thread Thread to change.
+ * @param prio New priority, from 0 to QTHREAD_PRIO_MAX.
+ * @return 0 on success, -1 if prio is out of range.
+ */
+int qthread_set_priority(thread_t *thread, int prio) {
+    if (!thread || prio < 0 || prio > QTHREAD_PRIO_MAX) return -1;
+
+    qpreempt_disable();
+    qworker_t *w = qsched_worker();
+    // Policies may file a thread under its priority, so take it out before changing it
+    int requeue = w && thread != w->current && qsched_take(w, thread);
+    int old = __atomic_exchange_n(&thread->priority, prio, __ATOMIC_RELAXED);
+    if (requeue) {
+        qsched_enqueue(w, thread);
+        qsched_check_preempt(w, thread);
+    }
+    qpreempt_enable();
+
+    if (prio < old && thread == qthread_self()) qsched_yield();
+    return 0;
+}
+
+/**
+ * @brief Returns the scheduling priority of a thread.
+ *
+ * @param thread Thread.
+ * @return Its priority.
+ */
+int qthread_get_priority(thread_t *thread) {
+    return __atomic_load_n(&thread->priority, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Changes the deadline of a thread.
+ *
+ * Requeued like a priority change, so a queued thread is refiled under its
+ * new deadline. A running thread that pushes its own deadline back yields to
+ * any queued thread that is now more urgent.
+ *
+ * @param thread Thread to change.
+ * @param deadline Absolute qthread_clock_ns() time (0 = none).
+ * @return 0 on success, -1 if thread is NULL.
+ */
+int qthread_set_deadline(thread_t *thread, uint64_t deadline) {
+    if (!thread) return -1;
+
+    qpreempt_disable();
+    qworker_t *w = qsched_worker();
+    int requeue = w && thread != w->current && qsched_take(w, thread);
+    uint64_t old = __atomic_exchange_n(&thread->deadline, deadline, __ATOMIC_RELAXED);
+    __atomic_store_n(&thread->deadline_missed, 0, __ATOMIC_RELAXED);
+    if (requeue) {
+        qsched_enqueue(w, thread);
+        qsched_check_preempt(w, thread);
+    }
+    qpreempt_enable();
+
+    int later = old && (!deadline || deadline > old);
+    if (later && thread == qthread_self()) qsched_yield();
+    return 0;
+}
+
+/**
+ * @brief Returns the deadline of a thread.
+ *
+ * @param thread Thread.
+ * @return Its absolute deadline, or 0 if it has none.
+ */
+uint64_t qthread_get_deadline(thread_t *thread) {
+    return __atomic_load_n(&thread->deadline, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Yields or preempts the running thread (see qsched_yield).
+ *
+ * @param forced Whether the switch is a preemption.
+ */
+static void qsched_reschedule(int forced) {
+    // Pin the thread to this worker before looking at it
+    qpreempt_disable();
+    qworker_t *w = qsched_worker();
+
+    thread_t *prev = w ? w->current : NULL;
+    if (!prev) {
+        qpreempt_enable();
+        if (w) qsched_run(NULL, NULL);
+        return;
+    }
+
+    // A yield (or preemption tick) serves the queue, ending any chain of handoffs
+    thread_t *next = __atomic_exchange_n(&w->next, NULL, __ATOMIC_ACQ_REL);
+    if (next) qsched_enqueue(w, next);
+
+    next = qsched_find_runnable(w);
+    if (next && qsched_before(prev, next)) {
+        qsched_enqueue(w, next); // Nothing as urgent is waiting: keep running
+        next = NULL;
+    }
+    if (next) {
+        prev->state = READY;
+        qsched_switch(w, prev, next, forced);
+    }
+    qsched_preempt_enable();
+}
+
+void qsched_yield(void) {
+    qsched_reschedule(0);
+}
+
+void qsched_preempt(void) {
+    qsched_reschedule(1);
+}
+
+void qsched_tick(void) {
+    qpreempt_disable();
+    qworker_t *w = qsched_worker();
+    int expired = w && w->current;
+    if (expired && qsched_policy->tick) {
+        // Let timers and fds queue their threads before the policy looks
+        qsched_poll_timers(w);
+        qio_poll(0);
+        expired = qsched_policy->tick(w->rq, w->current);
+    }
+    qpreempt_enable();
+    if (expired) qsched_preempt();
+}
+
+void qsched_block(qthread_spinlock_t *lock) {
+    qpreempt_disable();
+    qworker_t *w = qsched_worker();
+
+    w->unlock_after = lock;
+    qsched_switch(w, w->current, qsched_find_runnable(w), 0);
+    qsched_preempt_enable();
+}
+
+void qsched_run(int (*done)(void *), void *arg) {
+    for (;;) {
+        qworker_t *w = qsched_worker();
+        thread_t *t;
+
+        qpreempt_disable();
+        while (!(done && done(arg)) && (t = qsched_find_runnable(w)))
+            qsched_switch(w, NULL, t, 0);
+        qpreempt_enable();
+
+        if (!done || done(arg)) return;
+        if (qsched_nworkers == 1 && qtimer_next_deadline() == UINT64_MAX && !qio_waiting()) return;
+        qsched_idle_wait(done, arg);
+    }
+}
+
+/**
+ * @brief Tells whether qsched_stop asked the workers to exit (predicate for qsched_idle_wait).
+ *
+ * @param arg Unused.
+ */
+static int qsched_stopping(void *arg) {
+    (void)arg;
+    return __atomic_load_n(&stop_requested, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Main loop of the worker kernel threads other than worker 0.
+ *
+ * A worker whose preemption timer cannot be started says so and runs
+ * without preemption.
+ *
+ * @param arg The worker.
+ */
+static void *qsched_worker_main(void *arg) {
+    qworker_t *w = arg;
+    tls_worker = w;
+
+    // Wait until qsched_start has published how many workers did start
+    pthread_mutex_lock(&idle_mutex);
+    while (!__atomic_load_n(&qsched_nworkers, __ATOMIC_ACQUIRE))
+        pthread_cond_wait(&idle_cond, &idle_mutex);
+    pthread_mutex_unlock(&idle_mutex);
+
+    int preempt = qpreempt_start_worker(w) == 0;
+    if (!preempt) fprintf(stderr, "qthread: worker %d runs without preemption\n", w->id);
+    while (!qsched_stopping(NULL)) {
+        qsched_run(NULL, NULL);
+        qsched_idle_wait(qsched_stopping, NULL);
+    }
+    if (preempt) qpreempt_stop_worker(w);
+    return NULL;
+}
+
+/**
+ * @brief Scheduler context of worker 0 while the main thread is registered.
+ *
+ * Runs the other threads while the main thread is parked and idles when
+ * there are none. A single worker with no READY thread, timer or awaited fd
+ * can never run a thread again: report the deadlock instead of hanging.
+ *
+ * @param arg Worker 0.
+ */
+static void qsched_idle_main(void *arg) {
+    qsched_finish_switch(arg);
+    qpreempt_enable();
+    for (;;) {
+        qsched_run(NULL, NULL);
+        if (qsched_nworkers == 1 && !qsched_has_work(arg) &&
+            qtimer_next_deadline() == UINT64_MAX && !qio_waiting()) {
+            fputs("qthread: deadlock, every thread is blocked\n", stderr);
+            abort();
+        }
+        qsched_idle_wait(NULL, NULL);
+    }
+}
+
+int qsched_register_main(thread_t *t) {
+    qworker_t *w = qsched_worker();
+    if (!w || w != qsched_workers || w->current || qsched_main) return -1;
+
+    thread_t *idle = qstack_acquire(&w->stacks, DEFAULT_STACK_SIZE);
+    if (!idle) return -1;
+    if (qcontext_make(&w->sched_context, idle->stack, idle->stack_size, qsched_idle_main, w) == -1) {
+        qstack_release(&w->stacks, idle);
+        return -1;
+    }
+
+    qpreempt_disable();
+    idle_desc = idle;
+    t->state = RUNNING;
+    qsched_main = t;
+    w->current = t;
+    qpreempt_enable();
+    return 0;
+}
+
+/**
+ * @brief Frees a worker's policy instance.
+ *
+ * @param rq Instance.
+ */
+static void qsched_free_rq(void *rq) {
+    if (qsched_policy->fini) qsched_policy->fini(rq);
+    else free(rq);
+}
+
+/**
+ * @brief Frees the policy instances and buffers of workers that never ran.
+ *
+ * @param workers Workers.
+ * @param from First worker to free.
+ * @param to One past the last worker to free.
+ */
+static void qsched_free_workers(qworker_t *workers, int from, int to) {
+    for (int i = from; i < to; i++) {
+        qsched_free_rq(workers[i].rq);
+        free(workers[i].trace);
+        free(workers[i].hist);
+    }
+}
+
+void qsched_stop(void) {
+    qworker_t *w = qsched_workers;
+
+    __atomic_store_n(&stop_requested, 1, __ATOMIC_SEQ_CST);
+    qsched_notify_all();
+    for (int i = 1; i < qsched_nworkers; i++)
+        pthread_join(qsched_workers[i].tid, NULL);
+
+    qpreempt_disable();
+    qpreempt_stop_worker(w);
+    w->current = NULL;
+    qsched_main = NULL;
+    if (idle_desc) {
+        qstack_release(&w->stacks, idle_desc);
+        idle_desc = NULL;
+    }
+    for (int i = 0; i < qsched_nworkers; i++) {
+        qstack_trim(&qsched_workers[i].stacks, 0);
+        qstats_retire(&qsched_workers[i]);
+        free(qsched_workers[i].trace);
+        free(qsched_workers[i].hist);
+        qsched_free_rq(qsched_workers[i].rq);
+    }
+    pthread_cond_destroy(&idle_cond);
+
+    free(qsched_workers);
+    qsched_workers = NULL;
+    qsched_nworkers = 0;
+    tls_worker = NULL;
+    __atomic_store_n(&stop_requested, 0, __ATOMIC_RELAXED);
+    qpreempt_pending = 0; // A tick that raced the timer's removal has nothing to preempt
+    qpreempt_enable();
+}
+
+int qsched_start(void) {
+    if (qsched_nworkers) return 0;
+
+    int n = requested_workers;
+    qworker_t *workers = aligned_alloc(64, sizeof(qworker_t) * n);
+    if (!workers) return -1;
+
+    uint64_t now = qtimer_now() >> QTIMER_TICK_SHIFT;
+    for (int i = 0; i < n; i++) {
+        qworker_t *w = &workers[i];
+        *w = (qworker_t){0};
+        w->id = i;
+        w->rand = 0x9e3779b9u * (unsigned)(i + 1);
+        w->wheel.now = now;
+        if (!(w->rq = qsched_policy->init()) || qtrace_alloc(&w->trace) == -1 ||
+            qhist_alloc(&w->hist) == -1) {
+            if (w->rq) qsched_free_rq(w->rq);
+            free(w->trace);
+            qsched_free_workers(workers, 0, i);
+            free(workers);
+            return -1;
+        }
+    }
+
+    tls_worker = &workers[0];
+    workers[0].tid = pthread_self();
+    if (qpreempt_start_worker(&workers[0]) == -1) {
+        tls_worker = NULL;
+        qsched_free_workers(workers, 0, n);
+        free(workers);
+        return -1;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&idle_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    qsched_workers = workers;
+    int started = 1;
+    while (started < n && pthread_create(&workers[started].tid, NULL, qsched_worker_main,
+                                         &workers[started]) == 0)
+        started++;
+    // Run with the workers that did start
+    qsched_free_workers(workers, started, n);
+
+    // The workers wait for the count before they read it
+    __atomic_store_n(&qsched_nworkers, started, __ATOMIC_RELEASE);
+    qsched_notify_all();
+    return 0;
+}
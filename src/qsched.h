@@ -0,0 +1,214 @@
+/*
+ * @file qsched.h
+ * @brief Internal M:N scheduler: workers, run queues and thread state changes.
+ *
+ * Each worker is a kernel thread with its own run queue, kept by the
+ * scheduling policy (qthread_policy_t). A thread leaving the CPU (yield,
+ * block or exit) switches directly to the next runnable thread, or to the
+ * worker's scheduler context when there is none. Whatever has to
+ * happen to the thread that was left (re-enqueueing it, releasing the lock
+ * it blocked under, waking its joiners) is done by the next context right
+ * after the switch, once the old context is completely saved and another
+ * worker may safely pick the thread up.
+ */
+#ifndef QSCHED_H
+#define QSCHED_H
+
+#include "../include/qthread.h"
+#include "qspinlock.h"
+#include "qstack.h"
+#include "qtimer.h"
+#include "qtrace.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+struct qhist;
+
+/**
+ * @struct qworker_t
+ * @brief Per kernel thread scheduler state.
+ */
+typedef struct qworker {
+    void *rq; ///< Local READY threads, in the scheduling policy's instance.
+    thread_t *next; ///< READY thread to run before the local queue; taken with an exchange.
+    int id; ///< Index in qsched_workers.
+    thread_t *current; ///< Thread running on this worker (NULL in the scheduler context).
+    qthread_context_t sched_context; ///< Context of the worker's own stack.
+    thread_t *prev; ///< Thread just switched away from, pending post-switch handling.
+    qthread_spinlock_t *unlock_after; ///< Lock to release once prev is switched out.
+    int prev_to_next; ///< Whether a READY prev goes to the next slot instead of the queue.
+    unsigned tick; ///< Scheduling decisions taken, used to poll the global queue fairly.
+    unsigned rand; ///< State of the victim selection generator.
+    qstack_cache_t stacks; ///< Stack cache of this worker.
+    qwheel_t wheel; ///< Timers armed by threads running on this worker.
+    pthread_t tid; ///< Kernel thread running the worker.
+    timer_t preempt_timer; ///< CPU-time timer sending preemption ticks.
+    qtrace_ring_t *trace; ///< Events recorded on this worker (NULL unless tracing).
+    struct qhist *hist; ///< Latency histograms of this worker (NULL unless enabled).
+    qthread_stats_t stats; ///< Statistics of every thread switched on this worker (zero without QTHREAD_STATS).
+} __attribute__((aligned(64))) qworker_t;
+
+/// All workers; worker 0 is the kernel thread that started the runtime.
+extern qworker_t *qsched_workers;
+
+/// Number of workers (0 before the runtime starts).
+extern int qsched_nworkers;
+
+/// Scheduling policy of every worker.
+extern const qthread_policy_t *qsched_policy;
+
+/// Thread registered by qthread_init, bound to worker 0 (NULL if none).
+extern thread_t *qsched_main;
+
+/**
+ * @brief Starts the runtime on first use.
+ *
+ * The calling kernel thread becomes worker 0; the other workers are started
+ * as kernel threads, and the runtime runs with those that did start.
+ *
+ * @return 0 on success, -1 on failure (including worker 0's preemption timer).
+ */
+int qsched_start(void);
+
+/**
+ * @brief Makes the calling context the running thread of worker 0.
+ *
+ * Worker 0's scheduler context moves to a stack of its own, where it runs
+ * the other threads and idles while t is parked. t is only queued on worker
+ * 0: other workers that make it READY hand it over through a slot of its
+ * own, and send it back through that slot if they steal or pick it up.
+ *
+ * @param t Descriptor of the calling context (its stack fields unused).
+ * @return 0 on success, -1 if the caller is not worker 0 outside any thread.
+ */
+int qsched_register_main(thread_t *t);
+
+/**
+ * @brief Stops the runtime started by qsched_start.
+ *
+ * Called on worker 0 by the main thread or outside any thread, once every
+ * other thread has finished: joins the other workers, disarms preemption
+ * and frees the workers with their queues and stack caches. The caller is
+ * outside the runtime afterwards.
+ */
+void qsched_stop(void);
+
+/**
+ * @brief Returns the worker bound to the calling kernel thread.
+ *
+ * Threads may migrate between workers whenever they switch out, so the
+ * result must not be kept across a context switch.
+ *
+ * @return The worker, or NULL if the kernel thread is not part of the runtime.
+ */
+qworker_t *qsched_worker(void);
+
+/**
+ * @brief Makes a new or woken thread runnable on the calling worker.
+ *
+ * @param t Thread to enqueue; its state is set to READY.
+ */
+void qsched_wake(thread_t *t);
+
+/**
+ * @brief Makes a woken thread the next one the calling worker runs.
+ *
+ * Used by synchronization objects waking a thread on behalf of the running
+ * one: the woken thread takes the worker's next slot, so it runs as soon as
+ * the waker leaves the CPU (or switches to it with qthread_yield_to) while
+ * the data they share is still in cache. A thread displaced from the slot
+ * goes to the run queue.
+ *
+ * @param t Thread to make runnable; its state is set to READY.
+ */
+void qsched_handoff(thread_t *t);
+
+/**
+ * @brief Yields the CPU to another READY thread, if any.
+ *
+ * Outside any thread, runs threads until the worker finds nothing to do.
+ */
+void qsched_yield(void);
+
+/**
+ * @brief Switches the running thread out for a more urgent READY thread, if any.
+ *
+ * Like qsched_yield, but counted as a preemption rather than a yield.
+ */
+void qsched_preempt(void);
+
+/**
+ * @brief Handles a preemption tick of the running thread.
+ *
+ * Yields unless the policy lets the thread finish another slice.
+ */
+void qsched_tick(void);
+
+/**
+ * @brief Switches away from the current thread, which must not be re-enqueued.
+ *
+ * The caller has set the current thread's state to BLOCKED or FINISHED while
+ * holding lock; lock is released after the switch. A BLOCKED thread returns
+ * from this call once it has been woken with qsched_wake.
+ *
+ * @param lock Lock to release once the thread is switched out.
+ */
+void qsched_block(qthread_spinlock_t *lock);
+
+/**
+ * @brief Completes the switch that resumed the calling context.
+ *
+ * Must be the first thing a newly started thread does, followed by
+ * qpreempt_enable() to balance the switch it was started by.
+ *
+ * @param w Worker the context now runs on.
+ */
+void qsched_finish_switch(qworker_t *w);
+
+/**
+ * @brief Runs threads from the calling worker's scheduler context.
+ *
+ * With done NULL, returns as soon as the worker finds nothing to run.
+ * Otherwise runs until done(arg) is true; when idle it sleeps until other
+ * workers produce work, a timer is due, an awaited fd is ready or
+ * qsched_notify_all is called, and it gives up (returns with done(arg) still
+ * false) only if it is the only worker and no thread waits for a timer or I/O.
+ * done may be called with the idle workers' mutex held, so it must not wake
+ * threads or call qsched_notify_all.
+ *
+ * @param done Completion predicate (can be NULL).
+ * @param arg Argument passed to done.
+ */
+void qsched_run(int (*done)(void *), void *arg);
+
+/**
+ * @brief Arms the preemption timer of the calling worker, if enabled.
+ *
+ * Called by each worker on its own kernel thread when it starts.
+ *
+ * @param w The calling worker.
+ * @return 0 on success (or when preemption is off), -1 on failure.
+ */
+int qpreempt_start_worker(qworker_t *w);
+
+/**
+ * @brief Disarms the preemption timer of the calling worker, if armed.
+ *
+ * @param w The calling worker.
+ */
+void qpreempt_stop_worker(qworker_t *w);
+
+/**
+ * @brief Folds a worker's statistics into the totals before the worker is freed.
+ *
+ * @param w Worker being freed.
+ */
+void qstats_retire(qworker_t *w);
+
+/**
+ * @brief Wakes every sleeping worker so they re-check their wait conditions.
+ */
+void qsched_notify_all(void);
+
+#endif // QSCHED_H
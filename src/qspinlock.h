@@ -0,0 +1,110 @@
+/*
+ * @file qspinlock.h
+ * @brief Internal spinlock for short scheduler critical sections.
+ *
+ * Critical sections guarded by these locks are a handful of instructions long
+ * and never switch context while holding the lock (a thread that parks hands
+ * the lock to the scheduler, which releases it once the switch is complete).
+ * Holding a lock also disables preemption on the calling kernel thread.
+ */
+#ifndef QSPINLOCK_H
+#define QSPINLOCK_H
+
+#include "../include/qthread.h"
+#include <sched.h>
+
+/// Depth of scheduler code on this kernel thread that must not be preempted.
+extern __thread int qpreempt_count __attribute__((tls_model("initial-exec")));
+
+/// Reasons for a switch deferred until preemption is enabled again (QPREEMPT_* bits).
+extern __thread int qpreempt_pending __attribute__((tls_model("initial-exec")));
+
+/// A preemption tick arrived while preemption was disabled.
+#define QPREEMPT_TICK 1
+
+/// A thread the policy ranks before the running one became READY.
+#define QPREEMPT_URGENT 2
+
+/**
+ * @brief Yields on behalf of a switch deferred by qpreempt_disable.
+ *
+ * A deferred tick is still subject to the policy's tick hook.
+ */
+void qpreempt_resched(void);
+
+/**
+ * @brief Disables preemption on the calling kernel thread (nests).
+ */
+static inline void qpreempt_disable(void) {
+    qpreempt_count++;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Re-enables preemption, honouring a tick that arrived meanwhile.
+ */
+static inline void qpreempt_enable(void) {
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    if (--qpreempt_count == 0 && qpreempt_pending)
+        qpreempt_resched();
+}
+
+/**
+ * @brief Hints the CPU that the caller is busy-waiting.
+ */
+static inline void qspin_pause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__("pause");
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/**
+ * @brief Acquires a spinlock.
+ *
+ * Spins briefly, then gives the CPU away so a descheduled holder can finish.
+ *
+ * @param l Lock to acquire.
+ */
+static inline void qspin_lock(qthread_spinlock_t *l) {
+    int spins = 0;
+    qpreempt_disable();
+    while (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&l->locked, __ATOMIC_RELAXED)) {
+            if (++spins < 128) {
+                qspin_pause();
+            } else {
+                sched_yield();
+                spins = 0;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Acquires a spinlock if it is free.
+ *
+ * @param l Lock to acquire.
+ * @return 1 if the lock was taken, 0 if it is held elsewhere.
+ */
+static inline int qspin_trylock(qthread_spinlock_t *l) {
+    qpreempt_disable();
+    if (!__atomic_load_n(&l->locked, __ATOMIC_RELAXED) &&
+        !__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE))
+        return 1;
+    qpreempt_enable();
+    return 0;
+}
+
+/**
+ * @brief Releases a spinlock.
+ *
+ * @param l Lock to release.
+ */
+static inline void qspin_unlock(qthread_spinlock_t *l) {
+    __atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+    qpreempt_enable();
+}
+
+#endif // QSPINLOCK_H
@@ -0,0 +1,264 @@
+/*
+ * @file qstack.c
+ * @brief Size-bucketed cache of thread descriptors and stacks.
+ *
+ * Stacks are rounded up to a power-of-two size class. When a joined thread is
+ * released its descriptor keeps its stack and is pushed on the free list of
+ * that class, so the next qthread_create of a similar size reuses both
+ * without touching the allocator. Every scheduler worker has its own cache
+ * so creating and joining threads on different workers does not contend.
+ *
+ * With qthread_set_stack_mmap enabled, the descriptor and its stack share one
+ * anonymous mapping laid out as [guard page | stack | descriptor]. The guard
+ * page is PROT_NONE so an overflow faults instead of corrupting memory, and
+ * stack pages are only committed when first touched. Cached mmap stacks give
+ * their cold (deepest) pages back to the kernel with MADV_DONTNEED.
+ */
+#include "qstack.h"
+#include "qsched.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/// Maximum bytes of stack all caches together may hold.
+static size_t cache_limit = DEFAULT_STACK_CACHE_LIMIT;
+
+/// Whether new stacks are mmap'd behind a guard page.
+static int use_mmap = 0;
+
+/// Bytes at the top of a cached mmap stack that stay resident.
+static size_t hot_size = DEFAULT_STACK_HOT_SIZE;
+
+/**
+ * @brief Returns the system page size.
+ */
+static size_t page_size(void) {
+    static size_t page = 0;
+    if (!page) page = (size_t)sysconf(_SC_PAGESIZE);
+    return page;
+}
+
+/**
+ * @brief Maps a stack size to its size class.
+ *
+ * @param size Stack size in bytes.
+ * @return Class index, or -1 if the size is too large to be cached.
+ */
+static int size_class(size_t size) {
+    int c = 0;
+    while (((size_t)1 << (c + QSTACK_MIN_SHIFT)) < size) {
+        if (++c == QSTACK_CLASSES) return -1;
+    }
+    return c;
+}
+
+/**
+ * @brief Frees a descriptor and its stack.
+ *
+ * @param t Descriptor to free.
+ */
+static void qstack_destroy(thread_t *t) {
+    if (t->mapping_size) {
+        munmap((char *)t->stack - page_size(), t->mapping_size);
+    } else {
+        free(t->stack);
+        free(t);
+    }
+}
+
+/**
+ * @brief Maps a guarded stack with its descriptor placed above it.
+ *
+ * @param size Stack size in bytes (a multiple of the page size).
+ * @return The descriptor, or NULL if the mapping failed.
+ */
+static thread_t *qstack_map(size_t size) {
+    size_t page = page_size();
+    size_t len = page + ((size + sizeof(thread_t) + page - 1) & ~(page - 1));
+
+    char *base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (base == MAP_FAILED) return NULL;
+
+    if (mprotect(base, page, PROT_NONE) == -1) {
+        munmap(base, len);
+        return NULL;
+    }
+
+    thread_t *t = (thread_t *)(base + page + size);
+    t->stack = base + page;
+    t->stack_size = size;
+    t->mapping_size = len;
+    return t;
+}
+
+/**
+ * @brief Takes a cached pair or allocates a new one (see qstack_acquire).
+ */
+static thread_t *qstack_get(qstack_cache_t *cache, size_t size) {
+    int c = size_class(size);
+
+    if (c >= 0) {
+        qspin_lock(&cache->lock);
+        thread_t *t = cache->free_lists[use_mmap][c];
+        if (t) {
+            cache->free_lists[use_mmap][c] = t->next;
+            cache->cached_bytes -= t->stack_size;
+        }
+        qspin_unlock(&cache->lock);
+        if (t) return t;
+    }
+
+    if (c >= 0) size = (size_t)1 << (c + QSTACK_MIN_SHIFT);
+
+    if (use_mmap) {
+        size = (size + page_size() - 1) & ~(page_size() - 1);
+        return qstack_map(size);
+    }
+
+    thread_t *t = malloc(sizeof(thread_t));
+    if (!t) return NULL;
+
+    t->stack = malloc(size);
+    if (!t->stack) {
+        free(t);
+        return NULL;
+    }
+    t->stack_size = size;
+    t->mapping_size = 0;
+    return t;
+}
+
+/**
+ * @brief Caches or frees a pair (see qstack_release).
+ */
+static void qstack_put(qstack_cache_t *cache, thread_t *t) {
+    int c = size_class(t->stack_size);
+    size_t limit = cache_limit / (qsched_nworkers > 0 ? qsched_nworkers : 1);
+
+    if (c < 0 || t->stack_size > limit) {
+        qstack_destroy(t);
+        return;
+    }
+
+    if (t->mapping_size && t->stack_size > hot_size) {
+        // Drop the cold end of the stack; it is zero-filled again on demand
+        size_t cold = (t->stack_size - hot_size) & ~(page_size() - 1);
+        if (cold) madvise(t->stack, cold, MADV_DONTNEED);
+    }
+
+    int kind = t->mapping_size != 0;
+    qspin_lock(&cache->lock);
+    if (cache->cached_bytes + t->stack_size > limit) {
+        qspin_unlock(&cache->lock);
+        qstack_destroy(t);
+        return;
+    }
+    t->next = cache->free_lists[kind][c];
+    cache->free_lists[kind][c] = t;
+    cache->cached_bytes += t->stack_size;
+    qspin_unlock(&cache->lock);
+}
+
+/*
+ * The allocator is not reentrant: a thread preempted inside malloc or free
+ * could deadlock the next thread of its worker that calls them.
+ */
+
+thread_t *qstack_acquire(qstack_cache_t *cache, size_t size) {
+    qpreempt_disable();
+    thread_t *t = qstack_get(cache, size);
+    qpreempt_enable();
+    return t;
+}
+
+void qstack_release(qstack_cache_t *cache, thread_t *t) {
+    qpreempt_disable();
+    qstack_put(cache, t);
+    qpreempt_enable();
+}
+
+size_t qstack_trim(qstack_cache_t *cache, size_t keep) {
+    size_t released = 0;
+    thread_t *doomed = NULL;
+
+    qspin_lock(&cache->lock);
+    for (int c = QSTACK_CLASSES - 1; c >= 0 && cache->cached_bytes > keep; c--) {
+        for (int kind = 0; kind < 2; kind++) {
+            while (cache->free_lists[kind][c] && cache->cached_bytes > keep) {
+                thread_t *t = cache->free_lists[kind][c];
+                cache->free_lists[kind][c] = t->next;
+                cache->cached_bytes -= t->stack_size;
+                released += t->stack_size;
+                t->next = doomed;
+                doomed = t;
+            }
+        }
+    }
+    qspin_unlock(&cache->lock);
+
+    // Unmap outside the lock
+    qpreempt_disable();
+    while (doomed) {
+        thread_t *t = doomed;
+        doomed = t->next;
+        qstack_destroy(t);
+    }
+    qpreempt_enable();
+    return released;
+}
+
+/**
+ * @brief Selects how new thread stacks are allocated.
+ *
+ * When enabled, stacks are reserved with mmap behind a PROT_NONE guard page
+ * and committed lazily by demand paging, so large stacks only cost the pages
+ * a thread actually touches. Should be called before creating threads.
+ *
+ * @param enable Nonzero for mmap'd guarded stacks, 0 for malloc'd stacks.
+ */
+void qthread_set_stack_mmap(int enable) {
+    use_mmap = enable != 0;
+}
+
+/**
+ * @brief Sets how much of a cached mmap'd stack stays resident.
+ *
+ * Pages below the top `bytes` of a stack returned to the cache are released
+ * with MADV_DONTNEED.
+ *
+ * @param bytes Resident bytes kept at the top of each cached stack.
+ */
+void qthread_set_stack_hot_size(size_t bytes) {
+    hot_size = bytes;
+}
+
+/**
+ * @brief Sets the maximum number of stack bytes kept for reuse.
+ *
+ * The limit is shared evenly between the workers' caches. Cached stacks above
+ * the new limit are released immediately.
+ *
+ * @param bytes New limit in bytes (0 disables caching).
+ */
+void qthread_set_stack_cache_limit(size_t bytes) {
+    cache_limit = bytes;
+    qthread_stack_cache_trim(bytes);
+}
+
+/**
+ * @brief Releases cached stacks until at most the given amount remains.
+ *
+ * Each worker's cache keeps an even share of `keep`; larger stacks are
+ * released first.
+ *
+ * @param keep Bytes of cached stack to keep.
+ * @return Number of stack bytes released.
+ */
+size_t qthread_stack_cache_trim(size_t keep) {
+    size_t released = 0;
+
+    for (int i = 0; i < qsched_nworkers; i++)
+        released += qstack_trim(&qsched_workers[i].stacks, keep / qsched_nworkers);
+    return released;
+}
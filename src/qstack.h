@@ -0,0 +1,59 @@
+/*
+ * @file qstack.h
+ * @brief Internal cache of thread descriptors and their stacks.
+ */
+#ifndef QSTACK_H
+#define QSTACK_H
+
+#include "../include/qthread.h"
+
+/// Smallest size class (2^QSTACK_MIN_SHIFT bytes).
+#define QSTACK_MIN_SHIFT 12
+
+/// Number of size classes; larger stacks bypass the cache.
+#define QSTACK_CLASSES 16
+
+/**
+ * @struct qstack_cache_t
+ * @brief Cached descriptor/stack pairs; each scheduler worker owns one.
+ */
+typedef struct {
+    qthread_spinlock_t lock; ///< Guards the lists (taken by trims from other workers).
+    thread_t *free_lists[2][QSTACK_CLASSES]; ///< Per kind (malloc, mmap) and size class, linked through thread_t::next.
+    size_t cached_bytes; ///< Bytes of stack currently held.
+} qstack_cache_t;
+
+/**
+ * @brief Returns a thread descriptor with a stack of at least size bytes.
+ *
+ * Reuses a cached descriptor/stack pair of the same size class when one is
+ * available. Only thread_t::stack and thread_t::stack_size are meaningful
+ * on return.
+ *
+ * @param cache Cache to take from.
+ * @param size Requested stack size in bytes.
+ * @return The descriptor, or NULL if memory could not be allocated.
+ */
+thread_t *qstack_acquire(qstack_cache_t *cache, size_t size);
+
+/**
+ * @brief Gives a descriptor and its stack back to the cache.
+ *
+ * The pair is freed instead when caching it would exceed this cache's share
+ * of the retention limit.
+ *
+ * @param cache Cache to give the pair to (not necessarily the one it came from).
+ * @param t Descriptor obtained from qstack_acquire.
+ */
+void qstack_release(qstack_cache_t *cache, thread_t *t);
+
+/**
+ * @brief Releases cached pairs until at most keep bytes of stack remain.
+ *
+ * @param cache Cache to trim.
+ * @param keep Bytes of cached stack to keep.
+ * @return Number of stack bytes released.
+ */
+size_t qstack_trim(qstack_cache_t *cache, size_t keep);
+
+#endif // QSTACK_H
@@ -0,0 +1,100 @@
+/*
+ * @file qstats.c
+ * @brief Snapshots of the scheduling statistics (see qstats.h).
+ */
+#include "qstats.h"
+#include <string.h>
+
+#ifdef QTHREAD_STATS
+
+/// Totals of the workers freed by past shutdowns.
+static qthread_stats_t retired;
+
+/**
+ * @brief Adds one set of statistics to another, reading the source atomically.
+ *
+ * @param sum Accumulated statistics.
+ * @param s Statistics to add.
+ */
+static void qstats_sum(qthread_stats_t *sum, qthread_stats_t *s) {
+    sum->switches += __atomic_load_n(&s->switches, __ATOMIC_RELAXED);
+    sum->yields += __atomic_load_n(&s->yields, __ATOMIC_RELAXED);
+    sum->preemptions += __atomic_load_n(&s->preemptions, __ATOMIC_RELAXED);
+    sum->run_ns += __atomic_load_n(&s->run_ns, __ATOMIC_RELAXED);
+    sum->ready_ns += __atomic_load_n(&s->ready_ns, __ATOMIC_RELAXED);
+    sum->blocked_ns += __atomic_load_n(&s->blocked_ns, __ATOMIC_RELAXED);
+}
+
+void qstats_retire(qworker_t *w) {
+    qstats_sum(&retired, &w->stats);
+}
+
+/**
+ * @brief Takes a snapshot of a thread's scheduling statistics.
+ *
+ * @param thread Thread.
+ * @param[out] stats Statistics, including the interval the thread is in.
+ * @return 0 on success, -1 if thread is NULL.
+ */
+int qthread_stats(thread_t *thread, qthread_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (!thread) return -1;
+
+    qstats_sum(stats, &thread->stats);
+
+    // Add the interval the thread is in since its last switch
+    uint64_t now = qtimer_now();
+    uint64_t since = __atomic_load_n(&thread->stats_since, __ATOMIC_RELAXED);
+    uint64_t woken = __atomic_load_n(&thread->stats_woken, __ATOMIC_RELAXED);
+    if (now < since) return 0;
+    switch (__atomic_load_n(&thread->state, __ATOMIC_RELAXED)) {
+    case RUNNING:
+        stats->run_ns += now - since;
+        break;
+    case READY:
+        if (woken > since && woken <= now) {
+            stats->blocked_ns += woken - since;
+            since = woken;
+        }
+        stats->ready_ns += now - since;
+        break;
+    case BLOCKED:
+        stats->blocked_ns += now - since;
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sums the statistics kept by the running and the freed workers.
+ *
+ * @param[out] stats Statistics over every thread.
+ * @return 0.
+ */
+int qthread_stats_total(qthread_stats_t *stats) {
+    *stats = retired;
+    for (int i = 0; i < qsched_nworkers; i++)
+        qstats_sum(stats, &qsched_workers[i].stats);
+    return 0;
+}
+
+#else
+
+int qthread_stats(thread_t *thread, qthread_stats_t *stats) {
+    (void)thread;
+    memset(stats, 0, sizeof(*stats));
+    return -1;
+}
+
+int qthread_stats_total(qthread_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    return -1;
+}
+
+void qstats_retire(qworker_t *w) {
+    (void)w;
+}
+
+#endif // QTHREAD_STATS
@@ -0,0 +1,109 @@
+/*
+ * @file qstats.h
+ * @brief Internal accounting of per-thread scheduling statistics.
+ *
+ * The hooks are called on the scheduler's switch and wake paths. Built
+ * without QTHREAD_STATS they are empty, so the statistics cost nothing.
+ *
+ * A thread's counters are written by the worker switching it in or out
+ * (handing the thread over through a queue orders those writes) and may be
+ * read from anywhere, hence relaxed atomic stores. Each worker also adds the
+ * same amounts to its own totals, which only it writes.
+ */
+#ifndef QSTATS_H
+#define QSTATS_H
+
+#include "qsched.h"
+
+#ifdef QTHREAD_STATS
+
+/**
+ * @brief Adds to a counter that other kernel threads may read.
+ */
+static inline void qstats_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Starts the statistics of a new thread.
+ *
+ * @param t Thread being created or registered.
+ */
+static inline void qstats_init(thread_t *t) {
+    t->stats = (qthread_stats_t){0};
+    t->stats_since = qtimer_now();
+    t->stats_woken = 0;
+}
+
+/**
+ * @brief Records that a BLOCKED thread became READY.
+ *
+ * @param t Thread being woken (or made READY after creation).
+ */
+static inline void qstats_wake(thread_t *t) {
+    __atomic_store_n(&t->stats_woken, qtimer_now(), __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Accounts a context switch.
+ *
+ * @param w Calling worker.
+ * @param prev Thread leaving the CPU, its state already set (can be NULL).
+ * @param next Thread about to run (can be NULL).
+ * @param forced Whether a READY prev is preempted rather than yielding.
+ */
+static inline void qstats_switch(qworker_t *w, thread_t *prev, thread_t *next, int forced) {
+    if (!prev && !next) return;
+    uint64_t now = qtimer_now();
+
+    if (prev) {
+        uint64_t ran = now - prev->stats_since;
+        qstats_add(&prev->stats.run_ns, ran);
+        qstats_add(&w->stats.run_ns, ran);
+        if (prev->state == READY) {
+            qstats_add(forced ? &prev->stats.preemptions : &prev->stats.yields, 1);
+            qstats_add(forced ? &w->stats.preemptions : &w->stats.yields, 1);
+        }
+        __atomic_store_n(&prev->stats_since, now, __ATOMIC_RELAXED);
+    }
+
+    if (next) {
+        // Since its last switch out, next was BLOCKED until woken, then READY
+        uint64_t since = next->stats_since;
+        uint64_t woken = __atomic_load_n(&next->stats_woken, __ATOMIC_RELAXED);
+        if (woken > since) {
+            qstats_add(&next->stats.blocked_ns, woken - since);
+            qstats_add(&w->stats.blocked_ns, woken - since);
+            since = woken;
+        }
+        if (now > since) {
+            qstats_add(&next->stats.ready_ns, now - since);
+            qstats_add(&w->stats.ready_ns, now - since);
+        }
+        qstats_add(&next->stats.switches, 1);
+        qstats_add(&w->stats.switches, 1);
+        __atomic_store_n(&next->stats_woken, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&next->stats_since, now, __ATOMIC_RELAXED);
+    }
+}
+
+#else
+
+static inline void qstats_init(thread_t *t) {
+    t->stats = (qthread_stats_t){0};
+    t->stats_since = 0;
+    t->stats_woken = 0;
+}
+
+static inline void qstats_wake(thread_t *t) { (void)t; }
+
+static inline void qstats_switch(qworker_t *w, thread_t *prev, thread_t *next, int forced) {
+    (void)w;
+    (void)prev;
+    (void)next;
+    (void)forced;
+}
+
+#endif // QTHREAD_STATS
+
+#endif // QSTATS_H
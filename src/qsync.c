@@ -0,0 +1,537 @@
+/*
+ * @file qsync.c
+ * @brief Synchronization objects that park threads instead of spinning.
+ *
+ * A mutex is a word taken with one compare-and-swap while it is free, so an
+ * uncontended lock/unlock pair never enters the scheduler. A thread that
+ * finds it taken marks it contended and parks on the mutex's wait queue.
+ * Unlocking a contended mutex hands ownership straight to the longest waiter,
+ * which resumes already owning it instead of racing newcomers for the word.
+ * Semaphore posts likewise hand their unit to the longest waiter. Woken
+ * threads take the waker's next slot (qsched_handoff), so they run as soon as
+ * it leaves the CPU.
+ *
+ * Condition variables and semaphores also support timed waits. A timed
+ * waiter parks under its worker's timer wheel lock rather than the lock of
+ * the object, so the timeout cannot fire before the waiter is switched out;
+ * a waker that wins the waiter cancels the timer, which waits for that same
+ * lock, before waking it.
+ */
+#include "../include/qthread.h"
+#include "qsched.h"
+#include "qwaitq.h"
+#include <errno.h>
+#include <sched.h>
+
+/// Values of qthread_mutex_t::state.
+enum {
+    QMUTEX_FREE,
+    QMUTEX_LOCKED,
+    QMUTEX_CONTENDED ///< Unlock must look at the waiters.
+};
+
+/**
+ * @struct qmutex_outside_t
+ * @brief State of a lock attempt made outside any thread.
+ */
+typedef struct {
+    qthread_mutex_t *m; ///< Mutex being locked.
+    int acquired; ///< Set once the mutex is ours.
+} qmutex_outside_t;
+
+/**
+ * @brief Tries to take the mutex for a caller outside any thread.
+ *
+ * Used as a qsched_run predicate. The mutex is taken as contended so that
+ * its unlock notifies the other outside waiters.
+ *
+ * @param arg The qmutex_outside_t.
+ * @return 1 once the mutex is taken.
+ */
+static int qmutex_take_outside(void *arg) {
+    qmutex_outside_t *o = arg;
+    int expected = QMUTEX_FREE;
+
+    if (!o->acquired &&
+        __atomic_compare_exchange_n(&o->m->state, &expected, QMUTEX_CONTENDED, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        o->acquired = 1;
+    return o->acquired;
+}
+
+/**
+ * @brief Initializes an unlocked mutex.
+ *
+ * @param m Mutex.
+ * @return 0.
+ */
+int qthread_mutex_init(qthread_mutex_t *m) {
+    *m = (qthread_mutex_t)QTHREAD_MUTEX_INITIALIZER;
+    return 0;
+}
+
+/**
+ * @brief Locks a mutex only if it is free.
+ *
+ * A mutex handed over to a waiter never looks free, so this cannot overtake
+ * parked threads.
+ *
+ * @param m Mutex.
+ * @return 0 if the mutex was taken, -1 if it is held.
+ */
+int qthread_mutex_trylock(qthread_mutex_t *m) {
+    int expected = QMUTEX_FREE;
+    return __atomic_compare_exchange_n(&m->state, &expected, QMUTEX_LOCKED, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ? 0 : -1;
+}
+
+/**
+ * @brief Locks a mutex, parking the thread while another one holds it.
+ *
+ * Outside any thread, the caller runs threads until the mutex is free; a
+ * kernel thread that is not part of the runtime yields its CPU meanwhile.
+ *
+ * @param m Mutex.
+ * @return 0 on success, -1 if nothing could ever release it (deadlock).
+ */
+int qthread_mutex_lock(qthread_mutex_t *m) {
+    if (qthread_mutex_trylock(m) == 0) return 0;
+
+    thread_t *self = qthread_self();
+    qspin_lock(&m->lock);
+    // Flag the contention before parking so that unlock looks at the queue
+    if (__atomic_exchange_n(&m->state, QMUTEX_CONTENDED, __ATOMIC_ACQUIRE) == QMUTEX_FREE) {
+        qspin_unlock(&m->lock);
+        return 0;
+    }
+    if (self) {
+        qwaitq_push(&m->waiters, self);
+        self->state = BLOCKED;
+        qsched_block(&m->lock);
+        return 0; // Woken as the new owner
+    }
+
+    m->outside_waiters++;
+    qspin_unlock(&m->lock);
+
+    qmutex_outside_t o = { m, 0 };
+    if (qsched_worker()) {
+        qsched_run(qmutex_take_outside, &o);
+    } else {
+        while (!qmutex_take_outside(&o))
+            sched_yield();
+    }
+
+    qspin_lock(&m->lock);
+    m->outside_waiters--;
+    qspin_unlock(&m->lock);
+    return o.acquired ? 0 : -1;
+}
+
+/**
+ * @brief Unlocks a mutex held by the caller.
+ *
+ * If threads are waiting, the longest waiter becomes the owner and is woken.
+ *
+ * @param m Mutex.
+ * @return 0 on success, -1 if the mutex was not locked.
+ */
+int qthread_mutex_unlock(qthread_mutex_t *m) {
+    int expected = QMUTEX_LOCKED;
+    if (__atomic_compare_exchange_n(&m->state, &expected, QMUTEX_FREE, 0,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        return 0;
+    if (expected == QMUTEX_FREE) return -1;
+
+    qspin_lock(&m->lock);
+    thread_t *next = qwaitq_pop(&m->waiters);
+    int notify = 0;
+    if (next) {
+        // Hand over: the mutex stays taken, contended if anyone else waits
+        int contended = m->waiters.head || m->outside_waiters;
+        __atomic_store_n(&m->state, contended ? QMUTEX_CONTENDED : QMUTEX_LOCKED,
+                         __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&m->state, QMUTEX_FREE, __ATOMIC_RELEASE);
+        notify = m->outside_waiters > 0;
+    }
+    qspin_unlock(&m->lock);
+
+    if (next) qsched_handoff(next);
+    else if (notify) qsched_notify_all();
+    return 0;
+}
+
+/**
+ * @brief Timer callback ending a timed wait.
+ *
+ * @param timer Timer whose arg is the waiting thread.
+ */
+static void qwait_timeout(qtimer_t *timer) {
+    thread_t *t = timer->arg;
+    if (qwaitq_claim(t, QWAIT_TIMEDOUT)) qsched_wake(t);
+}
+
+/**
+ * @brief Parks the calling thread, already queued on a synchronization object.
+ *
+ * @param self Calling thread.
+ * @param lock Lock guarding the queue, held by the caller and released here.
+ * @param deadline Absolute time to give up at (UINT64_MAX for none).
+ * @return QWAIT_WOKEN or QWAIT_TIMEDOUT.
+ */
+static int qwait_park(thread_t *self, qthread_spinlock_t *lock, uint64_t deadline) {
+    if (deadline == UINT64_MAX) {
+        self->wait_timer = NULL;
+        self->state = BLOCKED;
+        qsched_block(lock);
+        return self->wait_status;
+    }
+
+    qtimer_t timer;
+    self->wait_timer = &timer;
+    qwheel_t *wheel = qtimer_lock_local();
+    qtimer_add(wheel, &timer, deadline, qwait_timeout, self);
+    qspin_unlock(lock);
+    self->state = BLOCKED;
+    qsched_block(&wheel->lock);
+    return self->wait_status;
+}
+
+/**
+ * @brief Dequeues the longest waiter whose wait has not timed out.
+ *
+ * @param q Queue, with its lock held.
+ * @return The claimed thread, to be woken with qwait_wake, or NULL.
+ */
+static thread_t *qwait_pop(qthread_waitq_t *q) {
+    thread_t *t;
+    while ((t = qwaitq_pop(q)) && !qwaitq_claim(t, QWAIT_WOKEN))
+        ; // Its timeout won; it only has to notice it is no longer queued
+    return t;
+}
+
+/**
+ * @brief Wakes a thread claimed by qwait_pop.
+ *
+ * @param t Thread.
+ */
+static void qwait_wake(thread_t *t) {
+    // Also waits until a timed waiter is switched out (it parks under the wheel lock)
+    if (t->wait_timer) qtimer_cancel(t->wait_timer);
+    qsched_handoff(t);
+}
+
+/**
+ * @brief Takes a thread whose wait timed out off the queue it waited on.
+ *
+ * @param self Calling thread.
+ * @param lock Lock guarding the queue.
+ * @param q Queue.
+ */
+static void qwait_leave(thread_t *self, qthread_spinlock_t *lock, qthread_waitq_t *q) {
+    qspin_lock(lock);
+    qwaitq_remove(q, self);
+    qspin_unlock(lock);
+}
+
+/**
+ * @brief Whether a deadline has passed.
+ *
+ * @param deadline Absolute time (UINT64_MAX for none).
+ * @return 1 if it has passed, with errno set to ETIMEDOUT, 0 otherwise.
+ */
+static int qwait_expired(uint64_t deadline) {
+    if (deadline == UINT64_MAX || qtimer_now() < deadline) return 0;
+    errno = ETIMEDOUT;
+    return 1;
+}
+
+/**
+ * @brief Initializes a condition variable.
+ *
+ * @param c Condition variable.
+ * @return 0.
+ */
+int qthread_cond_init(qthread_cond_t *c) {
+    *c = (qthread_cond_t)QTHREAD_COND_INITIALIZER;
+    return 0;
+}
+
+/**
+ * @brief Implements qthread_cond_wait and qthread_cond_timedwait.
+ *
+ * @param c Condition variable.
+ * @param m Mutex held by the caller.
+ * @param deadline Absolute time to give up at (UINT64_MAX for none).
+ * @return 0 when signaled, -1 on timeout or if the mutex cannot be relocked.
+ */
+static int qcond_wait(qthread_cond_t *c, qthread_mutex_t *m, uint64_t deadline) {
+    if (qwait_expired(deadline)) return -1;
+
+    thread_t *self = qthread_self();
+    if (!self) {
+        // Nothing can wake a caller outside any thread: run threads, then recheck
+        qthread_mutex_unlock(m);
+        if (qsched_worker()) qsched_yield();
+        else sched_yield();
+        if (qthread_mutex_lock(m) == -1) return -1;
+        return qwait_expired(deadline) ? -1 : 0;
+    }
+
+    qspin_lock(&c->lock);
+    qwaitq_push(&c->waiters, self);
+    qthread_mutex_unlock(m);
+    int status = qwait_park(self, &c->lock, deadline);
+    if (status == QWAIT_TIMEDOUT) qwait_leave(self, &c->lock, &c->waiters);
+
+    qthread_mutex_lock(m);
+    if (status == QWAIT_TIMEDOUT) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Unlocks a mutex and parks until the condition is signaled.
+ *
+ * @param c Condition variable.
+ * @param m Mutex held by the caller; locked again before returning.
+ * @return 0 on success, -1 if the mutex could not be locked again.
+ */
+int qthread_cond_wait(qthread_cond_t *c, qthread_mutex_t *m) {
+    return qcond_wait(c, m, UINT64_MAX);
+}
+
+/**
+ * @brief qthread_cond_wait with a timeout.
+ *
+ * @param c Condition variable.
+ * @param m Mutex held by the caller; locked again before returning.
+ * @param deadline Absolute qthread_clock_ns() time to give up at.
+ * @return 0 when signaled, -1 with errno set to ETIMEDOUT on timeout.
+ */
+int qthread_cond_timedwait(qthread_cond_t *c, qthread_mutex_t *m, uint64_t deadline) {
+    return qcond_wait(c, m, deadline);
+}
+
+/**
+ * @brief Wakes the thread that has waited longest on a condition variable.
+ *
+ * @param c Condition variable.
+ * @return 0.
+ */
+int qthread_cond_signal(qthread_cond_t *c) {
+    qspin_lock(&c->lock);
+    thread_t *t = qwait_pop(&c->waiters);
+    qspin_unlock(&c->lock);
+
+    if (t) qwait_wake(t);
+    return 0;
+}
+
+/**
+ * @brief Wakes every thread waiting on a condition variable.
+ *
+ * @param c Condition variable.
+ * @return 0.
+ */
+int qthread_cond_broadcast(qthread_cond_t *c) {
+    thread_t *head = NULL, **link = &head, *t;
+
+    qspin_lock(&c->lock);
+    while ((t = qwait_pop(&c->waiters))) {
+        *link = t;
+        link = &t->wait_next;
+    }
+    qspin_unlock(&c->lock);
+
+    while (head) {
+        t = head;
+        head = t->wait_next;
+        t->wait_next = NULL;
+        qwait_wake(t);
+    }
+    return 0;
+}
+
+/**
+ * @struct qsem_outside_t
+ * @brief State of a semaphore wait made outside any thread.
+ */
+typedef struct {
+    qthread_sem_t *s; ///< Semaphore waited on.
+    int acquired; ///< Set once a unit is ours.
+    int expired; ///< Set by the timeout.
+} qsem_outside_t;
+
+/**
+ * @brief Takes a unit if one is available.
+ *
+ * @param s Semaphore.
+ * @return 1 if a unit was taken, 0 otherwise.
+ */
+static int qsem_take(qthread_sem_t *s) {
+    int v = __atomic_load_n(&s->value, __ATOMIC_RELAXED);
+    while (v > 0) {
+        if (__atomic_compare_exchange_n(&s->value, &v, v - 1, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Wait predicate of a semaphore wait outside any thread.
+ *
+ * @param arg The qsem_outside_t.
+ * @return 1 once a unit is taken or the wait timed out.
+ */
+static int qsem_take_outside(void *arg) {
+    qsem_outside_t *o = arg;
+    if (!o->acquired && qsem_take(o->s)) o->acquired = 1;
+    return o->acquired || __atomic_load_n(&o->expired, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Timer callback ending a semaphore wait outside any thread.
+ *
+ * @param timer Timer whose arg is the qsem_outside_t.
+ */
+static void qsem_timeout_outside(qtimer_t *timer) {
+    qsem_outside_t *o = timer->arg;
+    __atomic_store_n(&o->expired, 1, __ATOMIC_RELEASE);
+    qsched_notify_all();
+}
+
+/**
+ * @brief Waits for a unit outside any thread.
+ *
+ * The worker runs threads meanwhile; a kernel thread that is not part of the
+ * runtime yields its CPU until a unit shows up.
+ *
+ * @param s Semaphore.
+ * @param deadline Absolute time to give up at (UINT64_MAX for none).
+ * @return 0 if a unit was taken, -1 otherwise.
+ */
+static int qsem_wait_outside(qthread_sem_t *s, uint64_t deadline) {
+    qsem_outside_t o = { s, 0, 0 };
+
+    qspin_lock(&s->lock);
+    s->outside_waiters++;
+    qspin_unlock(&s->lock);
+
+    if (qsched_worker()) {
+        qtimer_t timer;
+        if (deadline != UINT64_MAX) qtimer_arm(&timer, deadline, qsem_timeout_outside, &o);
+        qsched_run(qsem_take_outside, &o);
+        if (deadline != UINT64_MAX) qtimer_cancel(&timer);
+    } else {
+        while (!qsem_take_outside(&o) && !qwait_expired(deadline))
+            sched_yield();
+    }
+
+    qspin_lock(&s->lock);
+    s->outside_waiters--;
+    qspin_unlock(&s->lock);
+
+    if (o.acquired) return 0;
+    if (!qwait_expired(deadline)) errno = EDEADLK;
+    return -1;
+}
+
+/**
+ * @brief Implements qthread_sem_wait and qthread_sem_timedwait.
+ *
+ * @param s Semaphore.
+ * @param deadline Absolute time to give up at (UINT64_MAX for none).
+ * @return 0 if a unit was taken, -1 otherwise.
+ */
+static int qsem_wait(qthread_sem_t *s, uint64_t deadline) {
+    if (qsem_take(s)) return 0;
+
+    thread_t *self = qthread_self();
+    if (!self) return qsem_wait_outside(s, deadline);
+
+    qspin_lock(&s->lock);
+    if (qsem_take(s)) {
+        qspin_unlock(&s->lock);
+        return 0;
+    }
+    if (qwait_expired(deadline)) {
+        qspin_unlock(&s->lock);
+        errno = ETIMEDOUT; // Again: unlocking may switch threads, which can change errno
+        return -1;
+    }
+    qwaitq_push(&s->waiters, self);
+    if (qwait_park(self, &s->lock, deadline) == QWAIT_WOKEN) return 0; // Handed a posted unit
+
+    qwait_leave(self, &s->lock, &s->waiters);
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+/**
+ * @brief Initializes a semaphore.
+ *
+ * @param s Semaphore.
+ * @param value Initial number of units.
+ * @return 0.
+ */
+int qthread_sem_init(qthread_sem_t *s, unsigned int value) {
+    *s = (qthread_sem_t)QTHREAD_SEM_INITIALIZER((int)value);
+    return 0;
+}
+
+/**
+ * @brief Takes a unit, parking the thread until one is posted.
+ *
+ * @param s Semaphore.
+ * @return 0 on success, -1 if nothing could ever post a unit (deadlock).
+ */
+int qthread_sem_wait(qthread_sem_t *s) {
+    return qsem_wait(s, UINT64_MAX);
+}
+
+/**
+ * @brief Takes a unit if one is available.
+ *
+ * @param s Semaphore.
+ * @return 0 if a unit was taken, -1 otherwise.
+ */
+int qthread_sem_trywait(qthread_sem_t *s) {
+    return qsem_take(s) ? 0 : -1;
+}
+
+/**
+ * @brief qthread_sem_wait with a timeout.
+ *
+ * @param s Semaphore.
+ * @param deadline Absolute qthread_clock_ns() time to give up at.
+ * @return 0 if a unit was taken, -1 with errno set to ETIMEDOUT otherwise.
+ */
+int qthread_sem_timedwait(qthread_sem_t *s, uint64_t deadline) {
+    return qsem_wait(s, deadline);
+}
+
+/**
+ * @brief Releases a unit, handing it to the longest waiter if there is one.
+ *
+ * @param s Semaphore.
+ * @return 0.
+ */
+int qthread_sem_post(qthread_sem_t *s) {
+    qspin_lock(&s->lock);
+    thread_t *t = qwait_pop(&s->waiters);
+    int notify = 0;
+    if (!t) {
+        __atomic_fetch_add(&s->value, 1, __ATOMIC_RELEASE);
+        notify = s->outside_waiters > 0;
+    }
+    qspin_unlock(&s->lock);
+
+    if (t) qwait_wake(t);
+    else if (notify) qsched_notify_all();
+    return 0;
+}
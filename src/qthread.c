@@ -3,9 +3,13 @@
  * @brief Implementation of the lightweight threading library.
  *
  * This file provides the implementations of user-level threads, including
- * creation, scheduling, and termination.
+ * creation, scheduling, and termination. Threads are multiplexed onto the
+ * scheduler's worker kernel threads (see qsched.c).
  */
 #include "../include/qthread.h"
+#include "qcontext.h"
+#include "qsched.h"
+#include "qstats.h"
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -15,8 +19,20 @@ static size_t stack_size = DEFAULT_STACK_SIZE;
 /// Head of the circular thread list.
 thread_t *thread_list = NULL;
 
-/// Currently running thread.
-thread_t *current = NULL;
+/// Guards thread_list and the shutdown state below.
+static qthread_spinlock_t list_lock;
+
+/// Threads created and not finished yet.
+static int live_threads = 0;
+
+/// Main thread parked in qthread_shutdown until live_threads drops to 0.
+static thread_t *shutdown_waiter = NULL;
+
+/// Whether qthread_shutdown waits outside any thread.
+static int shutdown_outside = 0;
+
+/// Descriptor of the main thread registered by qthread_init.
+static thread_t main_thread;
 
 /**
  * @brief Sets the stack size for new threads.
@@ -35,74 +51,55 @@ void qthread_set_stacksize(size_t size) {
  * @return Pointer to the current thread.
  */
 thread_t *qthread_self() {
-    return current;
+    // A tick between the two loads could move us and return another worker's thread
+    qpreempt_disable();
+    qworker_t *w = qsched_worker();
+    thread_t *self = w ? w->current : NULL;
+    qpreempt_enable();
+    return self;
 }
 
 /**
  * @brief Schedules the next available READY thread.
+ *
+ * A running thread that yields goes to the tail of its worker's run queue,
+ * so threads are served round-robin. If no other thread is READY the caller
+ * keeps running. Called from outside any thread, it runs threads on the
+ * calling kernel thread until its worker runs out of work.
  */
 void qscheduler() {
-    if (!thread_list) return; // No threads to schedule
-
-    thread_t *t = NULL;
-
-    if (current == NULL) {
-        // Initial call: search all threads for the first READY one
-        t = thread_list;
-        do {
-            if (t->state == READY) {
-                break;
-            }
-            t = t->next;
-        } while (t != thread_list);
-    } else {
-        // Normal case: search from current->next
-        t = current->next;
-        while (t != current) {
-            if (t->state == READY) {
-                break;
-            }
-            t = t->next;
-        }
-
-        // After loop, t is current or a READY thread
-        if (t->state != READY) {
-            // No other READY thread found; check current
-            if (current->state == READY) {
-                t = current;
-            } else {
-                // All threads are not READY
-                return;
-            }
-        }
-    }
-
-    // Ensure we have a READY thread
-    if (t->state != READY) return;
-
-    // Perform context switch if necessary
-    if (current == NULL) {
-        // Initial switch: no previous context to save
-        current = t;
-        setcontext(&current->context);
-    } else if (t != current) {
-        thread_t *prev = current;
-        current = t;
-        swapcontext(&prev->context, &current->context);
-    }
+    qsched_yield();
 }
 
 /**
  * @brief Terminates the current thread and schedules another.
  *
- * Marks the current thread as finished and optionally stores a return value.
+ * Marks the current thread as finished, optionally stores a return value and
+ * wakes every thread blocked in qthread_join on it (once it is switched out).
  *
  * @param[in] value Return value to be stored (can be NULL).
  */
 void qthread_exit(void *value) {
-    current->retval = value; // Store return value
-    current->state = FINISHED; // Mark thread as finished
-    qscheduler(); // Schedule the next thread
+    thread_t *self = qthread_self();
+
+    // The last thread to finish lets qthread_shutdown proceed
+    thread_t *waiter = NULL;
+    int notify = 0;
+    qspin_lock(&list_lock);
+    if (__atomic_sub_fetch(&live_threads, 1, __ATOMIC_RELEASE) == 0) {
+        waiter = shutdown_waiter;
+        shutdown_waiter = NULL;
+        notify = shutdown_outside;
+    }
+    qspin_unlock(&list_lock);
+    if (waiter) qsched_wake(waiter);
+    if (notify) qsched_notify_all();
+
+    qspin_lock(&self->lock);
+    self->retval = value; // Store return value
+    self->state = FINISHED; // Mark thread as finished
+    qsched_block(&self->lock); // Schedule the next thread
+    abort(); // A finished thread is never resumed
 }
 
 /**
@@ -119,95 +116,248 @@ void qthread_wrapper(void (*func)(void*), void *arg) {
 }
 
 /**
- * @brief Creates a new thread.
+ * @brief First function run on a new thread's stack.
+ *
+ * @param arg The thread being started.
+ */
+static void qthread_entry(void *arg) {
+    thread_t *t = arg;
+    qsched_finish_switch(qsched_worker());
+    qpreempt_enable();
+    qthread_wrapper(t->start_routine, t->arg);
+}
+
+/**
+ * @brief Creates a new thread with a deadline.
  *
- * Allocates memory, initializes the context, and adds the thread to the list.
+ * Takes a descriptor and stack from the stack cache (allocating them if it is
+ * empty), initializes the context, and adds the thread to the list.
  *
  * @param[out] new_thread Pointer to store the created thread (can be NULL).
  * @param[in] start_routine Function executed by the thread.
  * @param[in] arg Argument passed to the function.
+ * @param[in] deadline Absolute qthread_clock_ns() time (0 = none).
  * @return 0 on success, -1 on failure.
  */
-int qthread_create(thread_t **new_thread, void (*start_routine)(void *), void *args) {
-    thread_t *t = malloc(sizeof(thread_t));
-    if (!t) return -1;
+int qthread_create_deadline(thread_t **new_thread, void (*start_routine)(void *), void *args,
+                            uint64_t deadline) {
+    if (qsched_start() == -1) return -1;
 
-    t->stack = malloc(stack_size);
-    if (!t->stack) {
-        free(t);
-        return -1;
-    }
+    qworker_t *w = qsched_worker();
+    qstack_cache_t *cache = &(w ? w : &qsched_workers[0])->stacks;
 
-    t->state = READY;
+    thread_t *t = qstack_acquire(cache, stack_size);
+    if (!t) return -1;
 
-    if (getcontext(&t->context) == -1) {
-        free(t->stack);
-        free(t);
+    t->start_routine = start_routine;
+    t->arg = args;
+
+    if (qcontext_make(&t->context, t->stack, t->stack_size, qthread_entry, t) == -1) {
+        qstack_release(cache, t);
         return -1;
     }
-    t->context.uc_stack.ss_sp = t->stack;
-    t->context.uc_stack.ss_size = stack_size;
-    t->context.uc_link = NULL;
-    makecontext(&t->context, (void (*)()) qthread_wrapper, 2, start_routine, args);
 
-    // Insert into circular list
+    t->lock = (qthread_spinlock_t){0};
+    t->joiners = NULL;
+    t->wait_next = NULL;
+    t->pending_joins = 0;
+    t->outside_joins = 0;
+    t->preempt_disabled = 0;
+    t->priority = QTHREAD_PRIO_DEFAULT;
+    t->sched_key = 0;
+    t->sched_index = -1;
+    t->sched_rq = NULL;
+    t->deadline = deadline;
+    t->deadline_missed = 0;
+    qstats_init(t);
+
+    // Insert at the tail of the circular list (just before the head)
+    qspin_lock(&list_lock);
+    __atomic_add_fetch(&live_threads, 1, __ATOMIC_RELAXED);
     if (!thread_list) {
         thread_list = t;
         t->next = t;
-        // Do not set current here; it will be handled by scheduler
+        t->prev = t;
     } else {
-        thread_t *temp = thread_list;
-        while (temp->next != thread_list)
-            temp = temp->next;
-        temp->next = t;
+        thread_t *tail = thread_list->prev;
+        tail->next = t;
+        t->prev = tail;
         t->next = thread_list;
+        thread_list->prev = t;
     }
+    qspin_unlock(&list_lock);
 
     if (new_thread)
         *new_thread = t;
 
+    qtrace_create(t);
+    qsched_wake(t); // Make it READY on this worker
+
     return 0;
 }
 
+/**
+ * @brief Creates a new thread.
+ *
+ * @param[out] new_thread Pointer to store the created thread (can be NULL).
+ * @param[in] start_routine Function executed by the thread.
+ * @param[in] arg Argument passed to the function.
+ * @return 0 on success, -1 on failure.
+ */
+int qthread_create(thread_t **new_thread, void (*start_routine)(void *), void *args) {
+    return qthread_create_deadline(new_thread, start_routine, args, 0);
+}
+
+/**
+ * @brief Tells whether a thread has finished (predicate for qsched_run).
+ *
+ * @param arg The thread.
+ */
+static int qthread_finished(void *arg) {
+    thread_t *t = arg;
+    return __atomic_load_n(&t->state, __ATOMIC_ACQUIRE) == FINISHED;
+}
+
 /**
  * @brief Waits for a thread to finish.
  *
- * Blocks execution until the specified thread completes.
+ * Blocks the calling thread (without being scheduled) until the specified
+ * thread completes. Called from outside any thread, it runs threads on the
+ * calling kernel thread until the thread completes. The last joiner releases
+ * the thread.
  *
  * @param[in] thread Thread to wait for.
  * @param[out] retval Pointer to store the thread's return value (can be NULL).
- * @return 0 on success, -1 on failure.
+ * @return 0 on success, -1 if the thread is the caller or can no longer finish.
  */
 int qthread_join(thread_t *thread, void **retval) {
-    while (thread->state != FINISHED) {
-        qscheduler(); // Wait until the thread finishes
-    }
+    qworker_t *w = qsched_worker();
+    thread_t *self = qthread_self();
 
-    if (retval) *retval = thread->retval; // Store return value if requested
-    
-    if (thread_list) {
-        thread_t *prev = thread_list;
-        thread_t *curr = thread_list->next;
+    if (thread == self) return -1; // A thread cannot join itself
 
-        if (prev == curr && prev == thread) {
-            thread_list = NULL;
+    qspin_lock(&thread->lock);
+    if (thread->state != FINISHED) {
+        if (self) {
+            // Block until the exit wakes us
+            self->state = BLOCKED;
+            self->wait_next = thread->joiners;
+            thread->joiners = self;
+            thread->pending_joins++;
+            qsched_block(&thread->lock);
+            qspin_lock(&thread->lock);
+            thread->pending_joins--;
         } else {
-            while (curr != thread && curr != thread_list) {
-                prev = curr;
-                curr = curr->next;
-            }
-
-            if (curr == thread) {
-                prev->next = curr->next;
-                if (thread_list == curr) {
-                    thread_list = prev->next;
-                }
+            // Outside any thread: run threads on this kernel thread until it finishes
+            thread->outside_joins++;
+            qspin_unlock(&thread->lock);
+            if (w) qsched_run(qthread_finished, thread);
+            qspin_lock(&thread->lock);
+            thread->outside_joins--;
+            if (thread->state != FINISHED) {
+                qspin_unlock(&thread->lock);
+                return -1; // Nothing left that could finish it
             }
         }
     }
 
-    free(thread->stack); // Free allocated stack
-    free(thread); // Free thread structure
+    if (retval) *retval = thread->retval; // Store return value if requested
+
+    int last = thread->pending_joins == 0 && thread->outside_joins == 0;
+    qspin_unlock(&thread->lock);
+    if (!last) return 0; // The last joiner releases the thread
+
+    // Unlink from the circular list
+    qspin_lock(&list_lock);
+    if (thread->next == thread) {
+        thread_list = NULL;
+    } else {
+        thread->prev->next = thread->next;
+        thread->next->prev = thread->prev;
+        if (thread_list == thread)
+            thread_list = thread->next;
+    }
+    qspin_unlock(&list_lock);
+
+    // Recycle the descriptor and its stack
+    w = qsched_worker();
+    qstack_release(&(w ? w : &qsched_workers[0])->stacks, thread);
 
     return 0; // Success
 }
+
+/**
+ * @brief Starts the runtime and registers the caller as the main thread.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int qthread_init(void) {
+    if (qsched_start() == -1) return -1;
+    if (qsched_main) return -1;
+
+    main_thread = (thread_t){0};
+    main_thread.priority = QTHREAD_PRIO_DEFAULT;
+    main_thread.sched_index = -1;
+    qstats_init(&main_thread);
+    return qsched_register_main(&main_thread);
+}
+
+/**
+ * @brief Tells whether every created thread has finished (predicate for qsched_run).
+ *
+ * @param arg Unused.
+ */
+static int qthread_all_finished(void *arg) {
+    (void)arg;
+    return __atomic_load_n(&live_threads, __ATOMIC_ACQUIRE) == 0;
+}
+
+/**
+ * @brief Waits for every thread to finish and stops the runtime.
+ *
+ * @return 0 on success, -1 if called from elsewhere or a thread cannot finish.
+ */
+int qthread_shutdown(void) {
+    if (!qsched_nworkers) return 0;
+
+    thread_t *self = qthread_self();
+    if (qsched_worker() != qsched_workers || self != qsched_main) return -1;
+
+    qspin_lock(&list_lock);
+    if (self) {
+        while (live_threads) {
+            // Parked as a thread; the last exit wakes us
+            shutdown_waiter = self;
+            self->state = BLOCKED;
+            qsched_block(&list_lock);
+            qspin_lock(&list_lock);
+        }
+        qspin_unlock(&list_lock);
+    } else {
+        shutdown_outside = 1;
+        qspin_unlock(&list_lock);
+        qsched_run(qthread_all_finished, NULL);
+        qspin_lock(&list_lock);
+        shutdown_outside = 0;
+        int stuck = live_threads != 0;
+        qspin_unlock(&list_lock);
+        if (stuck) return -1; // Nothing left that could finish them
+    }
+
+    // Release the threads nobody joined, once their exit switch is complete
+    qspin_lock(&list_lock);
+    thread_t *t = thread_list;
+    thread_list = NULL;
+    qspin_unlock(&list_lock);
+    if (t) t->prev->next = NULL;
+    while (t) {
+        thread_t *next = t->next;
+        qspin_lock(&t->lock);
+        qspin_unlock(&t->lock);
+        qstack_release(&qsched_workers[0].stacks, t);
+        t = next;
+    }
+
+    qsched_stop();
+    return 0;
+}
@@ -0,0 +1,310 @@
+/*
+ * @file qtimer.c
+ * @brief Hierarchical timer wheels and scheduler-aware sleeps.
+ *
+ * Every worker owns a wheel. Timers are armed on the wheel of the worker the
+ * calling thread runs on and fire on whichever worker advances that wheel:
+ * its owner between scheduling decisions, or any idle worker, which also
+ * bounds how long it sleeps by the earliest pending deadline.
+ */
+#include "qtimer.h"
+#include "qsched.h"
+#include <errno.h>
+#include <time.h>
+
+/// Mask of a wheel slot index.
+#define QWHEEL_MASK ((uint64_t)QWHEEL_SLOTS - 1)
+
+uint64_t qtimer_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Links a timer into the slot matching its distance from wheel->now.
+ *
+ * @param wheel Locked wheel.
+ * @param t Timer with its expiry set.
+ */
+static void wheel_insert(qwheel_t *wheel, qtimer_t *t) {
+    uint64_t when = t->expiry > wheel->now ? t->expiry : wheel->now;
+    uint64_t delta = when - wheel->now;
+    int level = 0;
+
+    while (level < QWHEEL_LEVELS - 1 && delta >> (QWHEEL_SLOT_BITS * (level + 1)))
+        level++;
+    if (delta >> (QWHEEL_SLOT_BITS * QWHEEL_LEVELS)) {
+        // Beyond the top level: park in its farthest slot and re-file on the way down
+        when = wheel->now + (1ULL << (QWHEEL_SLOT_BITS * QWHEEL_LEVELS)) - 1;
+    }
+
+    int slot = (int)((when >> (QWHEEL_SLOT_BITS * level)) & QWHEEL_MASK);
+    qtimer_t **head = &wheel->slots[level][slot];
+    t->level = level;
+    t->slot = slot;
+    t->prev = NULL;
+    t->next = *head;
+    if (*head) (*head)->prev = t;
+    *head = t;
+    wheel->occupied[level] |= 1ULL << slot;
+}
+
+/**
+ * @brief Unlinks an armed timer from its slot.
+ *
+ * @param wheel Locked wheel holding t.
+ * @param t Timer to unlink.
+ */
+static void wheel_remove(qwheel_t *wheel, qtimer_t *t) {
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        wheel->slots[t->level][t->slot] = t->next;
+    if (t->next) t->next->prev = t->prev;
+    if (!wheel->slots[t->level][t->slot])
+        wheel->occupied[t->level] &= ~(1ULL << t->slot);
+}
+
+/**
+ * @brief Finds the next tick at which the wheel has a slot to process.
+ *
+ * For level 0 that is the tick a timer expires; for higher levels, the tick
+ * at which a non-empty slot is cascaded to the levels below.
+ *
+ * @param wheel Locked wheel.
+ * @return The tick (not before wheel->now), or UINT64_MAX if the wheel is empty.
+ */
+static uint64_t wheel_next(qwheel_t *wheel) {
+    uint64_t next = UINT64_MAX;
+
+    for (int level = 0; level < QWHEEL_LEVELS; level++) {
+        uint64_t bits = wheel->occupied[level];
+        if (!bits) continue;
+
+        int shift = QWHEEL_SLOT_BITS * level;
+        uint64_t span = 1ULL << shift;
+        uint64_t start = (wheel->now + span - 1) & ~(span - 1); // First slot boundary
+        int pos = (int)((start >> shift) & QWHEEL_MASK);
+        uint64_t ahead = pos ? (bits >> pos) | (bits << (QWHEEL_SLOTS - pos)) : bits;
+
+        uint64_t tick = start + ((uint64_t)__builtin_ctzll(ahead) << shift);
+        if (tick < next) next = tick;
+    }
+    return next;
+}
+
+/**
+ * @brief Moves the timers of the current slot of a level to the levels below.
+ *
+ * @param wheel Locked wheel whose now is a slot boundary of level.
+ * @param level Level to cascade (at least 1).
+ */
+static void wheel_cascade(qwheel_t *wheel, int level) {
+    int slot = (int)((wheel->now >> (QWHEEL_SLOT_BITS * level)) & QWHEEL_MASK);
+    qtimer_t *t = wheel->slots[level][slot];
+
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~(1ULL << slot);
+    while (t) {
+        qtimer_t *next = t->next;
+        wheel_insert(wheel, t);
+        t = next;
+    }
+}
+
+qwheel_t *qtimer_lock_local(void) {
+    qpreempt_disable();
+    qworker_t *w = qsched_worker();
+    qwheel_t *wheel = w ? &w->wheel : &qsched_workers[0].wheel;
+    qspin_lock(&wheel->lock);
+    qpreempt_enable();
+    return wheel;
+}
+
+void qtimer_add(qwheel_t *wheel, qtimer_t *t, uint64_t deadline,
+                void (*fire)(qtimer_t *), void *arg) {
+    // Round up so a timer never fires before its deadline, saturating near UINT64_MAX
+    uint64_t round = (1ULL << QTIMER_TICK_SHIFT) - 1;
+    t->expiry = deadline > UINT64_MAX - round ? UINT64_MAX >> QTIMER_TICK_SHIFT
+                                              : (deadline + round) >> QTIMER_TICK_SHIFT;
+    t->fire = fire;
+    t->arg = arg;
+    t->wheel = wheel;
+    t->home = wheel;
+
+    if (!wheel->count) {
+        // Nothing to cascade: catch up with the clock so the timer lands low
+        uint64_t now = qtimer_now() >> QTIMER_TICK_SHIFT;
+        if (now > wheel->now) wheel->now = now;
+    }
+    wheel_insert(wheel, t);
+    __atomic_store_n(&wheel->count, wheel->count + 1, __ATOMIC_RELAXED);
+}
+
+void qtimer_arm(qtimer_t *t, uint64_t deadline, void (*fire)(qtimer_t *), void *arg) {
+    qwheel_t *wheel = qtimer_lock_local();
+    qtimer_add(wheel, t, deadline, fire, arg);
+    qspin_unlock(&wheel->lock);
+}
+
+int qtimer_cancel(qtimer_t *t) {
+    // Lock even an expired timer's wheel: its fire function may still be running
+    qwheel_t *wheel = t->home;
+    int cancelled = 0;
+    qspin_lock(&wheel->lock);
+    if (t->wheel) {
+        wheel_remove(wheel, t);
+        t->wheel = NULL;
+        __atomic_store_n(&wheel->count, wheel->count - 1, __ATOMIC_RELAXED);
+        cancelled = 1;
+    }
+    qspin_unlock(&wheel->lock);
+    return cancelled;
+}
+
+int qtimer_poll(qwheel_t *wheel) {
+    if (!__atomic_load_n(&wheel->count, __ATOMIC_RELAXED)) return 0;
+    if (!qspin_trylock(&wheel->lock)) return 0;
+
+    uint64_t target = qtimer_now() >> QTIMER_TICK_SHIFT;
+    int fired = 0;
+    uint64_t tick;
+
+    while ((tick = wheel_next(wheel)) <= target) {
+        wheel->now = tick;
+        for (int level = QWHEEL_LEVELS - 1; level > 0; level--) {
+            if (!(tick & ((1ULL << (QWHEEL_SLOT_BITS * level)) - 1)))
+                wheel_cascade(wheel, level);
+        }
+
+        int slot = (int)(tick & QWHEEL_MASK);
+        qtimer_t *t = wheel->slots[0][slot];
+        wheel->slots[0][slot] = NULL;
+        wheel->occupied[0] &= ~(1ULL << slot);
+        while (t) {
+            qtimer_t *next = t->next; // t may be gone once fired
+            t->wheel = NULL;
+            __atomic_store_n(&wheel->count, wheel->count - 1, __ATOMIC_RELAXED);
+            t->fire(t);
+            fired++;
+            t = next;
+        }
+        wheel->now = tick + 1;
+    }
+    if (wheel->now <= target) wheel->now = target + 1;
+
+    qspin_unlock(&wheel->lock);
+    return fired;
+}
+
+uint64_t qtimer_next_deadline(void) {
+    uint64_t next = UINT64_MAX;
+
+    for (int i = 0; i < qsched_nworkers; i++) {
+        qwheel_t *wheel = &qsched_workers[i].wheel;
+        if (!__atomic_load_n(&wheel->count, __ATOMIC_RELAXED)) continue;
+
+        qspin_lock(&wheel->lock);
+        uint64_t tick = wheel_next(wheel);
+        qspin_unlock(&wheel->lock);
+        if (tick != UINT64_MAX && (tick << QTIMER_TICK_SHIFT) < next)
+            next = tick << QTIMER_TICK_SHIFT;
+    }
+    return next;
+}
+
+/**
+ * @brief Returns the monotonic clock used by qthread_sleep_until.
+ *
+ * @return CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t qthread_clock_ns(void) {
+    return qtimer_now();
+}
+
+/**
+ * @brief Fire function of a sleeping thread's timer.
+ *
+ * @param t Timer whose arg is the sleeping thread.
+ */
+static void qtimer_wake_thread(qtimer_t *t) {
+    qsched_wake(t->arg);
+}
+
+/**
+ * @brief Fire function of a sleep outside any thread.
+ *
+ * @param t Timer whose arg is the flag the caller is waiting on.
+ */
+static void qtimer_wake_outside(qtimer_t *t) {
+    __atomic_store_n((int *)t->arg, 1, __ATOMIC_RELEASE);
+    qsched_notify_all();
+}
+
+/**
+ * @brief Wait predicate of a sleep outside any thread.
+ *
+ * @param arg Flag set when the sleep is over.
+ */
+static int qtimer_expired(void *arg) {
+    return __atomic_load_n((int *)arg, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Sleeps until the monotonic clock reaches a deadline.
+ *
+ * A thread is parked on its worker's timer wheel, which keeps running other
+ * threads meanwhile. Outside any thread, the worker runs threads until the
+ * deadline; a kernel thread that is not part of the runtime just sleeps.
+ *
+ * @param deadline Absolute qthread_clock_ns() time in nanoseconds (UINT64_MAX for none).
+ * @return 0 on success.
+ */
+int qthread_sleep_until(uint64_t deadline) {
+    if (qtimer_now() >= deadline) return 0;
+
+    qtimer_t timer;
+    thread_t *self = qthread_self();
+    if (self && deadline == UINT64_MAX) {
+        // Nothing will wake it
+        qspin_lock(&self->lock);
+        self->state = BLOCKED;
+        qsched_block(&self->lock);
+        return 0;
+    }
+    if (self) {
+        qwheel_t *wheel = qtimer_lock_local();
+        qtimer_add(wheel, &timer, deadline, qtimer_wake_thread, self);
+        self->state = BLOCKED;
+        qsched_block(&wheel->lock);
+        return 0;
+    }
+
+    if (qsched_worker()) {
+        int expired = 0;
+        if (deadline != UINT64_MAX) qtimer_arm(&timer, deadline, qtimer_wake_outside, &expired);
+        qsched_run(qtimer_expired, &expired);
+        if (deadline != UINT64_MAX) qtimer_cancel(&timer);
+        if (expired) return 0;
+    }
+
+    struct timespec ts = {
+        .tv_sec = (time_t)(deadline / 1000000000ULL),
+        .tv_nsec = (long)(deadline % 1000000000ULL),
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+    return 0;
+}
+
+/**
+ * @brief Sleeps for a number of nanoseconds.
+ *
+ * @param ns Time to sleep.
+ * @return 0 on success.
+ */
+int qthread_sleep_ns(uint64_t ns) {
+    uint64_t now = qtimer_now();
+    return qthread_sleep_until(ns > UINT64_MAX - now ? UINT64_MAX : now + ns);
+}
@@ -0,0 +1,147 @@
+/*
+ * @file qtimer.h
+ * @brief Internal hierarchical timer wheels used for sleeps and timeouts.
+ */
+#ifndef QTIMER_H
+#define QTIMER_H
+
+#include "../include/qthread.h"
+#include <stdint.h>
+
+/// Nanoseconds per wheel tick, as a shift (2^16 ns, about 65 us).
+#define QTIMER_TICK_SHIFT 16
+
+/// Slots per wheel level (a power of two).
+#define QWHEEL_SLOTS 64
+
+/// log2(QWHEEL_SLOTS).
+#define QWHEEL_SLOT_BITS 6
+
+/// Levels; the top level spans 2^52 ticks.
+#define QWHEEL_LEVELS 6
+
+struct qwheel;
+
+/**
+ * @struct qtimer_t
+ * @brief A one-shot timer, usually living on the stack of the thread it wakes.
+ */
+typedef struct qtimer {
+    struct qtimer *next; ///< Next timer in the slot.
+    struct qtimer *prev; ///< Previous timer in the slot.
+    uint64_t expiry; ///< Expiry tick.
+    struct qwheel *wheel; ///< Wheel holding the timer (NULL once expired or cancelled).
+    struct qwheel *home; ///< Wheel the timer was last armed on, kept after it expires.
+    int level; ///< Wheel level of the slot holding the timer.
+    int slot; ///< Slot within the level.
+    void (*fire)(struct qtimer *); ///< Called on expiry, with the wheel lock held.
+    void *arg; ///< Argument for fire.
+} qtimer_t;
+
+/**
+ * @struct qwheel_t
+ * @brief Per-worker hierarchical timing wheel.
+ *
+ * Level L has QWHEEL_SLOTS slots of 2^(6L) ticks each. A timer goes to the
+ * lowest level whose span covers its distance from now and moves down a
+ * level each time the wheel reaches its slot, so arming, cancelling and
+ * firing are O(1) amortized.
+ */
+typedef struct qwheel {
+    qthread_spinlock_t lock; ///< Guards the wheel.
+    uint64_t now; ///< Next tick to process.
+    int count; ///< Armed timers (read without the lock).
+    uint64_t occupied[QWHEEL_LEVELS]; ///< Bitmap of non-empty slots per level.
+    qtimer_t *slots[QWHEEL_LEVELS][QWHEEL_SLOTS]; ///< Timer lists.
+} qwheel_t;
+
+/**
+ * @brief Returns the monotonic clock in nanoseconds.
+ */
+uint64_t qtimer_now(void);
+
+/**
+ * @brief Reads the CPU's cycle counter, or the monotonic clock where there is none.
+ *
+ * The time stamp counter on x86-64 and the virtual counter on aarch64: a
+ * few cycles per read, but in arbitrary units, so only differences measured
+ * on the same worker should be compared.
+ */
+static inline uint64_t qtimer_cycles(void) {
+#if defined(__x86_64__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    return qtimer_now();
+#endif
+}
+
+/**
+ * @brief Locks the wheel of the calling worker.
+ *
+ * A thread can arm a timer with qtimer_add and park with
+ * qsched_block(&wheel->lock): the timer cannot fire before the thread is
+ * switched out, since firing takes the same lock.
+ *
+ * @return The locked wheel (worker 0's outside the runtime's kernel threads).
+ */
+qwheel_t *qtimer_lock_local(void);
+
+/**
+ * @brief Adds a timer to a locked wheel.
+ *
+ * @param wheel Wheel, locked by the caller.
+ * @param t Timer to arm (must not be armed).
+ * @param deadline Absolute CLOCK_MONOTONIC time in nanoseconds.
+ * @param fire Function called once the deadline has passed.
+ * @param arg Stored in t->arg for fire.
+ */
+void qtimer_add(qwheel_t *wheel, qtimer_t *t, uint64_t deadline,
+                void (*fire)(qtimer_t *), void *arg);
+
+/**
+ * @brief Arms a timer on the calling worker's wheel.
+ *
+ * The caller must not hold a lock that fire takes.
+ *
+ * @param t Timer to arm (must not be armed).
+ * @param deadline Absolute CLOCK_MONOTONIC time in nanoseconds.
+ * @param fire Function called once the deadline has passed.
+ * @param arg Stored in t->arg for fire.
+ */
+void qtimer_arm(qtimer_t *t, uint64_t deadline, void (*fire)(qtimer_t *), void *arg);
+
+/**
+ * @brief Disarms a timer.
+ *
+ * Since timers fire under the wheel lock, once this returns the fire
+ * function is not running and will not run.
+ *
+ * @param t Timer to cancel.
+ * @return 1 if the timer was cancelled, 0 if it had already fired.
+ */
+int qtimer_cancel(qtimer_t *t);
+
+/**
+ * @brief Fires the expired timers of a wheel.
+ *
+ * Fire functions run on the calling worker, so threads they wake are queued
+ * there. Gives up if another worker holds the wheel lock.
+ *
+ * @param wheel Wheel to advance.
+ * @return Number of timers fired.
+ */
+int qtimer_poll(qwheel_t *wheel);
+
+/**
+ * @brief Earliest time any wheel may have a timer due.
+ *
+ * @return Lower bound in CLOCK_MONOTONIC nanoseconds, or UINT64_MAX if no
+ *         timer is armed.
+ */
+uint64_t qtimer_next_deadline(void);
+
+#endif // QTIMER_H
@@ -0,0 +1,131 @@
+/*
+ * @file qtrace.c
+ * @brief Trace rings of the workers and trace dumps (see qtrace.h).
+ */
+#include "qtrace.h"
+#include "qsched.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/// Events kept per worker (0 disables tracing).
+static size_t trace_events = 0;
+
+/// qtimer_cycles() and qtimer_now() when the current rings were allocated.
+static uint64_t start_cycles, start_ns;
+
+/**
+ * @brief Enables scheduler event tracing.
+ *
+ * @param events Events kept per worker, rounded up to a power of two (0 disables tracing).
+ * @return 0 on success, -1 if threads already exist.
+ */
+int qthread_set_trace(size_t events) {
+    if (qsched_nworkers) return -1;
+    size_t n = events ? 2 : 0;
+    while (n && n < events) n <<= 1;
+    trace_events = n;
+    return 0;
+}
+
+int qtrace_alloc(qtrace_ring_t **ring) {
+    *ring = NULL;
+    if (!trace_events) return 0;
+
+    qtrace_ring_t *r = malloc(sizeof(*r) + trace_events * sizeof(qtrace_event_t));
+    if (!r) return -1;
+    r->head = 0;
+    r->mask = trace_events - 1;
+    start_cycles = qtimer_cycles();
+    start_ns = qtimer_now();
+    *ring = r;
+    return 0;
+}
+
+void qtrace_create(thread_t *t) {
+    qpreempt_disable();
+    qworker_t *w = qsched_worker();
+    if (w) qtrace_record(w->trace, QTRACE_CREATE, 0, t, w->current);
+    qpreempt_enable();
+}
+
+/**
+ * @brief Writes a whole buffer, retrying short and interrupted writes.
+ *
+ * @return 0 on success, -1 with errno set.
+ */
+static int qtrace_write(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes the events of one worker, oldest first.
+ *
+ * The worker keeps recording meanwhile: the ring is copied, then events
+ * the worker may have overwritten during the copy are left out.
+ *
+ * @param fd Destination.
+ * @param w Worker.
+ * @param buf Buffer holding a whole ring.
+ * @return 0 on success, -1 with errno set.
+ */
+static int qtrace_dump_worker(int fd, qworker_t *w, qtrace_event_t *buf) {
+    qtrace_ring_t *r = w->trace;
+    uint64_t size = r->mask + 1;
+    uint64_t end = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t first = end > size ? end - size : 0;
+
+    for (uint64_t i = first; i < end; i++)
+        buf[i - first] = r->events[i & r->mask];
+
+    // The slot after the head may be half written as well
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    uint64_t valid = head + 1 > size ? head + 1 - size : 0;
+    if (valid > end) valid = end;
+    if (valid < first) valid = first;
+
+    qtrace_section_t section = { (uint32_t)w->id, 0, end - valid };
+    if (qtrace_write(fd, &section, sizeof(section)) == -1) return -1;
+    return qtrace_write(fd, buf + (valid - first), (end - valid) * sizeof(qtrace_event_t));
+}
+
+/**
+ * @brief Writes the events recorded by every worker to a file.
+ *
+ * @param fd Destination.
+ * @return 0 on success, -1 if tracing is off or writing failed.
+ */
+int qthread_trace_dump(int fd) {
+    int n = qsched_nworkers;
+    if (!n || !qsched_workers[0].trace) return -1;
+
+    qtrace_event_t *buf = malloc(trace_events * sizeof(qtrace_event_t));
+    if (!buf) return -1;
+
+    qtrace_header_t header = {0};
+    memcpy(header.magic, QTRACE_MAGIC, sizeof(header.magic));
+    header.workers = (uint32_t)n;
+    header.event_size = sizeof(qtrace_event_t);
+    header.start_cycles = start_cycles;
+    header.start_ns = start_ns;
+    header.dump_cycles = qtimer_cycles();
+    header.dump_ns = qtimer_now();
+
+    int ret = qtrace_write(fd, &header, sizeof(header));
+    for (int i = 0; i < n && ret == 0; i++)
+        ret = qtrace_dump_worker(fd, &qsched_workers[i], buf);
+    free(buf);
+    return ret;
+}
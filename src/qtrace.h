@@ -0,0 +1,130 @@
+/*
+ * @file qtrace.h
+ * @brief Internal scheduler event tracing and the format of trace dumps.
+ *
+ * Each worker records its events in a ring of its own, overwriting the
+ * oldest ones, so recording takes no lock and no atomic read-modify-write:
+ * a cycle counter read, one 32-byte store and a release store of the head.
+ * Only the owning worker writes a ring, always with preemption disabled, so
+ * a thread cannot be moved to another worker halfway through an event.
+ *
+ * qthread_trace_dump writes a qtrace_header_t, then for each worker a
+ * qtrace_section_t followed by its events, oldest first. The format is read
+ * by tools/qtrace2json.c.
+ */
+#ifndef QTRACE_H
+#define QTRACE_H
+
+#include "qtimer.h"
+#include <stdint.h>
+
+/// Magic string opening a trace dump (8 bytes with the terminator).
+#define QTRACE_MAGIC "QTRACE1"
+
+/**
+ * @enum qtrace_type_t
+ * @brief Kinds of traced events.
+ */
+typedef enum {
+    QTRACE_CREATE = 1, ///< thread was created by other.
+    QTRACE_WAKE,       ///< thread was made READY by other (after creation or a wait).
+    QTRACE_SWITCH,     ///< thread left the CPU READY (or was the scheduler context) and other runs.
+    QTRACE_BLOCK,      ///< thread left the CPU BLOCKED and other runs.
+    QTRACE_EXIT        ///< thread left the CPU FINISHED and other runs.
+} qtrace_type_t;
+
+/// Flag of a QTRACE_SWITCH forced by a preemption tick or a more urgent thread.
+#define QTRACE_PREEMPTED 1u
+
+/**
+ * @struct qtrace_event_t
+ * @brief One traced event.
+ *
+ * Threads are identified by the address of their descriptor, 0 standing
+ * for the scheduler context. Descriptors are recycled, so an address
+ * identifies a new thread after each QTRACE_CREATE.
+ */
+typedef struct {
+    uint64_t ts; ///< qtimer_cycles() when the event happened.
+    uint64_t thread; ///< Thread the event is about.
+    uint64_t other; ///< Thread switched to, or the creator or waker (0 if none).
+    uint32_t type; ///< A qtrace_type_t.
+    uint32_t flags; ///< QTRACE_PREEMPTED or 0.
+} qtrace_event_t;
+
+/**
+ * @struct qtrace_header_t
+ * @brief Start of a trace dump.
+ *
+ * Two readings of the cycle counter and the monotonic clock, when tracing
+ * started and when the dump was written, convert event times to nanoseconds.
+ */
+typedef struct {
+    char magic[8]; ///< QTRACE_MAGIC.
+    uint32_t workers; ///< Number of sections that follow.
+    uint32_t event_size; ///< sizeof(qtrace_event_t).
+    uint64_t start_cycles; ///< qtimer_cycles() when the rings were allocated.
+    uint64_t start_ns; ///< qtimer_now() at the same time.
+    uint64_t dump_cycles; ///< qtimer_cycles() when the dump was written.
+    uint64_t dump_ns; ///< qtimer_now() at the same time.
+} qtrace_header_t;
+
+/**
+ * @struct qtrace_section_t
+ * @brief Header of the events of one worker in a trace dump.
+ */
+typedef struct {
+    uint32_t worker; ///< Worker index.
+    uint32_t reserved; ///< Zero.
+    uint64_t count; ///< Events that follow.
+} qtrace_section_t;
+
+/**
+ * @struct qtrace_ring_t
+ * @brief Events of one worker.
+ */
+typedef struct {
+    uint64_t head; ///< Events recorded so far; the next goes to events[head & mask].
+    uint64_t mask; ///< Capacity minus one (a power of two).
+    qtrace_event_t events[]; ///< The ring.
+} qtrace_ring_t;
+
+/**
+ * @brief Records an event in a worker's ring.
+ *
+ * @param r Ring of the calling worker (NULL when tracing is off).
+ * @param type A qtrace_type_t.
+ * @param flags QTRACE_PREEMPTED or 0.
+ * @param t Thread the event is about (NULL for the scheduler context).
+ * @param other Related thread (can be NULL).
+ */
+static inline void qtrace_record(qtrace_ring_t *r, uint32_t type, uint32_t flags,
+                                 thread_t *t, thread_t *other) {
+    if (!r) return;
+    uint64_t head = r->head;
+    qtrace_event_t *e = &r->events[head & r->mask];
+    e->ts = qtimer_cycles();
+    e->thread = (uintptr_t)t;
+    e->other = (uintptr_t)other;
+    e->type = type;
+    e->flags = flags;
+    // Publish the event to qthread_trace_dump
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Allocates a worker's ring if tracing is enabled.
+ *
+ * @param[out] ring The ring, or NULL when tracing is off.
+ * @return 0 on success, -1 if the allocation failed.
+ */
+int qtrace_alloc(qtrace_ring_t **ring);
+
+/**
+ * @brief Records the creation of a thread by the running one.
+ *
+ * @param t New thread.
+ */
+void qtrace_create(thread_t *t);
+
+#endif // QTRACE_H
@@ -0,0 +1,404 @@
+/*
+ * @file quring.c
+ * @brief io_uring completion backend, driven through the raw system calls.
+ *
+ * One ring is shared by every worker and guarded by a spinlock. A thread
+ * fills a submission queue entry whose user_data points to a request on its
+ * own stack, parks under the ring lock, and is woken once the completion has
+ * been reaped. Filling an entry does not enter the kernel: the queue is
+ * handed over in one io_uring_enter by the next worker that polls the ring
+ * (between scheduling decisions, when its queues run dry, or when it blocks
+ * for completions while idle), so concurrent requests share a system call.
+ */
+#include "quring.h"
+#include "qio.h"
+#include "qsched.h"
+#include <errno.h>
+
+#ifndef QTHREAD_NO_IO_URING
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define QURING_SUPPORTED 1
+#endif
+#endif
+#endif
+
+#ifdef QURING_SUPPORTED
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/// Submission queue entries (the completion queue gets twice as many).
+#define QURING_ENTRIES 256
+
+/// Kernel features the backend relies on.
+#define QURING_FEATURES (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | \
+                         IORING_FEAT_RW_CUR_POS | IORING_FEAT_EXT_ARG)
+
+/**
+ * @struct quring_t
+ * @brief The shared ring and pointers into its kernel-mapped queues.
+ */
+typedef struct {
+    qthread_spinlock_t lock; ///< Guards the submission tail and the completion head.
+    int fd; ///< io_uring instance.
+    unsigned *sq_head; ///< Submission entries consumed by the kernel.
+    unsigned *sq_tail; ///< Submission entries queued.
+    unsigned *sq_array; ///< Submission queue (indices into sqes).
+    unsigned sq_mask; ///< Mask of a submission queue index.
+    unsigned sq_entries; ///< Submission queue size.
+    struct io_uring_sqe *sqes; ///< Submission entries.
+    unsigned *cq_head; ///< Completions reaped.
+    unsigned *cq_tail; ///< Completions posted by the kernel.
+    unsigned cq_mask; ///< Mask of a completion queue index.
+    struct io_uring_cqe *cqes; ///< Completion entries.
+    int inflight; ///< Requests of parked threads not reaped yet.
+    int wakeup_fd; ///< eventfd polled through the ring to interrupt a blocked worker.
+} quring_t;
+
+/**
+ * @struct quring_req_t
+ * @brief A request of a parked thread, referenced by the entry's user_data.
+ */
+typedef struct {
+    thread_t *thread; ///< Thread to wake on completion.
+    int res; ///< Result of the request (negated errno on failure).
+} quring_req_t;
+
+static quring_t ring;
+
+/**
+ * @brief Calls io_uring_enter on the ring.
+ *
+ * @param to_submit Maximum entries to hand to the kernel.
+ * @param min_complete Completions to wait for.
+ * @param flags IORING_ENTER_* flags.
+ * @param arg Wait timeout (can be NULL).
+ * @return Entries submitted, or -1 with errno set.
+ */
+static int quring_enter(unsigned to_submit, unsigned min_complete, unsigned flags,
+                        struct io_uring_getevents_arg *arg) {
+    if (arg) flags |= IORING_ENTER_EXT_ARG;
+    return (int)syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags,
+                        arg, arg ? sizeof(*arg) : 0);
+}
+
+/**
+ * @brief Takes the next free submission entry.
+ *
+ * Hands the queued entries to the kernel if the queue is full.
+ *
+ * @return A zeroed entry; the caller holds the ring lock.
+ */
+static struct io_uring_sqe *quring_sqe(void) {
+    unsigned tail = *ring.sq_tail;
+
+    while (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries)
+        quring_enter(ring.sq_entries, 0, 0, NULL);
+
+    struct io_uring_sqe *sqe = &ring.sqes[tail & ring.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/**
+ * @brief Queues the entry returned by the last quring_sqe call.
+ */
+static void quring_push(void) {
+    unsigned tail = *ring.sq_tail;
+
+    ring.sq_array[tail & ring.sq_mask] = tail & ring.sq_mask;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Queues a poll of the wakeup eventfd (user_data 0).
+ */
+static void quring_arm_wakeup(void) {
+    struct io_uring_sqe *sqe = quring_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = ring.wakeup_fd;
+    sqe->poll32_events = POLLIN;
+    quring_push();
+}
+
+int quring_init(int wakeup_fd) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    int fd = (int)syscall(__NR_io_uring_setup, QURING_ENTRIES, &p);
+    if (fd < 0) return -1;
+    if ((p.features & QURING_FEATURES) != QURING_FEATURES) {
+        close(fd);
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t size = sq_size > cq_size ? sq_size : cq_size;
+    size_t sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    char *rings = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    void *sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        munmap(rings, size);
+        close(fd);
+        return -1;
+    }
+
+    ring.fd = fd;
+    ring.sq_head = (unsigned *)(rings + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(rings + p.sq_off.tail);
+    ring.sq_array = (unsigned *)(rings + p.sq_off.array);
+    ring.sq_mask = *(unsigned *)(rings + p.sq_off.ring_mask);
+    ring.sq_entries = p.sq_entries;
+    ring.sqes = sqes;
+    ring.cq_head = (unsigned *)(rings + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(rings + p.cq_off.tail);
+    ring.cq_mask = *(unsigned *)(rings + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+    ring.wakeup_fd = wakeup_fd;
+
+    quring_arm_wakeup();
+    quring_enter(ring.sq_entries, 0, 0, NULL);
+    return 0;
+}
+
+int quring_inflight(void) {
+    return __atomic_load_n(&ring.inflight, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Queues a request for the calling thread and parks it until completion.
+ *
+ * @param opcode IORING_OP_* operation.
+ * @param fd File descriptor.
+ * @param addr Buffer or address argument.
+ * @param len Length argument.
+ * @param off Offset argument (or second address).
+ * @param op_flags Operation-specific flags (poll events, accept flags, ...).
+ * @return Result of the request (negated errno on failure).
+ */
+static int quring_submit(uint8_t opcode, int fd, const void *addr, uint32_t len,
+                         uint64_t off, uint32_t op_flags) {
+    quring_req_t req = { .thread = qthread_self() };
+
+    qspin_lock(&ring.lock);
+    struct io_uring_sqe *sqe = quring_sqe();
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->rw_flags = (int)op_flags; // Shares its union with the other per-op flags
+    sqe->user_data = (uintptr_t)&req;
+    quring_push();
+    __atomic_store_n(&ring.inflight, ring.inflight + 1, __ATOMIC_RELAXED);
+
+    req.thread->state = BLOCKED;
+    qsched_block(&ring.lock);
+    return req.res;
+}
+
+/**
+ * @brief Waits for a non-blocking fd to become ready through the ring.
+ *
+ * @param fd File descriptor.
+ * @param events POLLIN or POLLOUT.
+ * @return 0 once the fd is ready, -1 with errno set on failure.
+ */
+static int quring_wait(int fd, uint32_t events) {
+    int res = quring_submit(IORING_OP_POLL_ADD, fd, NULL, 0, 0, events);
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return 0;
+}
+
+int quring_poll(uint64_t deadline) {
+    if (deadline) {
+        struct __kernel_timespec ts;
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        if (deadline != UINT64_MAX) {
+            uint64_t now = qtimer_now();
+            uint64_t left = deadline > now ? deadline - now : 0;
+            ts.tv_sec = (long long)(left / 1000000000ULL);
+            ts.tv_nsec = (long long)(left % 1000000000ULL);
+            arg.ts = (uintptr_t)&ts;
+        }
+        quring_enter(ring.sq_entries, 1, IORING_ENTER_GETEVENTS, &arg);
+    } else {
+        if (!quring_inflight()) return 0;
+        if (__atomic_load_n(ring.sq_tail, __ATOMIC_RELAXED) != __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE))
+            quring_enter(ring.sq_entries, 0, 0, NULL);
+        // Leave completions to a worker waiting for them, or it could miss its wakeup
+        if (qio_parked()) return 0;
+        if (__atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE) == __atomic_load_n(ring.cq_head, __ATOMIC_RELAXED))
+            return 0;
+    }
+
+    // Reap every completion, then wake their threads in completion order
+    thread_t *head = NULL, **link = &head;
+    int woken = 0, rearm = 0;
+
+    qspin_lock(&ring.lock);
+    unsigned cq_head = *ring.cq_head;
+    unsigned cq_tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; cq_head != cq_tail; cq_head++) {
+        struct io_uring_cqe *cqe = &ring.cqes[cq_head & ring.cq_mask];
+        quring_req_t *req = (quring_req_t *)(uintptr_t)cqe->user_data;
+        if (!req) {
+            rearm = 1;
+            continue;
+        }
+        req->res = cqe->res;
+        *link = req->thread;
+        link = &req->thread->wait_next;
+        woken++;
+    }
+    *link = NULL;
+    __atomic_store_n(ring.cq_head, cq_head, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring.inflight, ring.inflight - woken, __ATOMIC_RELAXED);
+    if (rearm) {
+        qio_wakeup_drain();
+        quring_arm_wakeup();
+    }
+    qspin_unlock(&ring.lock);
+
+    while (head) {
+        thread_t *next = head->wait_next;
+        head->wait_next = NULL;
+        qsched_wake(head);
+        head = next;
+    }
+    return woken;
+}
+
+ssize_t quring_read(int fd, void *buf, size_t count) {
+    uint32_t len = count > UINT32_MAX ? UINT32_MAX : (uint32_t)count;
+
+    for (;;) {
+        int res = quring_submit(IORING_OP_READ, fd, buf, len, (uint64_t)-1, 0);
+        if (res >= 0) return res;
+        if (res != -EAGAIN) {
+            errno = -res;
+            return -1;
+        }
+        // O_NONBLOCK fd: the kernel does not wait for data on our behalf
+        if (quring_wait(fd, POLLIN) == -1) return -1;
+    }
+}
+
+ssize_t quring_write(int fd, const void *buf, size_t count) {
+    uint32_t len = count > UINT32_MAX ? UINT32_MAX : (uint32_t)count;
+
+    for (;;) {
+        int res = quring_submit(IORING_OP_WRITE, fd, buf, len, (uint64_t)-1, 0);
+        if (res >= 0) return res;
+        if (res != -EAGAIN) {
+            errno = -res;
+            return -1;
+        }
+        if (quring_wait(fd, POLLOUT) == -1) return -1;
+    }
+}
+
+int quring_accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
+    for (;;) {
+        int res = quring_submit(IORING_OP_ACCEPT, fd, addr, 0, (uintptr_t)addrlen,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (res >= 0) return res;
+        if (res != -EAGAIN) {
+            errno = -res;
+            return -1;
+        }
+        if (quring_wait(fd, POLLIN) == -1) return -1;
+    }
+}
+
+int quring_connect(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+    int res = quring_submit(IORING_OP_CONNECT, fd, addr, 0, addrlen, 0);
+    if (res == 0) return 0;
+    if (res != -EINPROGRESS && res != -EAGAIN) {
+        errno = -res;
+        return -1;
+    }
+    if (quring_wait(fd, POLLOUT) == -1) return -1;
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) return -1;
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int quring_fsync(int fd) {
+    int res = quring_submit(IORING_OP_FSYNC, fd, NULL, 0, 0, 0);
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return 0;
+}
+
+#else // !QURING_SUPPORTED
+
+int quring_init(int wakeup_fd) {
+    (void)wakeup_fd;
+    return -1;
+}
+
+int quring_inflight(void) {
+    return 0;
+}
+
+int quring_poll(uint64_t deadline) {
+    (void)deadline;
+    return 0;
+}
+
+ssize_t quring_read(int fd, void *buf, size_t count) {
+    (void)fd; (void)buf; (void)count;
+    errno = ENOSYS;
+    return -1;
+}
+
+ssize_t quring_write(int fd, const void *buf, size_t count) {
+    (void)fd; (void)buf; (void)count;
+    errno = ENOSYS;
+    return -1;
+}
+
+int quring_accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
+    (void)fd; (void)addr; (void)addrlen;
+    errno = ENOSYS;
+    return -1;
+}
+
+int quring_connect(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+    (void)fd; (void)addr; (void)addrlen;
+    errno = ENOSYS;
+    return -1;
+}
+
+int quring_fsync(int fd) {
+    (void)fd;
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif // QURING_SUPPORTED
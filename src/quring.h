@@ -0,0 +1,65 @@
+/*
+ * @file quring.h
+ * @brief Internal io_uring completion backend of the I/O layer.
+ *
+ * Threads queue their requests in a submission ring shared by all workers
+ * and park; requests are handed to the kernel in batches by whichever worker
+ * next polls the ring, and their completions are reaped in batches too.
+ * Every call is meant for a thread (qthread_self() != NULL).
+ */
+#ifndef QURING_H
+#define QURING_H
+
+#include "../include/qthread.h"
+#include <stdint.h>
+
+/**
+ * @brief Sets up the ring.
+ *
+ * @param wakeup_fd eventfd whose readability must complete a poll of the
+ *        ring (see qio_wakeup).
+ * @return 0 on success, -1 if io_uring is unavailable or lacks the features
+ *         the backend needs.
+ */
+int quring_init(int wakeup_fd);
+
+/**
+ * @brief Number of requests submitted and not yet completed.
+ */
+int quring_inflight(void);
+
+/**
+ * @brief Submits queued requests and wakes the threads whose requests completed.
+ *
+ * @param deadline Absolute CLOCK_MONOTONIC time in nanoseconds to wait for a
+ *        completion until, 0 not to wait, UINT64_MAX to wait indefinitely.
+ * @return Number of threads woken.
+ */
+int quring_poll(uint64_t deadline);
+
+/**
+ * @brief read(2) through the ring. Returns -1 with errno set on failure.
+ */
+ssize_t quring_read(int fd, void *buf, size_t count);
+
+/**
+ * @brief write(2) through the ring. Returns -1 with errno set on failure.
+ */
+ssize_t quring_write(int fd, const void *buf, size_t count);
+
+/**
+ * @brief accept4(2) through the ring; the new socket is non-blocking.
+ */
+int quring_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+/**
+ * @brief connect(2) through the ring, waiting for the connection to complete.
+ */
+int quring_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+
+/**
+ * @brief fsync(2) through the ring.
+ */
+int quring_fsync(int fd);
+
+#endif // QURING_H
@@ -0,0 +1,87 @@
+/*
+ * @file qwaitq.h
+ * @brief Internal helpers for the FIFO wait queues of synchronization objects.
+ *
+ * Waiters are linked through thread_t::wait_next, so parking needs no
+ * allocation. Every call but qwaitq_claim is made with the lock guarding the
+ * queue held.
+ *
+ * A wait that can also end with a timeout is won by whoever first claims
+ * the waiter through thread_t::wait_status: a waker that loses drops the
+ * thread it dequeued, and a timed-out waiter removes itself from the queue.
+ */
+#ifndef QWAITQ_H
+#define QWAITQ_H
+
+#include "../include/qthread.h"
+
+/// Values of thread_t::wait_status.
+enum {
+    QWAIT_PENDING, ///< Not claimed yet.
+    QWAIT_WOKEN, ///< Ended by a waker.
+    QWAIT_TIMEDOUT ///< Ended by the timeout.
+};
+
+/**
+ * @brief Appends a thread to a wait queue.
+ *
+ * @param q Queue.
+ * @param t Thread, not in any wait queue.
+ */
+static inline void qwaitq_push(qthread_waitq_t *q, thread_t *t) {
+    t->wait_next = NULL;
+    t->wait_status = QWAIT_PENDING;
+    if (q->tail) q->tail->wait_next = t;
+    else q->head = t;
+    q->tail = t;
+}
+
+/**
+ * @brief Removes the thread that has waited longest.
+ *
+ * @param q Queue.
+ * @return The thread, or NULL if the queue is empty.
+ */
+static inline thread_t *qwaitq_pop(qthread_waitq_t *q) {
+    thread_t *t = q->head;
+    if (!t) return NULL;
+    q->head = t->wait_next;
+    if (!q->head) q->tail = NULL;
+    t->wait_next = NULL;
+    return t;
+}
+
+/**
+ * @brief Removes a given thread from a wait queue.
+ *
+ * @param q Queue.
+ * @param t Thread to remove.
+ * @return 1 if it was queued, 0 otherwise.
+ */
+static inline int qwaitq_remove(qthread_waitq_t *q, thread_t *t) {
+    thread_t *prev = NULL;
+    for (thread_t *cur = q->head; cur; prev = cur, cur = cur->wait_next) {
+        if (cur != t) continue;
+        if (prev) prev->wait_next = t->wait_next;
+        else q->head = t->wait_next;
+        if (q->tail == t) q->tail = prev;
+        t->wait_next = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Ends the wait of a thread unless something else ended it first.
+ *
+ * @param t Waiting thread.
+ * @param status QWAIT_WOKEN or QWAIT_TIMEDOUT.
+ * @return 1 if the caller ended the wait and must wake the thread, 0 otherwise.
+ */
+static inline int qwaitq_claim(thread_t *t, int status) {
+    int expected = QWAIT_PENDING;
+    return __atomic_compare_exchange_n(&t->wait_status, &expected, status, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+#endif // QWAITQ_H
@@ -0,0 +1,266 @@
+/*
+ * @file qtrace2json.c
+ * @brief Converts a qthread_trace_dump file to Chrome trace JSON.
+ *
+ * The output loads in chrome://tracing and Perfetto, with two processes:
+ *
+ * - workers: one track per worker, with a slice for each thread it ran (the
+ *   reason it stopped in the slice's arguments) and instant events for the
+ *   threads it created and woke.
+ * - threads: one track per thread, with running, ready and blocked slices,
+ *   so a ready slice is the wake-to-run (or yield-to-run) latency.
+ *
+ * Threads are numbered in order of appearance, a recycled descriptor getting
+ * a new number when it is created again. Timestamps are microseconds since
+ * tracing started.
+ *
+ * Usage: qtrace2json dump [out.json] (stdin / stdout for "-" or when omitted).
+ */
+#include "../src/qtrace.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @struct trace_event_t
+ * @brief An event with the worker that recorded it.
+ */
+typedef struct {
+    qtrace_event_t e; ///< The event.
+    uint32_t worker; ///< Worker index.
+    uint64_t seq; ///< Position in the dump, to keep the sort stable.
+} trace_event_t;
+
+/// States shown on the thread tracks.
+enum { T_NONE, T_RUNNING, T_READY, T_BLOCKED };
+
+/// Names of the states.
+static const char *state_names[] = { NULL, "running", "ready", "blocked" };
+
+/**
+ * @struct trace_thread_t
+ * @brief What the converter knows of a thread address.
+ */
+typedef struct {
+    uint64_t addr; ///< Descriptor address (0 for a free slot).
+    int id; ///< Number of the current incarnation.
+    int state; ///< State since `since`.
+    double since; ///< Time the state was entered.
+} trace_thread_t;
+
+/**
+ * @struct trace_worker_t
+ * @brief Slice open on a worker track.
+ */
+typedef struct {
+    int id; ///< Thread running (0 for none).
+    double since; ///< Time it was switched in.
+} trace_worker_t;
+
+static FILE *out;
+static int first = 1;
+static trace_thread_t *threads;
+static size_t threads_mask;
+static int next_id = 1;
+
+/**
+ * @brief Writes one object of the traceEvents array.
+ */
+static void emit(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void emit(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    fputs(first ? "\n" : ",\n", out);
+    first = 0;
+    vfprintf(out, fmt, ap);
+    va_end(ap);
+}
+
+/**
+ * @brief Orders events by timestamp, then by position in the dump.
+ */
+static int cmp_event(const void *a, const void *b) {
+    const trace_event_t *x = a, *y = b;
+    if (x->e.ts != y->e.ts) return x->e.ts < y->e.ts ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/**
+ * @brief Finds the entry of a thread address, numbering it on first sight.
+ *
+ * @param addr Descriptor address (not 0).
+ * @param created Whether the event creates the thread (starting a new incarnation).
+ * @return The entry.
+ */
+static trace_thread_t *thread_get(uint64_t addr, int created) {
+    size_t i = (addr >> 4) * 0x9e3779b97f4a7c15ull & threads_mask;
+    while (threads[i].addr && threads[i].addr != addr) i = (i + 1) & threads_mask;
+
+    trace_thread_t *t = &threads[i];
+    if (!t->addr || created) {
+        t->addr = addr;
+        t->id = next_id++;
+        t->state = T_NONE;
+        emit("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":2,\"tid\":%d,"
+             "\"args\":{\"name\":\"thread %d\"}}", t->id, t->id);
+    }
+    return t;
+}
+
+/**
+ * @brief Ends the state slice of a thread and starts another one.
+ *
+ * @param t Thread.
+ * @param state New state (T_NONE once it exits).
+ * @param now Time of the change.
+ */
+static void thread_set(trace_thread_t *t, int state, double now) {
+    if (t->state != T_NONE && now >= t->since)
+        emit("{\"name\":\"%s\",\"ph\":\"X\",\"pid\":2,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+             state_names[t->state], t->id, t->since, now - t->since);
+    t->state = state;
+    t->since = now;
+}
+
+/**
+ * @brief Reads a whole object from the dump.
+ *
+ * @return 0 on success, -1 at a premature end of file.
+ */
+static int read_all(FILE *in, void *buf, size_t len) {
+    return fread(buf, 1, len, in) == len ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    const char *in_path = argc > 1 ? argv[1] : "-";
+    const char *out_path = argc > 2 ? argv[2] : "-";
+
+    FILE *in = strcmp(in_path, "-") ? fopen(in_path, "rb") : stdin;
+    if (!in) {
+        perror(in_path);
+        return 1;
+    }
+
+    qtrace_header_t header;
+    if (read_all(in, &header, sizeof(header)) == -1 ||
+        memcmp(header.magic, QTRACE_MAGIC, sizeof(header.magic)) ||
+        header.event_size != sizeof(qtrace_event_t)) {
+        fprintf(stderr, "%s: not a qthread trace dump\n", in_path);
+        return 1;
+    }
+
+    // Gather the events of every worker
+    trace_event_t *events = NULL;
+    size_t n = 0;
+    for (uint32_t w = 0; w < header.workers; w++) {
+        qtrace_section_t section;
+        if (read_all(in, &section, sizeof(section)) == -1) goto truncated;
+        trace_event_t *grown = realloc(events, (n + section.count + 1) * sizeof(*events));
+        if (!grown) {
+            perror("realloc");
+            return 1;
+        }
+        events = grown;
+        for (uint64_t i = 0; i < section.count; i++, n++) {
+            if (read_all(in, &events[n].e, sizeof(qtrace_event_t)) == -1) goto truncated;
+            events[n].worker = section.worker;
+            events[n].seq = n;
+        }
+    }
+    if (in != stdin) fclose(in);
+    qsort(events, n, sizeof(*events), cmp_event);
+
+    out = strcmp(out_path, "-") ? fopen(out_path, "w") : stdout;
+    if (!out) {
+        perror(out_path);
+        return 1;
+    }
+
+    // Cycles to microseconds since tracing started
+    double us_per_cycle = 1e-3;
+    if (header.dump_cycles > header.start_cycles)
+        us_per_cycle = (double)(header.dump_ns - header.start_ns) /
+                       (double)(header.dump_cycles - header.start_cycles) / 1e3;
+
+    threads_mask = 64;
+    while (threads_mask < 2 * n) threads_mask <<= 1;
+    threads = calloc(threads_mask, sizeof(*threads));
+    threads_mask--;
+    trace_worker_t *workers = calloc(header.workers ? header.workers : 1, sizeof(*workers));
+    if (!threads || !workers) {
+        perror("calloc");
+        return 1;
+    }
+
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", out);
+    emit("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"workers\"}}");
+    emit("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,\"args\":{\"name\":\"threads\"}}");
+    for (uint32_t w = 0; w < header.workers; w++)
+        emit("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+             "\"args\":{\"name\":\"worker %u\"}}", w, w);
+
+    double now = 0;
+    for (size_t i = 0; i < n; i++) {
+        qtrace_event_t *e = &events[i].e;
+        uint32_t w = events[i].worker;
+        if (w >= header.workers) continue;
+        now = e->ts >= header.start_cycles ? (double)(e->ts - header.start_cycles) * us_per_cycle : 0;
+
+        trace_thread_t *t = e->thread ? thread_get(e->thread, e->type == QTRACE_CREATE) : NULL;
+        int by = 0;
+
+        switch (e->type) {
+        case QTRACE_CREATE:
+        case QTRACE_WAKE:
+            if (e->other) by = thread_get(e->other, 0)->id;
+            if (e->type == QTRACE_WAKE && t) thread_set(t, T_READY, now);
+            emit("{\"name\":\"%s thread %d\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,"
+                 "\"ts\":%.3f,\"args\":{\"by\":%d}}",
+                 e->type == QTRACE_CREATE ? "create" : "wake", t ? t->id : 0, w, now, by);
+            break;
+        case QTRACE_SWITCH:
+        case QTRACE_BLOCK:
+        case QTRACE_EXIT: {
+            const char *reason = e->type == QTRACE_BLOCK ? "block"
+                               : e->type == QTRACE_EXIT ? "exit"
+                               : e->flags & QTRACE_PREEMPTED ? "preempt" : "yield";
+            trace_worker_t *tw = &workers[w];
+            if (tw->id)
+                emit("{\"name\":\"thread %d\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,"
+                     "\"dur\":%.3f,\"args\":{\"end\":\"%s\"}}",
+                     tw->id, w, tw->since, now - tw->since, reason);
+            if (t)
+                thread_set(t, e->type == QTRACE_SWITCH ? T_READY
+                              : e->type == QTRACE_BLOCK ? T_BLOCKED : T_NONE, now);
+
+            trace_thread_t *next = e->other ? thread_get(e->other, 0) : NULL;
+            if (next) thread_set(next, T_RUNNING, now);
+            tw->id = next ? next->id : 0;
+            tw->since = now;
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    // Close what is still open at the last event
+    for (uint32_t w = 0; w < header.workers; w++)
+        if (workers[w].id)
+            emit("{\"name\":\"thread %d\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,"
+                 "\"dur\":%.3f}", workers[w].id, w, workers[w].since, now - workers[w].since);
+    for (size_t i = 0; i <= threads_mask; i++)
+        if (threads[i].addr) thread_set(&threads[i], T_NONE, now);
+
+    fputs("\n]}\n", out);
+    if (out != stdout) fclose(out);
+    free(threads);
+    free(workers);
+    free(events);
+    return 0;
+
+truncated:
+    fprintf(stderr, "%s: truncated trace dump\n", in_path);
+    return 1;
+}